@@ -27,6 +27,7 @@
 # define _XOPEN_SOURCE
 #endif
 #include <unistd.h>
+#include <sys/stat.h>
 #include <vpn.h>
 #include <c-ctype.h>
 #include "plain.h"
@@ -60,18 +61,79 @@ struct plain_ctx_st {
 	const struct plain_cfg_st *config;
 };
 
-static void plain_vhost_init(void **vctx, void *pool, void *additional)
+/* An entry of the passwd file */
+struct plain_entry_st {
+	char *username;
+	char *groups; /* the unparsed group list */
+	char *cpass;
+};
+
+/* The passwd file is loaded into a hash table indexed by username,
+ * which is rebuilt when the file is modified. */
+struct plain_vctx_st {
+	const struct plain_cfg_st *config;
+
+	void *db_pool; /* contains the entries of the index */
+	struct htable db;
+	unsigned db_loaded;
+
+	/* identifies the file version loaded */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+};
+
+static size_t rehash(const void *_e, void *unused)
 {
-	struct plain_cfg_st *config = additional;
+	const char *e = _e;
+	return hash_any(e, strlen(e), 0);
+}
+
+static size_t entry_rehash(const void *_e, void *unused)
+{
+	const struct plain_entry_st *e = _e;
+	return rehash(e->username, NULL);
+}
 
-	/* vctx is plain_cfg_st */
+static bool entry_cmp(const void* _c1, void* _c2)
+{
+	const struct plain_entry_st *c1 = _c1;
+	const char *c2 = _c2;
+
+	if (strcmp(c1->username, c2) == 0)
+		return 1;
+	return 0;
+}
+
+static void plain_vhost_deinit(void *_vctx)
+{
+	struct plain_vctx_st *vctx = _vctx;
+
+	if (vctx->db_loaded)
+		htable_clear(&vctx->db);
+	talloc_free(vctx->db_pool);
+	talloc_free(vctx);
+}
+
+static void plain_vhost_init(void **_vctx, void *pool, void *additional)
+{
+	struct plain_cfg_st *config = additional;
+	struct plain_vctx_st *vctx;
 
 	if (config == NULL) {
 		fprintf(stderr, "plain: no configuration passed!\n");
 		exit(1);
 	}
 
-	*vctx = (void*)config;
+	vctx = talloc_zero(pool, struct plain_vctx_st);
+	if (vctx == NULL) {
+		fprintf(stderr, "plain: memory error\n");
+		exit(1);
+	}
+
+	vctx->config = config;
+	*_vctx = vctx;
 
 #ifdef HAVE_LIBOATH
 	oath_init();
@@ -134,31 +196,86 @@ break_group_list(void *pool, char *text,
 	while (p != NULL && *elements < MAX_GROUPS);
 }
 
-/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
- */
-static int read_auth_pass(struct plain_ctx_st *pctx)
+/* Splits a line of the passwd file in its username, group list and
+ * password hash fields. Returns 0 if all fields are present. */
+static int split_passwd_line(char *line, char **username, char **groups, char **cpass)
+{
+	char *sp;
+
+#ifdef HAVE_STRSEP
+	sp = line;
+	*username = strsep(&sp, ":");
+	if (*username == NULL)
+		return -1;
+
+	*groups = strsep(&sp, ":");
+	if (*groups == NULL)
+		return -1;
+
+	*cpass = strsep(&sp, ":");
+	if (*cpass == NULL)
+		return -1;
+#else
+	*username = strtok_r(line, ":", &sp);
+	if (*username == NULL)
+		return -1;
+
+	*groups = strtok_r(NULL, ":", &sp);
+	if (*groups == NULL)
+		return -1;
+
+	*cpass = strtok_r(NULL, ":", &sp);
+	if (*cpass == NULL)
+		return -1;
+#endif
+	return 0;
+}
+
+/* Loads the passwd file into a new index, and replaces the current one
+ * on success. If the file is unchanged since the last load, the current
+ * index is kept. */
+static int load_passwd_db(struct plain_vctx_st *vctx)
 {
 	FILE *fp;
 	char line[512];
 	ssize_t ll;
-	char *p, *sp;
+	char *p, *username, *groups, *cpass;
+	struct plain_entry_st *entry;
+	struct htable db;
+	struct stat st;
+	void *db_pool;
+	size_t hval;
+	unsigned entries = 0;
 	int ret;
 
-	if (pctx->config->passwd == NULL) {
-		/* no password file is set */
-		return 0;
-	}
-
-	pctx->failed = 1;
-
-	fp = fopen(pctx->config->passwd, "r");
+	fp = fopen(vctx->config->passwd, "r");
 	if (fp == NULL) {
 		syslog(LOG_AUTH,
 		       "error in plain authentication; cannot open: %s",
-		       pctx->config->passwd);
+		       vctx->config->passwd);
 		return -1;
 	}
 
+	ret = fstat(fileno(fp), &st);
+	if (ret == -1) {
+		ret = -1;
+		goto exit;
+	}
+
+	if (vctx->db_loaded && st.st_dev == vctx->dev && st.st_ino == vctx->ino &&
+	    st.st_size == vctx->size && st.st_mtime == vctx->mtime) {
+		ret = 0;
+		goto exit;
+	}
+
+	db_pool = talloc_new(vctx);
+	if (db_pool == NULL) {
+		ret = -1;
+		goto exit;
+	}
+
+	htable_init(&db, entry_rehash, NULL);
+
 	line[sizeof(line)-1] = 0;
 	while ((p=fgets(line, sizeof(line)-1, fp)) != NULL) {
 		ll = strlen(p);
@@ -174,55 +291,95 @@ static int read_auth_pass(struct plain_ctx_st *pctx)
 			ll--;
 			line[ll] = 0;
 		}
-#ifdef HAVE_STRSEP
-		sp = line;
-		p = strsep(&sp, ":");
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strsep(&sp, ":");
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strsep(&sp, ":");
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
+		if (split_passwd_line(line, &username, &groups, &cpass) < 0)
+			continue;
 
-#else
-		p = strtok_r(line, ":", &sp);
+		/* the first entry of a user takes precedence */
+		hval = rehash(username, NULL);
+		if (htable_get(&db, hval, entry_cmp, username) != NULL)
+			continue;
 
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strtok_r(NULL, ":", &sp);
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strtok_r(NULL, ":", &sp);
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
-#endif
+		entry = talloc(db_pool, struct plain_entry_st);
+		if (entry == NULL)
+			goto fail;
+
+		entry->username = talloc_strdup(entry, username);
+		entry->groups = talloc_strdup(entry, groups);
+		entry->cpass = talloc_strdup(entry, cpass);
+		if (entry->username == NULL || entry->groups == NULL || entry->cpass == NULL)
+			goto fail;
+
+		if (htable_add(&db, hval, entry) == 0)
+			goto fail;
+		entries++;
 	}
 
-	/* always succeed */
+	/* replace the previous index */
+	if (vctx->db_loaded)
+		htable_clear(&vctx->db);
+	talloc_free(vctx->db_pool);
+
+	memcpy(&vctx->db, &db, sizeof(db));
+	vctx->db_pool = db_pool;
+	vctx->db_loaded = 1;
+
+	vctx->dev = st.st_dev;
+	vctx->ino = st.st_ino;
+	vctx->size = st.st_size;
+	vctx->mtime = st.st_mtime;
+
+	syslog(LOG_DEBUG, "plain-auth: loaded %u entries from %s",
+	       entries, vctx->config->passwd);
+
 	ret = 0;
+	goto exit;
+
+ fail:
+	syslog(LOG_AUTH,
+	       "plain-auth: memory error while loading %s",
+	       vctx->config->passwd);
+	htable_clear(&db);
+	talloc_free(db_pool);
+	ret = -1;
  exit:
 	safe_memset(line, 0, sizeof(line));
 	fclose(fp);
 	return ret;
 }
 
-static int plain_auth_init(void **ctx, void *pool, void *vctx, const common_auth_init_st *info)
+/* Returns 0 if the user is successfully authenticated, and sets the appropriate group name.
+ */
+static int read_auth_pass(struct plain_ctx_st *pctx, struct plain_vctx_st *vctx)
+{
+	struct plain_entry_st *entry;
+	int ret;
+
+	if (pctx->config->passwd == NULL) {
+		/* no password file is set */
+		return 0;
+	}
+
+	pctx->failed = 1;
+
+	ret = load_passwd_db(vctx);
+	if (ret < 0)
+		return -1;
+
+	entry = htable_get(&vctx->db, rehash(pctx->username, NULL), entry_cmp, pctx->username);
+	if (entry != NULL) {
+		break_group_list(pctx, entry->groups, pctx->groupnames, &pctx->groupnames_size);
+		strlcpy(pctx->cpass, entry->cpass, sizeof(pctx->cpass));
+		pctx->failed = 0;
+	}
+
+	/* always succeed */
+	return 0;
+}
+
+static int plain_auth_init(void **ctx, void *pool, void *_vctx, const common_auth_init_st *info)
 {
+	struct plain_vctx_st *vctx = _vctx;
 	struct plain_ctx_st *pctx;
 	int ret;
 
@@ -238,10 +395,10 @@ static int plain_auth_init(void **ctx, void *pool, void *vctx, const common_auth
 
 	strlcpy(pctx->username, info->username, sizeof(pctx->username));
 	pctx->pass_msg = NULL; /* use default */
-	pctx->config = vctx;
+	pctx->config = vctx->config;
 
 	/* this doesn't fail on password mismatch but sets p->failed */
-	ret = read_auth_pass(pctx);
+	ret = read_auth_pass(pctx, vctx);
 	if (ret < 0) {
 		talloc_free(pctx);
 		return ERR_AUTH_FAIL;
@@ -377,12 +534,6 @@ static void plain_auth_deinit(void *ctx)
 	talloc_free(ctx);
 }
 
-static size_t rehash(const void *_e, void *unused)
-{
-	const char *e = _e;
-	return hash_any(e, strlen(e), 0);
-}
-
 static bool str_cmp(const void* _c1, void* _c2)
 {
 	const char *c1 = _c1, *c2 = _c2;
@@ -485,6 +636,7 @@ const struct auth_mod_st plain_auth_funcs = {
 	.type = AUTH_TYPE_PLAIN | AUTH_TYPE_USERNAME_PASS,
 	.allows_retries = 1,
 	.vhost_init = plain_vhost_init,
+	.vhost_deinit = plain_vhost_deinit,
 	.auth_init = plain_auth_init,
 	.auth_deinit = plain_auth_deinit,
 	.auth_msg = plain_auth_msg,
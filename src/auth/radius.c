@@ -85,6 +85,13 @@ static void radius_vhost_init(void **_vctx, void *pool, void *additional)
 		fprintf(stderr, "error reading the radius dictionary\n");
 		exit(1);
 	}
+
+	vctx->config = talloc_strdup(vctx, config->config);
+	if (vctx->config == NULL)
+		goto fail;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_init(&vctx->lock, NULL);
+#endif
 	*_vctx = vctx;
 
 	return;
@@ -96,11 +103,63 @@ static void radius_vhost_init(void **_vctx, void *pool, void *additional)
 static void radius_vhost_deinit(void *_vctx)
 {
 	struct radius_vhost_ctx *vctx = _vctx;
+	unsigned i;
+
+	for (i=0;i<vctx->free_rh_size;i++)
+		rc_destroy(vctx->free_rh[i]);
+	vctx->free_rh_size = 0;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_destroy(&vctx->lock);
+#endif
 
 	if (vctx->rh != NULL)
 		rc_destroy(vctx->rh);
 }
 
+/* Returns a handle which is not used by any other request */
+static rc_handle *get_handle(struct radius_vhost_ctx *vctx)
+{
+#ifdef HAVE_LIBPTHREAD
+	rc_handle *rh = NULL;
+
+	pthread_mutex_lock(&vctx->lock);
+	if (vctx->free_rh_size > 0)
+		rh = vctx->free_rh[--vctx->free_rh_size];
+	pthread_mutex_unlock(&vctx->lock);
+
+	if (rh != NULL)
+		return rh;
+
+	rh = rc_read_config(vctx->config);
+	if (rh == NULL)
+		return NULL;
+
+	if (rc_read_dictionary(rh, rc_conf_str(rh, "dictionary")) != 0) {
+		rc_destroy(rh);
+		return NULL;
+	}
+
+	return rh;
+#else
+	return vctx->rh;
+#endif
+}
+
+static void put_handle(struct radius_vhost_ctx *vctx, rc_handle *rh)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&vctx->lock);
+	if (vctx->free_rh_size < MAX_SEC_MOD_THREADS) {
+		vctx->free_rh[vctx->free_rh_size++] = rh;
+		rh = NULL;
+	}
+	pthread_mutex_unlock(&vctx->lock);
+
+	if (rh != NULL)
+		rc_destroy(rh);
+#endif
+}
+
 static int radius_auth_init(void **ctx, void *pool, void *_vctx, const common_auth_init_st *info)
 {
 	struct radius_ctx_st *pctx;
@@ -251,18 +310,27 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	char route[72];
 	char txt[64];
 	VALUE_PAIR *vp;
+	rc_handle *rh;
 	int ret;
 
+	rh = get_handle(pctx->vctx);
+	if (rh == NULL) {
+		syslog(LOG_ERR,
+		       "%s:%u: error in reading the radius configuration", __func__, __LINE__);
+		return ERR_AUTH_FAIL;
+	}
+
 	/* send Access-Request */
 	syslog(LOG_DEBUG, "radius-auth: communicating username (%s) and password", pctx->username);
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_USER_NAME, pctx->username, -1, 0) == NULL) {
+	if (rc_avpair_add(rh, &send, PW_USER_NAME, pctx->username, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		return ERR_AUTH_FAIL;
+		ret = ERR_AUTH_FAIL;
+		goto cleanup;
 	}
 
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_USER_PASSWORD, (char*)pass, -1, 0) == NULL) {
+	if (rc_avpair_add(rh, &send, PW_USER_PASSWORD, (char*)pass, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
@@ -276,14 +344,14 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 
 		if (inet_pton(AF_INET, pctx->our_ip, &in) != 0) {
 			in.s_addr = ntohl(in.s_addr);
-			rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IP_ADDRESS, (char*)&in, sizeof(struct in_addr), 0);
+			rc_avpair_add(rh, &send, PW_NAS_IP_ADDRESS, (char*)&in, sizeof(struct in_addr), 0);
 		} else if (inet_pton(AF_INET6, pctx->our_ip, &in6) != 0) {
-			rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IPV6_ADDRESS, (char*)&in6, sizeof(struct in6_addr), 0);
+			rc_avpair_add(rh, &send, PW_NAS_IPV6_ADDRESS, (char*)&in6, sizeof(struct in6_addr), 0);
 		}
 	}
 
 	if (pctx->vctx->nas_identifier[0] != 0) {
-		if (rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IDENTIFIER, pctx->vctx->nas_identifier, -1, 0) == NULL) {
+		if (rc_avpair_add(rh, &send, PW_NAS_IDENTIFIER, pctx->vctx->nas_identifier, -1, 0) == NULL) {
 			syslog(LOG_ERR,
 			       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 			       pctx->username);
@@ -292,7 +360,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		}
 	}
 
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_CALLING_STATION_ID, pctx->remote_ip, -1, 0) == NULL) {
+	if (rc_avpair_add(rh, &send, PW_CALLING_STATION_ID, pctx->remote_ip, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
@@ -301,7 +369,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
 	if (pctx->user_agent[0] != 0) {
-		if (rc_avpair_add(pctx->vctx->rh, &send, PW_CONNECT_INFO, pctx->user_agent, -1, 0) == NULL) {
+		if (rc_avpair_add(rh, &send, PW_CONNECT_INFO, pctx->user_agent, -1, 0) == NULL) {
 			syslog(LOG_ERR,
 			       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 			       pctx->username);
@@ -311,7 +379,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
 	service = PW_AUTHENTICATE_ONLY;
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_SERVICE_TYPE, &service, -1, 0) == NULL) {
+	if (rc_avpair_add(rh, &send, PW_SERVICE_TYPE, &service, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
@@ -320,7 +388,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
 	service = PW_ASYNC;
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_PORT_TYPE, &service, -1, 0) == NULL) {
+	if (rc_avpair_add(rh, &send, PW_NAS_PORT_TYPE, &service, -1, 0) == NULL) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
@@ -329,7 +397,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
 	pctx->pass_msg[0] = 0;
-	ret = rc_aaa(pctx->vctx->rh, pctx->id, send, &recvd, pctx->pass_msg, 1, PW_ACCESS_REQUEST);
+	ret = rc_aaa(rh, pctx->id, send, &recvd, pctx->pass_msg, 1, PW_ACCESS_REQUEST);
 
 	if (ret == OK_RC) {
 		uint32_t ipv4;
@@ -440,6 +508,7 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		rc_avpair_free(send);
 	if (recvd != NULL)
 		rc_avpair_free(recvd);
+	put_handle(pctx->vctx, rh);
 	return ret;
 }
 
@@ -463,6 +532,7 @@ static void radius_auth_deinit(void *ctx)
 const struct auth_mod_st radius_auth_funcs = {
 	.type = AUTH_TYPE_RADIUS | AUTH_TYPE_USERNAME_PASS,
 	.allows_retries = 1,
+	.may_block = 1,
 	.vhost_init = radius_vhost_init,
 	.vhost_deinit = radius_vhost_deinit,
 	.auth_init = radius_auth_init,
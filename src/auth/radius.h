@@ -31,9 +31,23 @@
 #   include <radcli/radcli.h>
 #  endif
 
+#  ifdef HAVE_LIBPTHREAD
+#   include <pthread.h>
+#  endif
+
 struct radius_vhost_ctx {
 	rc_handle *rh;
 	char nas_identifier[64];
+
+	/* radcli handles are not thread-safe; as authentication may run
+	 * on the sec-mod threads, each request uses a handle of its own
+	 * which is kept here for reuse. */
+	char *config;
+#  ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t lock;
+#  endif
+	rc_handle *free_rh[MAX_SEC_MOD_THREADS];
+	unsigned free_rh_size;
 };
 
 struct radius_ctx_st {
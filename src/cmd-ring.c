@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <cmd-ring.h>
+
+#ifdef ENABLE_CMD_RING
+# include <sys/eventfd.h>
+
+int cmd_ring_new(struct cmd_ring_st **ring, int *efd)
+{
+	struct cmd_ring_st *r;
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	/* main is not reading the ring until the first wakeup */
+	r->waiting = 1;
+
+	*ring = r;
+	*efd = fd;
+	return 0;
+}
+
+void cmd_ring_free(struct cmd_ring_st *ring, int efd)
+{
+	if (ring != NULL)
+		munmap(ring, sizeof(*ring));
+	if (efd != -1)
+		close(efd);
+}
+
+int cmd_ring_put(struct cmd_ring_st *ring, int efd, const struct cmd_ring_msg_st *msg)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	int ret;
+
+	if (head - tail >= CMD_RING_SIZE)
+		return -1;
+
+	memcpy(&ring->msgs[head & (CMD_RING_SIZE-1)], msg, sizeof(*msg));
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in cmd_ring_sleep(); either main sees the
+	 * new head, or we see that it is waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)) {
+		do {
+			ret = write(efd, &one, sizeof(one));
+		} while (ret == -1 && errno == EINTR);
+	}
+
+	return 0;
+}
+
+int cmd_ring_get(struct cmd_ring_st *ring, uint32_t *tail, struct cmd_ring_msg_st *msg)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == *tail)
+		return 0;
+
+	if (head - *tail > CMD_RING_SIZE)
+		return -1;
+
+	/* copy first, so that the worker cannot modify what we validate */
+	memcpy(msg, &ring->msgs[*tail & (CMD_RING_SIZE-1)], sizeof(*msg));
+	(*tail)++;
+	__atomic_store_n(&ring->tail, *tail, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int cmd_ring_sleep(struct cmd_ring_st *ring, int efd, uint32_t tail)
+{
+	uint64_t v;
+	int ret;
+
+	do {
+		ret = read(efd, &v, sizeof(v));
+	} while (ret == -1 && errno == EINTR);
+
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) != tail;
+}
+
+void cmd_ring_wakeup(int efd)
+{
+	uint64_t one = 1;
+	int ret;
+
+	do {
+		ret = write(efd, &one, sizeof(one));
+	} while (ret == -1 && errno == EINTR);
+}
+
+#else
+
+int cmd_ring_new(struct cmd_ring_st **ring, int *efd)
+{
+	return -1;
+}
+
+void cmd_ring_free(struct cmd_ring_st *ring, int efd)
+{
+}
+
+int cmd_ring_put(struct cmd_ring_st *ring, int efd, const struct cmd_ring_msg_st *msg)
+{
+	return -1;
+}
+
+int cmd_ring_get(struct cmd_ring_st *ring, uint32_t *tail, struct cmd_ring_msg_st *msg)
+{
+	return 0;
+}
+
+int cmd_ring_sleep(struct cmd_ring_st *ring, int efd, uint32_t tail)
+{
+	return 0;
+}
+
+void cmd_ring_wakeup(int efd)
+{
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CMD_RING_H
+# define CMD_RING_H
+
+#include <config.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+# define ENABLE_CMD_RING 1
+#endif
+
+/* A single-producer single-consumer ring in a shared anonymous mapping,
+ * which carries the frequent worker to main messages (CMD_TUN_MTU and
+ * CMD_COMP_STATS) in a fixed binary layout. The worker is the producer
+ * and main the consumer; main is woken up through an eventfd, which is
+ * written only when main has declared that it is about to sleep.
+ *
+ * The mapping is writable by the worker, so main treats everything it
+ * reads from it as untrusted input; it keeps its consumer index in its
+ * own memory, and only publishes it in the ring for the worker.
+ */
+#define CMD_RING_SIZE 64 /* must be a power of two */
+
+struct cmd_ring_msg_st {
+	uint32_t cmd;
+	union {
+		uint32_t mtu;	/* CMD_TUN_MTU */
+		struct {	/* CMD_COMP_STATS */
+			uint64_t attempted;
+			uint64_t skipped;
+			uint64_t saved_bytes;
+		} comp;
+	} m;
+};
+
+struct cmd_ring_st {
+	uint32_t head __attribute__((aligned(64))); /* written by the worker */
+	uint32_t tail __attribute__((aligned(64))); /* written by main, never read by it */
+	uint32_t waiting __attribute__((aligned(64))); /* main expects a wakeup */
+	struct cmd_ring_msg_st msgs[CMD_RING_SIZE];
+};
+
+/* Creates a ring and its eventfd; returns -1 if unsupported */
+int cmd_ring_new(struct cmd_ring_st **ring, int *efd);
+void cmd_ring_free(struct cmd_ring_st *ring, int efd);
+
+/* Worker side: returns -1 when the ring is full, in which case the
+ * message should be sent over the command socket. */
+int cmd_ring_put(struct cmd_ring_st *ring, int efd, const struct cmd_ring_msg_st *msg);
+
+/* Main side: returns 1 and copies the next message to @msg, zero
+ * if the ring is empty, or -1 if the worker corrupted the indices.
+ * @tail is main's private consumer index, initially zero. */
+int cmd_ring_get(struct cmd_ring_st *ring, uint32_t *tail, struct cmd_ring_msg_st *msg);
+
+/* Main side: clears the eventfd and declares that the ring is about to
+ * be waited on. Returns non-zero if messages arrived in the meantime,
+ * in which case they must be read before waiting. */
+int cmd_ring_sleep(struct cmd_ring_st *ring, int efd, uint32_t tail);
+
+/* Main side: signals the eventfd, so that main is woken up again for
+ * the messages it left in the ring. */
+void cmd_ring_wakeup(int efd);
+
+#endif
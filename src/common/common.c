@@ -119,6 +119,18 @@ const char *cmd_request_to_str(unsigned _cmd)
 		return "ban IP";
 	case CMD_BAN_IP_REPLY:
 		return "ban IP reply";
+	case CMD_WORKER_START:
+		return "worker start";
+	case CMD_COMP_STATS:
+		return "compression stats";
+	case CMD_SCRIPT_JOB:
+		return "script job";
+	case CMD_SCRIPT_RESULT:
+		return "script result";
+	case CMD_SCRIPT_RUNNER_CONFIG:
+		return "script runner config";
+	case CMD_SCRIPT_CANCEL:
+		return "script cancel";
 
 	case CMD_SEC_CLI_STATS:
 		return "sm: worker cli stats";
@@ -495,6 +495,7 @@ static void apply_default_conf(vhost_cfg_st *vhost, unsigned reload)
 
 	vhost->perm_config.config->mobile_idle_timeout = (unsigned)-1;
 	vhost->perm_config.config->no_compress_limit = DEFAULT_NO_COMPRESS_LIMIT;
+	vhost->perm_config.config->adaptive_compression = 1;
 	vhost->perm_config.config->rekey_time = 24*60*60;
 	vhost->perm_config.config->cookie_timeout = DEFAULT_COOKIE_RECON_TIMEOUT;
 	vhost->perm_config.config->auth_timeout = DEFAULT_AUTH_TIMEOUT_SECS;
@@ -511,6 +512,7 @@ static void apply_default_conf(vhost_cfg_st *vhost, unsigned reload)
 	vhost->perm_config.config->use_utmp = 1;
 	vhost->perm_config.config->keepalive = 3600;
 	vhost->perm_config.config->dpd = 60;
+	vhost->perm_config.config->script_max_concurrency = 32;
 
 }
 
@@ -730,6 +732,9 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		} else if (strcmp(name, "udp-port") == 0) {
 			if (!PWARN_ON_VHOST(vhost->name, "udp-port", udp_port))
 				READ_NUMERIC(vhost->perm_config.udp_port);
+		} else if (strcmp(name, "tls-session-cache-size") == 0) {
+			if (!PWARN_ON_VHOST(vhost->name, "tls-session-cache-size", tls_session_cache_size))
+				READ_NUMERIC(vhost->perm_config.tls_session_cache_size);
 		} else if (strcmp(name, "run-as-user") == 0) {
 			if (!PWARN_ON_VHOST(vhost->name, "run-as-user", uid)) {
 				const struct passwd* pwd = getpwnam(value);
@@ -770,6 +775,9 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		} else if (strcmp(name, "occtl-socket-file") == 0) {
 			if (!PWARN_ON_VHOST_STRDUP(vhost->name, "occtl-socket-file", occtl_socket_file))
 				PREAD_STRING(pool, vhost->perm_config.occtl_socket_file);
+		} else if (strcmp(name, "metrics-socket-file") == 0) {
+			if (!PWARN_ON_VHOST_STRDUP(vhost->name, "metrics-socket-file", metrics_socket_file))
+				PREAD_STRING(pool, vhost->perm_config.metrics_socket_file);
 		} else if (strcmp(name, "chroot-dir") == 0) {
 			if (!PWARN_ON_VHOST_STRDUP(vhost->name, "chroot-dir", chroot_dir))
 				PREAD_STRING(pool, vhost->perm_config.chroot_dir);
@@ -844,6 +852,12 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "disconnect-script") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "disconnect-script", disconnect_script))
 			READ_STRING(config->disconnect_script);
+	} else if (strcmp(name, "script-max-concurrency") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "script-max-concurrency", script_max_concurrency))
+			READ_NUMERIC(config->script_max_concurrency);
+	} else if (strcmp(name, "script-queue-size") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "script-queue-size", script_queue_size))
+			READ_NUMERIC(config->script_queue_size);
 	} else if (strcmp(name, "session-control") == 0) {
 		fprintf(stderr, WARNSTR"the option 'session-control' is deprecated\n");
 	} else if (strcmp(name, "banner") == 0) {
@@ -873,6 +887,8 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		}
 	} else if (strcmp(name, "no-compress-limit") == 0) {
 		READ_NUMERIC(config->no_compress_limit);
+	} else if (strcmp(name, "adaptive-compression") == 0) {
+		READ_TF(config->adaptive_compression);
 	} else if (strcmp(name, "use-seccomp") == 0) {
 		READ_TF(config->isolate);
 		if (config->isolate)
@@ -900,6 +916,15 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "ping-leases") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "ping_leases", ping_leases))
 			READ_TF(config->ping_leases);
+	} else if (strcmp(name, "worker-pool-size") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "worker-pool-size", worker_pool_size))
+			READ_NUMERIC(config->worker_pool_size);
+	} else if (strcmp(name, "worker-cmd-ring") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "worker-cmd-ring", worker_cmd_ring))
+			READ_TF(config->worker_cmd_ring);
+	} else if (strcmp(name, "sec-mod-threads") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "sec-mod-threads", sec_mod_threads))
+			READ_NUMERIC(config->sec_mod_threads);
 	} else if (strcmp(name, "restrict-user-to-routes") == 0) {
 		READ_TF(config->restrict_user_to_routes);
 	} else if (strcmp(name, "restrict-user-to-ports") == 0) {
@@ -916,6 +941,12 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		READ_PRIO_TOS(config->net_priority);
 	} else if (strcmp(name, "output-buffer") == 0) {
 		READ_NUMERIC(config->output_buffer);
+	} else if (strcmp(name, "tun-batch-size") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "tun-batch-size", tun_batch_size))
+			READ_NUMERIC(config->tun_batch_size);
+	} else if (strcmp(name, "tun-offload") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "tun-offload", tun_offload))
+			READ_TF(config->tun_offload);
 	} else if (strcmp(name, "rx-data-per-sec") == 0) {
 		READ_NUMERIC(config->rx_per_sec);
 		config->rx_per_sec /= 1000; /* in kb */
@@ -1045,6 +1076,9 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "route-del-cmd") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "route-del-cmd", route_del_cmd))
 			READ_STRING(config->route_del_cmd);
+	} else if (strcmp(name, "route-netlink") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "route-netlink", route_netlink))
+			READ_TF(config->route_netlink);
 	} else if (strcmp(name, "config-per-user") == 0) {
 		READ_STRING(config->per_user_dir);
 	} else if (strcmp(name, "config-per-group") == 0) {
@@ -1150,6 +1184,8 @@ static void parse_cfg_file(void *pool, const char *file, struct list_head *head,
 			PREFIX_VHOST(vhost),
 			sup_config_name(vhost->perm_config.sup_config_type));
 	}
+
+	vhost_index_build(head);
 }
 
 
@@ -1329,6 +1365,51 @@ static void check_cfg(vhost_cfg_st *vhost, vhost_cfg_st *defvhost, unsigned sile
 	if (config->no_compress_limit < MIN_NO_COMPRESS_LIMIT)
 		config->no_compress_limit = MIN_NO_COMPRESS_LIMIT;
 
+	if (config->tun_batch_size == 0)
+		config->tun_batch_size = 1;
+
+	if (config->tun_batch_size > MAX_TUN_BATCH_SIZE) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'tun-batch-size' was limited to %u\n", PREFIX_VHOST(vhost), MAX_TUN_BATCH_SIZE);
+		config->tun_batch_size = MAX_TUN_BATCH_SIZE;
+	}
+
+	if (config->worker_pool_size > MAX_WORKER_POOL_SIZE) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'worker-pool-size' was limited to %u\n", PREFIX_VHOST(vhost), MAX_WORKER_POOL_SIZE);
+		config->worker_pool_size = MAX_WORKER_POOL_SIZE;
+	}
+
+	if (config->sec_mod_threads > MAX_SEC_MOD_THREADS) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'sec-mod-threads' was limited to %u\n", PREFIX_VHOST(vhost), MAX_SEC_MOD_THREADS);
+		config->sec_mod_threads = MAX_SEC_MOD_THREADS;
+	}
+
+#if !defined(HAVE_LIBPTHREAD)
+	if (config->sec_mod_threads != 0) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'sec-mod-threads' is set, but not compiled with pthread support\n", PREFIX_VHOST(vhost));
+		config->sec_mod_threads = 0;
+	}
+#endif
+
+#if !defined(__linux__) || !defined(HAVE_LINUX_VIRTIO_NET_H)
+	if (config->tun_offload != 0) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'tun-offload' is not supported on this system\n", PREFIX_VHOST(vhost));
+		config->tun_offload = 0;
+	}
+#endif
+
+#if !defined(__linux__)
+	if (config->route_netlink != 0) {
+		if (!silent)
+			fprintf(stderr, WARNSTR"%s'route-netlink' is not supported on this system\n", PREFIX_VHOST(vhost));
+		config->route_netlink = 0;
+	}
+#endif
+
 #if !defined(HAVE_LIBSECCOMP)
 	if (config->isolate != 0 && !silent) {
 		fprintf(stderr, ERRSTR"%s'isolate-workers' is set to true, but not compiled with seccomp or Linux namespaces support\n", PREFIX_VHOST(vhost));
@@ -1524,6 +1605,12 @@ void clear_vhosts(struct list_head *head)
 		/* we rely on talloc freeing recursively */
 		talloc_free(vhost->perm_config.config);
 		vhost->perm_config.config = NULL;
+
+		if (vhost->name_index) {
+			htable_clear(vhost->name_index);
+			talloc_free(vhost->name_index);
+			vhost->name_index = NULL;
+		}
 	}
 
 	return;
@@ -73,6 +73,14 @@ typedef enum {
 	CMD_SESSION_INFO = 13,
 	CMD_BAN_IP = 16,
 	CMD_BAN_IP_REPLY = 17,
+	CMD_WORKER_START = 18,
+	CMD_COMP_STATS = 19,
+
+	/* between main and the script runner */
+	CMD_SCRIPT_JOB = 20,
+	CMD_SCRIPT_RESULT = 21,
+	CMD_SCRIPT_RUNNER_CONFIG = 22,
+	CMD_SCRIPT_CANCEL = 23,
 
 	/* from worker to sec-mod */
 	CMD_SEC_AUTH_INIT = 120,
@@ -116,6 +124,8 @@ typedef enum {
 #define ERR_PEER_TERMINATED -11
 #define ERR_CTL -12
 #define ERR_NO_CMD_FD -13
+#define ERR_WAIT_FOR_PING -14
+#define ERR_WAIT_FOR_THREAD -15
 
 #define ERR_WORKER_TERMINATED ERR_PEER_TERMINATED
 
@@ -79,14 +79,15 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
-#include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
 #include <gnutls/crypto.h>
 #include <icmp-ping.h>
-#include <poll.h>
+#include <ip-lease.h>
+#include <ip-util.h>
+#include <cloexec.h>
 
 #ifndef ICMP_DEST_UNREACH
 # ifdef ICMP_UNREACH
@@ -113,6 +114,27 @@ enum {
 	PINGINTERVAL = 1,	/* 1 second */
 };
 
+/* The probes of all clients are sent and received over two long-lived
+ * raw sockets, watched by the main event loop. The session setup of a
+ * client is suspended while its lease is being probed, and is resumed
+ * via resume_accept_user() once a reply is received or the probe
+ * times out.
+ */
+struct ping_probe_st {
+	/* must be first so that this structure can behave as ev_timer */
+	ev_timer timer;
+
+	struct list_node list;
+
+	struct proc_st *proc;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint16_t id;
+};
+
+/* the maximum number of ICMP packets read on a single wakeup */
+#define MAX_PING_READS 64
+
 /* common routines */
 
 static int in_cksum(unsigned short *buf, int sz)
@@ -138,211 +160,266 @@ static int in_cksum(unsigned short *buf, int sz)
 	return ans;
 }
 
-inline static int retry(int e)
-{
-	if (e == EAGAIN || e == EWOULDBLOCK || e == EINTR)
-		return 1;
-	else
-		return 0;
-}
-
 #define PING_TIMEOUT 3
 
-static
-ssize_t recvfrom_timeout(int sockfd, void *buf, size_t len, int flags,
-			 struct sockaddr *src_addr, socklen_t * addrlen)
+static void ping_probe_done(main_server_st *s, struct ping_probe_st *probe,
+			    unsigned in_use)
 {
+	struct proc_st *proc = probe->proc;
+	int family = probe->addr.ss_family;
+	char buf1[64];
 	int ret;
-    struct pollfd pfd;
 
-    pfd.fd = sockfd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+	mslog(s, proc, LOG_INFO,
+	      "pinged %s and is %s",
+	      human_addr((void *) &probe->addr, probe->addr_len,
+			 buf1, sizeof(buf1)),
+	      in_use?"in use":"not in use");
 
-    ret = poll(&pfd, 1, 250);
-	if (ret == -1)
-		return -1;
-	else if (ret > 0)
-		return recvfrom(sockfd, buf, len, 0, src_addr, addrlen);
-	else
-		return -1;
+	/* detaches from proc */
+	talloc_free(probe);
 
+	if (in_use)
+		ip_lease_set_in_use(s, proc, family);
 
+	ret = resume_accept_user(s, proc);
+	if (ret < 0) {
+		/* takes care of free */
+		remove_proc(s, proc, RPROC_KILL);
+	}
 }
 
-int icmp_ping4(main_server_st * s, struct sockaddr_in *addr1)
+static void ping_timeout_cb(struct ev_loop *loop, ev_timer *w, int revents)
 {
-	struct icmp *pkt;
-	int pingsock, c, e;
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	char buf1[64];
-	time_t now;
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
+	main_server_st *s = ev_userdata(loop);
 
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
+	ping_probe_done(s, (struct ping_probe_st *)w, 0);
+}
 
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+static void ping_reply(main_server_st *s, struct sockaddr_storage *from,
+		       socklen_t from_len, uint16_t id, unsigned in_use)
+{
+	struct ping_probe_st *probe = NULL, *pos;
 
-	pingsock = socket(AF_INET, SOCK_RAW, 1);
-	if (pingsock == -1) {
-		e = errno;
-		mslog(s, NULL, LOG_INFO,
-		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+	list_for_each_safe(&s->ping_list.head, probe, pos, list) {
+		if (probe->id == id && probe->addr_len == from_len &&
+		    ip_cmp(&probe->addr, from) == 0) {
+			ping_probe_done(s, probe, in_use);
+			return;
+		}
 	}
+}
 
-	pkt = (struct icmp *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp_type = ICMP_ECHO;
-	pkt->icmp_id = id1;
-	pkt->icmp_cksum =
-	    in_cksum((unsigned short *) pkt, sizeof(packet1));
-
-	while ((c = sendto(pingsock, packet1, DEFDATALEN + ICMP_MINLEN, 0,
-			   (struct sockaddr *) addr1,
-			   sizeof(*addr1)) == -1) && retry(errno));
-	/* listen for replies */
-
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in from;
+static void ping4_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct icmp *pkt;
+	unsigned i;
+	int c;
+
+	for (i = 0; i < MAX_PING_READS; i++) {
+		struct sockaddr_storage from;
 		socklen_t fromlen = sizeof(from);
 
-		c = recvfrom_timeout(pingsock, packet1, sizeof(packet1), 0,
-				     (struct sockaddr *) &from, &fromlen);
+		c = recvfrom(w->fd, packet1, sizeof(packet1), 0,
+			     (struct sockaddr *) &from, &fromlen);
+		if (c < 0)
+			break;
 
-		if (c < 0) {
+		if (c < 76 || fromlen != sizeof(struct sockaddr_in))
 			continue;
-		} else if (c >= 76 && fromlen == sizeof(struct sockaddr_in)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN_P(&from), SA_IN_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
 
 #ifdef HAVE_STRUCT_IPHDR_IHL
-				struct iphdr *iphdr =
-				    (struct iphdr *) packet1;
-				pkt = (struct icmp *) (packet1 + (iphdr->ihl << 2));	/* skip ip hdr */
+		pkt = (struct icmp *) (packet1 + (((struct iphdr *) packet1)->ihl << 2));	/* skip ip hdr */
 #else
-				pkt = (struct icmp *) (packet1 + ((packet1[0] & 0x0f) << 2));	/* skip ip hdr */
+		pkt = (struct icmp *) (packet1 + ((packet1[0] & 0x0f) << 2));	/* skip ip hdr */
 #endif
-				if (pkt->icmp_id == id1) {
-					if (pkt->icmp_type == ICMP_ECHOREPLY)
-						gotreply++;
-					else if (pkt->icmp_type == ICMP_DEST_UNREACH)
-						unreachable++;
-                                }
-			}
-		}
+		if (pkt->icmp_type == ICMP_ECHOREPLY)
+			ping_reply(s, &from, fromlen, pkt->icmp_id, 1);
+		else if (pkt->icmp_type == ICMP_DEST_UNREACH)
+			ping_reply(s, &from, fromlen, pkt->icmp_id, 0);
 	}
+}
 
-	close(pingsock);
+static void ping6_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct icmp6_hdr *pkt;
+	unsigned i;
+	int c;
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return gotreply;
-	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return 0;
+	for (i = 0; i < MAX_PING_READS; i++) {
+		struct sockaddr_storage from;
+		socklen_t fromlen = sizeof(from);
+
+		c = recvfrom(w->fd, packet1, sizeof(packet1), 0,
+			     (struct sockaddr *) &from, &fromlen);
+		if (c < 0)
+			break;
+
+		if (c < 8 || fromlen != sizeof(struct sockaddr_in6))
+			continue;
+
+		pkt = (struct icmp6_hdr *) packet1;
+		if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
+			ping_reply(s, &from, fromlen, pkt->icmp6_id, 1);
+		else if (pkt->icmp6_type == ICMP6_DST_UNREACH)
+			ping_reply(s, &from, fromlen, pkt->icmp6_id, 0);
 	}
 }
 
-int icmp_ping6(main_server_st * s,
-	       struct sockaddr_in6 *addr1)
+static int open_ping_socket(main_server_st *s, int family)
 {
-	struct icmp6_hdr *pkt;
-	char buf1[64];
-	int pingsock, c, e;
-#if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
-	int sockopt;
-#endif
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
-	time_t now;
+	int fd, e;
 
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
-
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+	if (family == AF_INET) {
+		if (s->ping_list.fd4 != -1)
+			return s->ping_list.fd4;
+		fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+	} else {
+		if (s->ping_list.fd6 != -1)
+			return s->ping_list.fd6;
+		fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	}
 
-	pingsock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-	if (pingsock == -1) {
+	if (fd == -1) {
 		e = errno;
 		mslog(s, NULL, LOG_INFO,
 		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+		return -1;
 	}
 
-	pkt = (struct icmp6_hdr *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp6_type = ICMP6_ECHO_REQUEST;
-	pkt->icmp6_id = id1;
+	set_non_block(fd);
+	set_cloexec_flag(fd, 1);
 
+	if (family == AF_INET) {
+		s->ping_list.fd4 = fd;
+		ev_io_init(&s->ping_list.io4, ping4_watcher_cb, fd, EV_READ);
+		ev_io_start(loop, &s->ping_list.io4);
+	} else {
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
-	sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
-	setsockopt(pingsock, SOL_RAW, IPV6_CHECKSUM,
-		   &sockopt, sizeof(sockopt));
+		int sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
+		setsockopt(fd, SOL_RAW, IPV6_CHECKSUM,
+			   &sockopt, sizeof(sockopt));
 #endif
-	while ((c =
-		sendto(pingsock, packet1,
-		       DEFDATALEN + sizeof(struct icmp6_hdr), 0,
-		       (struct sockaddr *) addr1,
-		       sizeof(*addr1)) == -1) && retry(errno));
-
-	/* listen for replies */
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in6 from;
-		socklen_t fromlen = sizeof(from);
-		c = recvfrom_timeout(pingsock, packet1,
-				     sizeof(packet1), 0,
-				     (struct sockaddr *)
-				     &from, &fromlen);
-		if (c < 0) {
-			continue;
-		} else if (c >= 8 && fromlen == sizeof(struct sockaddr_in6)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN6_P(&from), SA_IN6_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
-
-				pkt = (struct icmp6_hdr *) packet1;
-				if (pkt->icmp6_id == id1) {
-					if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
-						gotreply++;
-					else if (pkt->icmp6_type == ICMP6_DST_UNREACH)
-						unreachable++;
-				}
-			}
+#ifdef ICMP6_FILTER
+		{
+			struct icmp6_filter filter;
+
+			/* we are only interested in the replies to our probes */
+			ICMP6_FILTER_SETBLOCKALL(&filter);
+			ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+			ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+			setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER,
+				   &filter, sizeof(filter));
 		}
+#endif
+		s->ping_list.fd6 = fd;
+		ev_io_init(&s->ping_list.io6, ping6_watcher_cb, fd, EV_READ);
+		ev_io_start(loop, &s->ping_list.io6);
 	}
 
-	close(pingsock);
+	return fd;
+}
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return gotreply;
+static int ping_probe_destructor(struct ping_probe_st *probe)
+{
+	ev_timer_stop(loop, &probe->timer);
+	list_del(&probe->list);
+	probe->proc->ping = NULL;
+	return 0;
+}
+
+int icmp_ping_start(main_server_st *s, struct proc_st *proc,
+		    struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	struct ping_probe_st *probe;
+	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	size_t packet_size;
+	int pingsock, c, e;
+
+	if (proc->ping != NULL)
+		return -1;
+
+	pingsock = open_ping_socket(s, addr->ss_family);
+	if (pingsock == -1)
+		return -1;
+
+	probe = talloc_zero(proc, struct ping_probe_st);
+	if (probe == NULL)
+		return -1;
+
+	probe->proc = proc;
+	memcpy(&probe->addr, addr, addr_len);
+	probe->addr_len = addr_len;
+	gnutls_rnd(GNUTLS_RND_NONCE, &probe->id, sizeof(probe->id));
+
+	memset(packet1, 0, sizeof(packet1));
+	if (addr->ss_family == AF_INET) {
+		struct icmp *pkt = (struct icmp *) packet1;
+
+		pkt->icmp_type = ICMP_ECHO;
+		pkt->icmp_id = probe->id;
+		pkt->icmp_cksum =
+		    in_cksum((unsigned short *) pkt, sizeof(packet1));
+		packet_size = DEFDATALEN + ICMP_MINLEN;
 	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return 0;
+		struct icmp6_hdr *pkt = (struct icmp6_hdr *) packet1;
+
+		pkt->icmp6_type = ICMP6_ECHO_REQUEST;
+		pkt->icmp6_id = probe->id;
+		packet_size = DEFDATALEN + sizeof(struct icmp6_hdr);
+	}
+
+	do {
+		c = sendto(pingsock, packet1, packet_size, 0,
+			   (struct sockaddr *) addr, addr_len);
+	} while (c == -1 && errno == EINTR);
+
+	if (c == -1) {
+		e = errno;
+		mslog(s, proc, LOG_INFO,
+		      "could not send ping: %s", strerror(e));
+		talloc_free(probe);
+		return -1;
+	}
+
+	ev_timer_init(&probe->timer, ping_timeout_cb, PING_TIMEOUT, 0);
+	ev_timer_start(loop, &probe->timer);
+
+	list_add(&s->ping_list.head, &probe->list);
+	proc->ping = probe;
+	talloc_set_destructor(probe, ping_probe_destructor);
+
+	return 0;
+}
+
+void icmp_ping_init(main_server_st *s)
+{
+	list_head_init(&s->ping_list.head);
+	s->ping_list.fd4 = -1;
+	s->ping_list.fd6 = -1;
+}
+
+void icmp_ping_deinit(main_server_st *s)
+{
+	struct ping_probe_st *probe = NULL, *pos;
+
+	list_for_each_safe(&s->ping_list.head, probe, pos, list) {
+		talloc_free(probe);
+	}
+
+	if (s->ping_list.fd4 != -1) {
+		ev_io_stop(loop, &s->ping_list.io4);
+		close(s->ping_list.fd4);
+		s->ping_list.fd4 = -1;
+	}
+
+	if (s->ping_list.fd6 != -1) {
+		ev_io_stop(loop, &s->ping_list.io6);
+		close(s->ping_list.fd6);
+		s->ping_list.fd6 = -1;
 	}
 }
@@ -23,9 +23,14 @@
 
 #include <main.h>
 
-/* returns the number of positive replies received or
- * 0 if no host with this IP exists. */
-int icmp_ping4(main_server_st* s, struct sockaddr_in* addr1);
-int icmp_ping6(main_server_st* s, struct sockaddr_in6* addr1);
+void icmp_ping_init(main_server_st* s);
+void icmp_ping_deinit(main_server_st* s);
+
+/* Sends an ICMP echo request to the provided address of the client's lease.
+ * Returns zero if the probe was sent; resume_accept_user() is called once
+ * it completes. Otherwise a negative number is returned, and the address
+ * should be used unprobed. */
+int icmp_ping_start(main_server_st* s, struct proc_st* proc,
+		    struct sockaddr_storage* addr, socklen_t addr_len);
 
 #endif
@@ -21,6 +21,7 @@
 #include <stdio.h>
 
 #include <ip-lease.h>
+#include <ip-pool.h>
 #include <main.h>
 #include <ip-util.h>
 #include <gnutls/crypto.h>
@@ -52,6 +53,7 @@ void ip_lease_deinit(struct ip_lease_db_st* db)
 {
 struct ip_lease_st * cache;
 struct htable_iter iter;
+struct ip_pool_st *p, *pos;
 
 	cache = htable_first(&db->ht, &iter);
 	while(cache != NULL) {
@@ -62,7 +64,12 @@ struct htable_iter iter;
 		cache = htable_next(&db->ht, &iter);
 	}
 	htable_clear(&db->ht);
-	
+
+	list_for_each_safe(&db->pools, p, pos, list) {
+		list_del(&p->list);
+		talloc_free(p);
+	}
+
 	return;
 }
 
@@ -76,6 +83,7 @@ const struct ip_lease_st * e = _e;
 void ip_lease_init(struct ip_lease_db_st* db)
 {
 	htable_init(&db->ht, rehash, NULL);
+	list_head_init(&db->pools);
 }
 
 static bool ip_lease_cmp(const void* _c1, void* _c2)
@@ -103,6 +111,62 @@ struct ip_lease_st t;
 	return 0;
 }
 
+static int lease_pool_index(struct ip_pool_st *p, struct ip_lease_st *lease, uint32_t *idx)
+{
+	if (p->family == AF_INET && lease->sig_len == sizeof(struct sockaddr_in))
+		return ip_pool_index(p, SA_IN_U8_P(&lease->sig), idx);
+	if (p->family == AF_INET6 && lease->sig_len == sizeof(struct sockaddr_in6))
+		return ip_pool_index(p, SA_IN6_U8_P(&lease->sig), idx);
+	return -1;
+}
+
+/* Updates the bitmaps of all the networks which contain the lease;
+ * the networks of different groups may overlap. */
+static void mark_ip_lease(struct ip_lease_db_st *db, struct ip_lease_st *lease, unsigned used)
+{
+	struct ip_pool_st *p;
+	uint32_t idx;
+
+	list_for_each(&db->pools, p, list) {
+		if (lease_pool_index(p, lease, &idx) == 0)
+			ip_pool_mark(p, idx, used);
+	}
+}
+
+/* Returns the bitmap of the network, or NULL if the network is too
+ * large to be tracked. The bitmap is created on first use from the
+ * leases which are already in the hash table. */
+static struct ip_pool_st *get_ip_pool(main_server_st *s, int family, const uint8_t *network,
+				      unsigned prefix, unsigned subnet_prefix)
+{
+	struct ip_pool_st *p;
+	struct ip_lease_st *lease;
+	struct htable_iter iter;
+	unsigned len = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	uint32_t idx;
+
+	list_for_each(&s->ip_leases.pools, p, list) {
+		if (p->family == family && p->prefix == prefix &&
+		    p->subnet_prefix == subnet_prefix &&
+		    memcmp(p->network, network, len) == 0)
+			return p;
+	}
+
+	p = ip_pool_new(s, family, network, prefix, subnet_prefix);
+	if (p == NULL)
+		return NULL;
+
+	lease = htable_first(&s->ip_leases.ht, &iter);
+	while (lease != NULL) {
+		if (lease_pool_index(p, lease, &idx) == 0)
+			ip_pool_mark(p, idx, 1);
+		lease = htable_next(&s->ip_leases.ht, &iter);
+	}
+
+	list_add_tail(&s->ip_leases.pools, &p->list);
+	return p;
+}
+
 void steal_ip_leases(struct proc_st* proc, struct proc_st *thief)
 {
 	/* here we reset the old tun device, and assign the old addresses
@@ -158,10 +222,13 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 
 	struct sockaddr_storage tmp, mask, network, rnd;
 	unsigned i;
-	unsigned max_loops = MAX_IP_TRIES;
+	unsigned max_loops;
 	int ret;
 	const char *c_network, *c_netmask;
 	char buf[64];
+	struct ip_pool_st *pool = NULL;
+	uint32_t m, idx;
+	unsigned prefix;
 
 	/* Our IP accounting */
 	if (proc->config->ipv4_net && proc->config->ipv4_netmask) {
@@ -241,18 +308,39 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 	}
 
 	/* assign "random" IP */
-	proc->ipv4 = talloc_zero(proc, struct ip_lease_st);
-	if (proc->ipv4 == NULL)
-		return ERR_MEM;
-	proc->ipv4->db = &s->ip_leases;
+	memset(&rnd, 0, sizeof(rnd));
+	((struct sockaddr_in*)&rnd)->sin_family = AF_INET;
+	((struct sockaddr_in*)&rnd)->sin_port = 0;
+
+	if (proc->ipv4 == NULL) {
+		proc->ipv4 = talloc_zero(proc, struct ip_lease_st);
+		if (proc->ipv4 == NULL)
+			return ERR_MEM;
+		proc->ipv4->db = &s->ip_leases;
+	} else {
+		/* the previously selected IP was found in use; continue
+		 * from it */
+		memcpy(&rnd, &proc->ipv4->rip, sizeof(struct sockaddr_in));
+		proc->ipv4->in_use = 0;
+	}
+	max_loops = MAX_IP_TRIES - proc->ipv4->tries;
 
        	memcpy(&tmp, &network, sizeof(tmp));
      	((struct sockaddr_in*)&tmp)->sin_family = AF_INET;
 	((struct sockaddr_in*)&tmp)->sin_port = 0;
 
-	memset(&rnd, 0, sizeof(rnd));
-	((struct sockaddr_in*)&rnd)->sin_family = AF_INET;
-	((struct sockaddr_in*)&rnd)->sin_port = 0;
+	/* non-contiguous netmasks are left to random probing */
+	memcpy(&m, SA_IN_U8_P(&mask), sizeof(m));
+	m = ntohl(m);
+	for (prefix=0;prefix<32 && (m & (0x80000000U >> prefix));prefix++);
+	if (prefix == 32 || (m << prefix) == 0)
+		pool = get_ip_pool(s, AF_INET, SA_IN_U8_P(&network), prefix, 32);
+
+	if (pool && pool->used >= pool->size) {
+		mslog(s, proc, LOG_ERR, "the IPv4 network %s/%u is exhausted", c_network, prefix);
+		ret = ERR_NO_IP;
+		goto fail;
+	}
 
 	do {
 		if (max_loops == 0) {
@@ -263,7 +351,15 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 		if (max_loops == MAX_IP_TRIES) {
 			memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
 		} else {
-			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
+			if (pool && max_loops < MAX_IP_TRIES-FIXED_IPS) {
+				/* the seeded addresses are taken; use the next free one */
+				if (ip_pool_next(pool, &idx) < 0) {
+					mslog(s, proc, LOG_ERR, "the IPv4 network %s/%u is exhausted", c_network, prefix);
+					ret = ERR_NO_IP;
+					goto fail;
+				}
+				ip_pool_addr(pool, idx, SA_IN_U8_P(&rnd));
+			} else if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
 				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in_addr));
 			} else {
 				ip_from_seed(SA_IN_U8_P(&rnd), sizeof(struct in_addr),
@@ -304,11 +400,11 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
-
-       		if (icmp_ping4(s, (void*)&proc->ipv4->rip) == 0)
-       			break;
+		break;
 	} while(1);
 
+	proc->ipv4->tries = MAX_IP_TRIES - max_loops;
+
 	return 0;
 
 fail:
@@ -323,11 +419,13 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd, subnet_mask;
-	unsigned i, max_loops = MAX_IP_TRIES;
+	unsigned i, max_loops;
 	const char* c_network = NULL;
 	unsigned prefix, subnet_prefix ;
 	int ret;
 	char buf[64];
+	struct ip_pool_st *pool;
+	uint32_t idx;
 
 	if (proc->config->ipv6_net && proc->config->ipv6_subnet_prefix) {
 		c_network = proc->config->ipv6_net;
@@ -402,15 +500,28 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 	}
 
 	/* assign "random" IP */
-	proc->ipv6 = talloc_zero(proc, struct ip_lease_st);
-	if (proc->ipv6 == NULL)
-		return ERR_MEM;
-	proc->ipv6->db = &s->ip_leases;
+	if (proc->ipv6 == NULL) {
+		proc->ipv6 = talloc_zero(proc, struct ip_lease_st);
+		if (proc->ipv6 == NULL)
+			return ERR_MEM;
+		proc->ipv6->db = &s->ip_leases;
+	} else {
+		/* the previously selected IP was found in use */
+		proc->ipv6->in_use = 0;
+	}
+	max_loops = MAX_IP_TRIES - proc->ipv6->tries;
 
   	memcpy(&tmp, &network, sizeof(tmp));
        	((struct sockaddr_in6*)&tmp)->sin6_family = AF_INET6;
        	((struct sockaddr_in6*)&tmp)->sin6_port = 0;
 
+	pool = get_ip_pool(s, AF_INET6, SA_IN6_U8_P(&network), prefix, subnet_prefix);
+	if (pool && pool->used >= pool->size) {
+		mslog(s, proc, LOG_ERR, "the IPv6 network %s/%u is exhausted", c_network, prefix);
+		ret = ERR_NO_IP;
+		goto fail;
+	}
+
 	do {
 		if (max_loops == 0) {
 			mslog(s, NULL, LOG_ERR, "could not figure out a valid IPv6 IP");
@@ -425,7 +536,16 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 			ip_from_seed(proc->ipv4_seed, 4,
 				     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
 		} else {
-			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
+			if (pool && max_loops < MAX_IP_TRIES-FIXED_IPS) {
+				/* the seeded subnets are taken; use the next free one */
+				if (ip_pool_next(pool, &idx) < 0) {
+					mslog(s, proc, LOG_ERR, "the IPv6 network %s/%u is exhausted", c_network, prefix);
+					ret = ERR_NO_IP;
+					goto fail;
+				}
+				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
+				ip_pool_addr(pool, idx, SA_IN6_U8_P(&rnd));
+			} else if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
 				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in6_addr));
 			} else {
 				ip_from_seed(SA_IN6_U8_P(&rnd), sizeof(struct in6_addr),
@@ -461,11 +581,11 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
-
-        	if (proc->ipv6->prefix != 128 || icmp_ping6(s, (void*)&proc->ipv6->rip) == 0)
-        		break;
+		break;
         } while(1);
 
+	proc->ipv6->tries = MAX_IP_TRIES - max_loops;
+
  finish:
 	/* LIP = network address + 1 */
 	memcpy(&proc->ipv6->lip, &network, sizeof(struct sockaddr_in6));
@@ -489,17 +609,44 @@ int unref_ip_lease(struct ip_lease_st *lease)
 {
 	if (lease->db) {
 		htable_del(&lease->db->ht, rehash(lease, NULL), lease);
+		mark_ip_lease(lease->db, lease, 0);
 	}
 
 	return 0;
 }
 
+/* Marks the lease of the given family as used by another host, as
+ * found by its ICMP probe. The address is released and a new one is
+ * selected on the next call to get_ip_leases().
+ */
+void ip_lease_set_in_use(main_server_st *s, struct proc_st *proc, int family)
+{
+	struct ip_lease_st *lease;
+
+	if (family == AF_INET)
+		lease = proc->ipv4;
+	else
+		lease = proc->ipv6;
+
+	if (lease == NULL || lease->db == NULL)
+		return;
+
+	talloc_set_destructor(lease, NULL);
+	unref_ip_lease(lease);
+	lease->in_use = 1;
+}
+
+/* Obtains the IPv4 and IPv6 leases of the client. When ping-leases
+ * is set, it returns ERR_WAIT_FOR_PING after a lease is selected, and
+ * it must be called again once its probe has completed (the leases
+ * obtained so far are kept in @proc).
+ */
 int get_ip_leases(main_server_st *s, struct proc_st *proc)
 {
 int ret;
 char buf[128];
 
-	if (proc->ipv4 == NULL) {
+	if (proc->ipv4 == NULL || proc->ipv4->in_use) {
 		ret = get_ipv4_lease(s, proc);
 		if (ret < 0)
 			return ret;
@@ -510,10 +657,15 @@ char buf[128];
 				return -1;
 			}
 			talloc_set_destructor(proc->ipv4, unref_ip_lease);
+			mark_ip_lease(&s->ip_leases, proc->ipv4, 1);
+
+			if (GETCONFIG(s)->ping_leases &&
+			    icmp_ping_start(s, proc, &proc->ipv4->rip, proc->ipv4->rip_len) == 0)
+				return ERR_WAIT_FOR_PING;
 		}
 	}
 
-	if (proc->ipv6 == NULL) {
+	if (proc->ipv6 == NULL || proc->ipv6->in_use) {
 		ret = get_ipv6_lease(s, proc);
 		if (ret < 0)
 			return ret;
@@ -524,6 +676,12 @@ char buf[128];
 				return -1;
 			}
 			talloc_set_destructor(proc->ipv6, unref_ip_lease);
+			mark_ip_lease(&s->ip_leases, proc->ipv6, 1);
+
+			/* only single addresses are probed */
+			if (GETCONFIG(s)->ping_leases && proc->ipv6->prefix == 128 &&
+			    icmp_ping_start(s, proc, &proc->ipv6->rip, proc->ipv6->rip_len) == 0)
+				return ERR_WAIT_FOR_PING;
 		}
 	}
 
@@ -40,6 +40,9 @@ struct ip_lease_st {
         socklen_t lip_len;
         unsigned prefix; /* in ipv6 */
 
+        unsigned tries; /* the number of addresses tried */
+        unsigned in_use; /* the ICMP probe found the address in use */
+
         struct ip_lease_db_st* db;
 };
 
@@ -51,5 +54,6 @@ void steal_ip_leases(struct proc_st* proc, struct proc_st *thief);
 int get_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_lease(main_server_st* s, struct ip_lease_st * lease);
+void ip_lease_set_in_use(main_server_st* s, struct proc_st* proc, int family);
 
 #endif
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <talloc.h>
+#include <ip-pool.h>
+
+/* A bitmap of the leases of a network. It is used to find a free
+ * address once the seeded addresses of a client are taken; the search
+ * is next-fit, scanning a word of the bitmap at a time, and thus
+ * allocation only fails when the network is exhausted. The bitmap
+ * tracks the leases of the main process hash table, which remains
+ * authoritative.
+ */
+
+#define BIT(b) (0x80 >> ((b) % 8))
+
+static uint32_t get_bits(const uint8_t *addr, unsigned start, unsigned n)
+{
+	uint32_t v = 0;
+	unsigned i, b;
+
+	for (i=0;i<n;i++) {
+		b = start + i;
+		v = (v << 1) | ((addr[b/8] & BIT(b)) ? 1 : 0);
+	}
+	return v;
+}
+
+static void set_bits(uint8_t *addr, unsigned start, unsigned n, uint32_t v)
+{
+	unsigned i, b;
+
+	for (i=n;i>0;i--) {
+		b = start + i - 1;
+		if (v & 1)
+			addr[b/8] |= BIT(b);
+		else
+			addr[b/8] &= ~BIT(b);
+		v >>= 1;
+	}
+}
+
+/* The network address, the local address of the tun device (network
+ * address + 1) and in IPv4 the broadcast address cannot be leased. */
+static unsigned is_reserved(const struct ip_pool_st *p, uint32_t idx)
+{
+	if (idx == 0)
+		return 1;
+
+	if (p->family == AF_INET)
+		return (idx == 1 || idx == p->size - 1);
+
+	return (idx == 1 && p->subnet_prefix == 128);
+}
+
+struct ip_pool_st *ip_pool_new(void *pool, int family, const uint8_t *network,
+			       unsigned prefix, unsigned subnet_prefix)
+{
+	struct ip_pool_st *p;
+	unsigned addr_bits = (family == AF_INET) ? 32 : 128;
+	unsigned words, i;
+
+	if (prefix > subnet_prefix || subnet_prefix > addr_bits ||
+	    subnet_prefix - prefix > IP_POOL_MAX_BITS)
+		return NULL;
+
+	p = talloc_zero(pool, struct ip_pool_st);
+	if (p == NULL)
+		return NULL;
+
+	p->family = family;
+	memcpy(p->network, network, addr_bits / 8);
+	p->prefix = prefix;
+	p->subnet_prefix = subnet_prefix;
+	p->size = (uint32_t)1 << (subnet_prefix - prefix);
+
+	words = (p->size + 63) / 64;
+	p->map = talloc_zero_array(p, uint64_t, words);
+	if (p->map == NULL) {
+		talloc_free(p);
+		return NULL;
+	}
+
+	/* the padding of the last word is never available */
+	for (i=p->size;i<words*64;i++)
+		p->map[i/64] |= (uint64_t)1 << (i % 64);
+
+	for (i=0;i<p->size;i++) {
+		if (i == 2)
+			i = p->size - 1;
+		if (is_reserved(p, i))
+			ip_pool_mark(p, i, 1);
+	}
+	p->reserved = p->used;
+
+	return p;
+}
+
+int ip_pool_index(const struct ip_pool_st *p, const uint8_t *addr, uint32_t *idx)
+{
+	unsigned full = p->prefix / 8;
+	unsigned rem = p->prefix % 8;
+	uint8_t mask;
+
+	if (memcmp(addr, p->network, full) != 0)
+		return -1;
+
+	if (rem) {
+		mask = 0xff << (8 - rem);
+		if ((addr[full] & mask) != (p->network[full] & mask))
+			return -1;
+	}
+
+	*idx = get_bits(addr, p->prefix, p->subnet_prefix - p->prefix);
+	return 0;
+}
+
+void ip_pool_addr(const struct ip_pool_st *p, uint32_t idx, uint8_t *addr)
+{
+	unsigned full = p->prefix / 8;
+	unsigned rem = p->prefix % 8;
+	uint8_t mask;
+
+	memcpy(addr, p->network, full);
+	if (rem) {
+		mask = 0xff << (8 - rem);
+		addr[full] = (addr[full] & ~mask) | (p->network[full] & mask);
+	}
+
+	set_bits(addr, p->prefix, p->subnet_prefix - p->prefix, idx);
+}
+
+unsigned ip_pool_is_used(const struct ip_pool_st *p, uint32_t idx)
+{
+	if (idx >= p->size)
+		return 1;
+
+	return (p->map[idx/64] >> (idx % 64)) & 1;
+}
+
+void ip_pool_mark(struct ip_pool_st *p, uint32_t idx, unsigned used)
+{
+	uint64_t bit = (uint64_t)1 << (idx % 64);
+
+	if (idx >= p->size)
+		return;
+
+	if (used) {
+		if (!(p->map[idx/64] & bit)) {
+			p->map[idx/64] |= bit;
+			p->used++;
+		}
+	} else if ((p->map[idx/64] & bit) && !is_reserved(p, idx)) {
+		p->map[idx/64] &= ~bit;
+		p->used--;
+	}
+}
+
+int ip_pool_next(struct ip_pool_st *p, uint32_t *idx)
+{
+	uint32_t words = (p->size + 63) / 64;
+	uint32_t w, i;
+	uint64_t avail;
+	unsigned b;
+
+	if (p->used >= p->size)
+		return -1;
+
+	w = p->cursor / 64;
+	/* the extra iteration covers the bits of the first word
+	 * which precede the cursor */
+	for (i=0;i<=words;i++) {
+		avail = ~p->map[w];
+		if (i == 0)
+			avail &= ~(uint64_t)0 << (p->cursor % 64);
+
+		if (avail) {
+			for (b=0;!(avail & ((uint64_t)1 << b));b++);
+
+			*idx = w * 64 + b;
+			p->cursor = (*idx + 1) % p->size;
+			return 0;
+		}
+		w = (w + 1) % words;
+	}
+
+	return -1;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IP_POOL_H
+# define IP_POOL_H
+
+#include <stdint.h>
+#include <ccan/list/list.h>
+
+/* Networks with more leases than 2^IP_POOL_MAX_BITS are not tracked
+ * with a bitmap; for them random probing is sufficient. */
+#define IP_POOL_MAX_BITS 24
+
+struct ip_pool_st {
+	struct list_node list;
+
+	int family;
+	uint8_t network[16];
+	unsigned prefix; /* the prefix of the network */
+	unsigned subnet_prefix; /* the prefix of each lease; 32 in IPv4 */
+
+	uint64_t *map; /* a bit per lease, set when used or reserved */
+	uint32_t size; /* the number of leases in the network */
+	uint32_t used; /* the number of set bits */
+	uint32_t reserved; /* the bits which are never available */
+	uint32_t cursor; /* where the next-fit search starts */
+};
+
+/* Returns NULL if the network is too large to be tracked */
+struct ip_pool_st *ip_pool_new(void *pool, int family, const uint8_t *network,
+			       unsigned prefix, unsigned subnet_prefix);
+
+/* Returns zero and sets @idx if @addr is within the pool's network */
+int ip_pool_index(const struct ip_pool_st *p, const uint8_t *addr, uint32_t *idx);
+
+/* Replaces the network and lease bits of @addr with those of @idx */
+void ip_pool_addr(const struct ip_pool_st *p, uint32_t idx, uint8_t *addr);
+
+void ip_pool_mark(struct ip_pool_st *p, uint32_t idx, unsigned used);
+unsigned ip_pool_is_used(const struct ip_pool_st *p, uint32_t idx);
+
+/* Finds the next free lease after the previously returned one.
+ * Returns -1 if the pool is exhausted. */
+int ip_pool_next(struct ip_pool_st *p, uint32_t *idx);
+
+#endif
@@ -163,11 +163,25 @@ struct oc_packed_uint16_t {
 	uint16_t d;
 } __attribute__((packed));
 
+/*
+ * This is theoretically a hash. But RAM is cheap and just loading the
+ * 16-bit value and using it as a hash is *much* faster.
+ */
+#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
+
+/*
+ * We use INVALID_OFS (0xffff) for none in the hash table since we know
+ * IP packets are limited to 64KiB and we can never be *starting* a match
+ * at the penultimate byte of the packet.
+ */
+#define INVALID_OFS 0xffff
+
 /*
  * Much of the compression algorithm used here is based very loosely on ideas
  * from isdn_lzscomp.c by Andre Beck: http://micky.ibh.de/~beck/stuff/lzs4i4l/
  */
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+static int _lzs_compress(uint16_t *hash_table, unsigned char *dst, int dstlen,
+			 const unsigned char *src, int srclen)
 {
 	int length, offset;
 	int inpos = 0, outpos = 0;
@@ -177,26 +191,12 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 	uint32_t outbits = 0;
 	int nr_outbits = 0;
 
-	/*
-	 * This is theoretically a hash. But RAM is cheap and just loading the
-	 * 16-bit value and using it as a hash is *much* faster.
-	 */
-#define HASH_BITS 16
-#define HASH_TABLE_SIZE (1ULL << HASH_BITS)
-#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
-
 	/*
 	 * There are two data structures for tracking the history. The first
-	 * is the true hash table, an array indexed by the hash value described
-	 * above. It yields the offset in the input buffer at which the given
-	 * hash was most recently seen. We use INVALID_OFS (0xffff) for none
-	 * since we know IP packets are limited to 64KiB and we can never be
-	 * *starting* a match at the penultimate byte of the packet.
-	 */
-#define INVALID_OFS 0xffff
-	uint16_t hash_table[HASH_TABLE_SIZE]; /* Buffer offset for first match */
-
-	/*
+	 * is the true hash table (see lzs_ctx_st), an array indexed by the
+	 * first two bytes at each offset. It yields the offset in the input
+	 * buffer at which the given hash was most recently seen.
+	 *
 	 * The second data structure allows us to find the previous occurrences
 	 * of the same hash value. It is a ring buffer containing links only for
 	 * the latest MAX_HISTORY bytes of the input. The lookup for a given
@@ -206,14 +206,9 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 #define MAX_HISTORY (1<<11) /* Highest offset LZS can represent is 11 bits */
 	uint16_t hash_chain[MAX_HISTORY];
 
-	/* Just in case anyone tries to use this in a more general-purpose
-	 * scenario... */
-	if (srclen > INVALID_OFS + 1)
-		return -EFBIG;
-
 	/* No need to initialise hash_chain since we can only ever follow
-	 * links to it that have already been initialised. */
-	memset(hash_table, 0xff, sizeof(hash_table));
+	 * links to it that have already been initialised. The hash_table
+	 * is left clean by the previous call (see lzs_compress_ctx()). */
 
 	while (inpos < srclen - 2) {
 		hash = HASH(src + inpos);
@@ -331,3 +326,48 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 
 	return outpos;
 }
+
+/* Above that packet size clearing the whole hash table is faster than
+ * resetting the entries the packet may have set */
+#define LZS_RESET_LIMIT 4096
+
+/*
+ * Compresses using the provided context. Rather than clearing the
+ * whole 128KiB hash table for every packet, only the entries which
+ * may have been set by this packet are reset on return; that is
+ * proportional to the packet size. Large packets clear the table.
+ */
+int lzs_compress_ctx(lzs_ctx_st *ctx, unsigned char *dst, int dstlen,
+		     const unsigned char *src, int srclen)
+{
+	int ret, i;
+
+	/* Just in case anyone tries to use this in a more general-purpose
+	 * scenario... */
+	if (srclen > INVALID_OFS + 1)
+		return -EFBIG;
+
+	if (!ctx->initialized) {
+		memset(ctx->hash_table, 0xff, sizeof(ctx->hash_table));
+		ctx->initialized = 1;
+	}
+
+	ret = _lzs_compress(ctx->hash_table, dst, dstlen, src, srclen);
+
+	if (srclen > LZS_RESET_LIMIT) {
+		memset(ctx->hash_table, 0xff, sizeof(ctx->hash_table));
+	} else {
+		for (i = 0; i < srclen - 2; i++)
+			ctx->hash_table[HASH(src + i)] = INVALID_OFS;
+	}
+
+	return ret;
+}
+
+/* A worker process serves a single session; use a per-process context */
+int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+{
+	static lzs_ctx_st ctx;
+
+	return lzs_compress_ctx(&ctx, dst, dstlen, src, srclen);
+}
@@ -15,5 +15,22 @@
  * Lesser General Public License for more details.
  */
 
+#ifndef LZS_H
+#define LZS_H
+
+#include <stdint.h>
+
+#define LZS_HASH_TABLE_SIZE (1 << 16)
+
+/* Compressor state which is reused across packets */
+typedef struct lzs_ctx_st {
+	uint16_t hash_table[LZS_HASH_TABLE_SIZE]; /* Buffer offset for first match */
+	unsigned initialized;
+} lzs_ctx_st;
+
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
 int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
+int lzs_compress_ctx(lzs_ctx_st *ctx, unsigned char *dst, int dstlen,
+		     const unsigned char *src, int srclen);
+
+#endif
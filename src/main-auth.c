@@ -237,7 +237,7 @@ struct proc_st *old_proc;
  */
 int check_multiple_users(main_server_st *s, struct proc_st* proc)
 {
-struct proc_st *ctmp = NULL, *cpos;
+struct user_sessions_st *u;
 unsigned int entries = 1; /* that one */
 unsigned max;
 
@@ -246,17 +246,16 @@ unsigned max;
 	if (max == 0)
 		return 0;
 
-	list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
-		if (ctmp != proc && ctmp->pid != -1) {
-			if (strcmp(proc->username, ctmp->username) == 0) {
-				entries++;
-
-				if (entries > max)
-					return -1;
-			}
-		}
+	u = proc_search_user(s, proc->username);
+	if (u != NULL) {
+		entries += u->sessions;
+		if (proc->user_sessions == u)
+			entries--;
 	}
 
+	if (entries > max)
+		return -1;
+
 	return 0;
 }
 
@@ -63,6 +63,101 @@ static bool ban_entry_cmp(const void *_c1, void *_c2)
 	return 0;
 }
 
+/* The entries are kept in a binary min-heap ordered by their cleanup
+ * time, so that cleanup_banned_entries() only visits the entries which
+ * can be removed, rather than the whole hash table. */
+static void heap_set(main_server_st *s, unsigned idx, ban_entry_st *e)
+{
+	s->ban_heap[idx] = e;
+	e->heap_idx = idx;
+}
+
+static void heap_sift_up(main_server_st *s, unsigned idx)
+{
+	ban_entry_st *e = s->ban_heap[idx];
+	unsigned parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (s->ban_heap[parent]->cleanup_time <= e->cleanup_time)
+			break;
+		heap_set(s, idx, s->ban_heap[parent]);
+		idx = parent;
+	}
+	heap_set(s, idx, e);
+}
+
+static void heap_sift_down(main_server_st *s, unsigned idx)
+{
+	ban_entry_st *e = s->ban_heap[idx];
+	unsigned child;
+
+	for (;;) {
+		child = 2 * idx + 1;
+		if (child >= s->ban_heap_size)
+			break;
+		if (child + 1 < s->ban_heap_size &&
+		    s->ban_heap[child + 1]->cleanup_time < s->ban_heap[child]->cleanup_time)
+			child++;
+		if (e->cleanup_time <= s->ban_heap[child]->cleanup_time)
+			break;
+		heap_set(s, idx, s->ban_heap[child]);
+		idx = child;
+	}
+	heap_set(s, idx, e);
+}
+
+static int heap_add(main_server_st *s, ban_entry_st *e)
+{
+	ban_entry_st **heap;
+	unsigned max;
+
+	if (s->ban_heap_size >= s->ban_heap_max) {
+		max = s->ban_heap_max ? s->ban_heap_max * 2 : 64;
+		heap = talloc_realloc(s, s->ban_heap, ban_entry_st *, max);
+		if (heap == NULL)
+			return -1;
+		s->ban_heap = heap;
+		s->ban_heap_max = max;
+	}
+
+	heap_set(s, s->ban_heap_size++, e);
+	heap_sift_up(s, e->heap_idx);
+	return 0;
+}
+
+static void heap_remove(main_server_st *s, ban_entry_st *e)
+{
+	unsigned idx = e->heap_idx;
+	ban_entry_st *last;
+
+	s->ban_heap_size--;
+	if (idx == s->ban_heap_size)
+		return;
+
+	last = s->ban_heap[s->ban_heap_size];
+	heap_set(s, idx, last);
+	if (last->cleanup_time < e->cleanup_time)
+		heap_sift_up(s, idx);
+	else
+		heap_sift_down(s, idx);
+}
+
+/* The entry can be removed once it has expired and its score
+ * counting period is over (see cleanup_banned_entries()). */
+static void update_cleanup_time(main_server_st *s, ban_entry_st *e)
+{
+	time_t old = e->cleanup_time;
+
+	e->cleanup_time = e->last_reset + GETCONFIG(s)->ban_reset_time + 1;
+	if (e->expires > e->cleanup_time)
+		e->cleanup_time = e->expires;
+
+	if (e->cleanup_time < old)
+		heap_sift_up(s, e->heap_idx);
+	else if (e->cleanup_time > old)
+		heap_sift_down(s, e->heap_idx);
+}
 
 void *main_ban_db_init(main_server_st *s)
 {
@@ -86,6 +181,10 @@ struct htable *db = s->ban_db;
 		htable_clear(db);
 		talloc_free(db);
 	}
+
+	talloc_free(s->ban_heap);
+	s->ban_heap = NULL;
+	s->ban_heap_size = s->ban_heap_max = 0;
 }
 
 unsigned main_ban_db_elems(main_server_st *s)
@@ -138,9 +237,16 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 		memcpy(&e->ip, &t.ip, sizeof(e->ip));
 		e->last_reset = now;
 
+		if (heap_add(s, e) < 0) {
+			mslog(s, NULL, LOG_INFO,
+			       "could not add ban entry to heap");
+			goto fail;
+		}
+
 		if (htable_add(db, rehash(e, NULL), e) == 0) {
 			mslog(s, NULL, LOG_INFO,
 			       "could not add ban entry to hash table");
+			heap_remove(s, e);
 			goto fail;
 		}
 	} else {
@@ -160,6 +266,8 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 		print_msg = 1;
 	e->score += score;
 
+	update_cleanup_time(s, e);
+
 	if (ip_size == 4)
 		p_str_ip = inet_ntop(AF_INET, ip, str_ip, sizeof(str_ip));
 	else
@@ -235,6 +343,7 @@ int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size)
 		if (e != NULL) { /* new entry */
 			e->score = 0;
 			e->expires = 0;
+			update_cleanup_time(s, e);
 			return 1;
 		}
 	}
@@ -286,20 +395,23 @@ void cleanup_banned_entries(main_server_st *s)
 {
 	struct htable *db = s->ban_db;
 	ban_entry_st *t;
-	struct htable_iter iter;
 	time_t now = time(0);
 
 	if (db == NULL)
 		return;
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
+	while (s->ban_heap_size > 0) {
+		t = s->ban_heap[0];
+		if (t->cleanup_time > now)
+			break;
+
 		if (now >= t->expires && now > t->last_reset + GETCONFIG(s)->ban_reset_time) {
-			htable_delval(db, &iter);
+			heap_remove(s, t);
+			htable_del(db, rehash(t, NULL), t);
 			talloc_free(t);
+		} else {
+			/* ban-reset-time was increased on reload */
+			update_cleanup_time(s, t);
 		}
-		t = htable_next(db, &iter);
-
 	}
 }
-
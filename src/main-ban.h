@@ -34,6 +34,9 @@ typedef struct ban_entry_st {
 
 	time_t last_reset; /* the time its score counting started */
 	time_t expires; /* the time after the client is allowed to login */
+
+	time_t cleanup_time; /* the time after the entry can be removed */
+	unsigned heap_idx; /* the position in s->ban_heap */
 } ban_entry_st;
 
 void cleanup_banned_entries(main_server_st *s);
@@ -30,11 +30,15 @@
 #include <vpn.h>
 #include <cloexec.h>
 #include <ip-lease.h>
+#include <ip-pool.h>
+#include <ip-util.h>
+#include <arpa/inet.h>
 
 #include <errno.h>
 #include <system.h>
 #include <main-ctl.h>
 #include <main-ban.h>
+#include <proc-search.h>
 #include <ccan/container_of/container_of.h>
 
 #include <ctl.pb-c.h>
@@ -69,6 +73,8 @@ static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
 			   unsigned msg_size);
 static void method_list_cookies(method_ctx *ctx, int cfd, uint8_t * msg,
 			   unsigned msg_size);
+static void method_list_page(method_ctx *ctx, int cfd, uint8_t * msg,
+			     unsigned msg_size);
 
 typedef void (*method_func) (method_ctx *ctx, int cfd, uint8_t * msg,
 			     unsigned msg_size);
@@ -92,6 +98,7 @@ static const ctl_method_st methods[] = {
 	ENTRY(CTL_CMD_RELOAD, method_reload),
 	ENTRY(CTL_CMD_STOP, method_stop),
 	ENTRY(CTL_CMD_LIST, method_list_users),
+	ENTRY_INDEF(CTL_CMD_LIST_PAGE, method_list_page),
 	ENTRY(CTL_CMD_LIST_BANNED, method_list_banned),
 	ENTRY(CTL_CMD_LIST_COOKIES, method_list_cookies),
 	ENTRY(CTL_CMD_USER_INFO, method_user_info),
@@ -169,11 +176,43 @@ int ctl_handler_init(main_server_st * s)
 	return sd;
 }
 
+static int append_ip_pool(method_ctx *ctx, StatusRep *rep,
+			  struct ip_pool_st *p)
+{
+	IpPoolRep *r;
+	char buf[64];
+
+	if (inet_ntop(p->family, p->network, buf, sizeof(buf)) == NULL)
+		return -1;
+
+	rep->ip_pools =
+	    talloc_realloc(ctx->pool, rep->ip_pools, IpPoolRep *, (1 + rep->n_ip_pools));
+	if (rep->ip_pools == NULL)
+		return -1;
+
+	r = rep->ip_pools[rep->n_ip_pools] = talloc(ctx->pool, IpPoolRep);
+	if (r == NULL)
+		return -1;
+	rep->n_ip_pools++;
+
+	ip_pool_rep__init(r);
+
+	r->network = talloc_asprintf(ctx->pool, "%s/%u", buf, p->prefix);
+	if (r->network == NULL)
+		return -1;
+	r->subnet_prefix = p->subnet_prefix;
+	r->size = p->size - p->reserved;
+	r->used = p->used - p->reserved;
+
+	return 0;
+}
+
 static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 			  unsigned msg_size)
 {
 	StatusRep rep = STATUS_REP__INIT;
 	int ret;
+	struct ip_pool_st *p;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: status");
 
@@ -204,6 +243,16 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	rep.total_auth_failures = ctx->s->stats.total_auth_failures;
 	rep.total_sessions_closed = ctx->s->stats.total_sessions_closed;
 
+	rep.script_runtimes = ctx->s->stats.script_runtimes;
+	rep.n_script_runtimes = SCRIPT_RUNTIME_BUCKETS;
+
+	list_for_each(&ctx->s->ip_leases.pools, p, list) {
+		if (append_ip_pool(ctx, &rep, p) < 0) {
+			mslog(ctx->s, NULL, LOG_ERR, "error appending IP pool info to reply");
+			break;
+		}
+	}
+
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_STATUS_REP, &rep,
 		       (pack_size_func) status_rep__get_packed_size,
 		       (pack_func) status_rep__pack);
@@ -259,9 +308,12 @@ static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
 }
 
 #define IPBUF_SIZE 64
+/* Appends the information on the proc; @fields selects the optional
+ * USER_INFO_FIELD_ values to include. */
 static int append_user_info(method_ctx *ctx,
 			    UserListRep * list,
-			    struct proc_st *ctmp)
+			    struct proc_st *ctmp,
+			    unsigned fields)
 {
 	uint32_t tmp;
 	char *ipbuf;
@@ -372,26 +424,38 @@ static int append_user_info(method_ctx *ctx,
 	rep->remote_ip6 = strtmp;
 
 	rep->conn_time = ctmp->conn_time;
-	rep->hostname = ctmp->hostname;
-	rep->user_agent = ctmp->user_agent;
-
 	rep->status = ctmp->status;
 
-	rep->tls_ciphersuite = ctmp->tls_ciphersuite;
-	rep->dtls_ciphersuite = ctmp->dtls_ciphersuite;
-
 	calc_safe_id(ctmp->sid, sizeof(ctmp->sid), safe_id, SAFE_ID_SIZE);
 	rep->safe_id.data = (unsigned char*)safe_id;
 	rep->safe_id.len = SAFE_ID_SIZE;
 
+	if (!(fields & USER_INFO_FIELD_SESSION))
+		goto config;
+
+	rep->hostname = ctmp->hostname;
+	rep->user_agent = ctmp->user_agent;
+
+	rep->tls_ciphersuite = ctmp->tls_ciphersuite;
+	rep->dtls_ciphersuite = ctmp->dtls_ciphersuite;
+
 	rep->cstp_compr = ctmp->cstp_compr;
 	rep->dtls_compr = ctmp->dtls_compr;
+	if (ctmp->comp_attempted > 0 || ctmp->comp_skipped > 0) {
+		rep->comp_attempted = ctmp->comp_attempted;
+		rep->has_comp_attempted = 1;
+		rep->comp_skipped = ctmp->comp_skipped;
+		rep->has_comp_skipped = 1;
+		rep->comp_saved_bytes = ctmp->comp_saved_bytes;
+		rep->has_comp_saved_bytes = 1;
+	}
 	if (ctmp->mtu > 0) {
 		rep->mtu = ctmp->mtu;
 		rep->has_mtu = 1;
 	}
 
-	if (ctmp->config) {
+ config:
+	if (ctmp->config && (fields & USER_INFO_FIELD_CONFIG)) {
 		rep->restrict_to_routes = ctmp->config->restrict_user_to_routes;
 
 		tmp = ctmp->config->rx_per_sec;
@@ -442,7 +506,7 @@ static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-users");
 
 	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
-		ret = append_user_info(ctx, &rep, ctmp);
+		ret = append_user_info(ctx, &rep, ctmp, USER_INFO_FIELD_ALL);
 		if (ret < 0) {
 			mslog(ctx->s, NULL, LOG_ERR,
 			      "error appending user info to reply");
@@ -461,6 +525,169 @@ static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
+struct user_filter_st {
+	const char *username;
+	const char *groupname;
+	const char *vhost;
+
+	unsigned has_ip;
+	int family;
+	uint8_t ip[16];
+	unsigned prefix;
+};
+
+static int parse_ip_filter(struct user_filter_st *f, const char *str)
+{
+	char buf[MAX_IP_STR+4];
+	char *p;
+	unsigned max;
+
+	strlcpy(buf, str, sizeof(buf));
+
+	p = strchr(buf, '/');
+	if (p != NULL)
+		*p++ = 0;
+
+	if (inet_pton(AF_INET, buf, f->ip) == 1) {
+		f->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, f->ip) == 1) {
+		f->family = AF_INET6;
+		max = 128;
+	} else {
+		return -1;
+	}
+
+	f->prefix = max;
+	if (p != NULL) {
+		f->prefix = atoi(p);
+		if (f->prefix > max)
+			return -1;
+	}
+	f->has_ip = 1;
+
+	return 0;
+}
+
+static unsigned addr_in_prefix(const struct user_filter_st *f,
+			       const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	const uint8_t *ip;
+	unsigned full = f->prefix / 8;
+	unsigned rem = f->prefix % 8;
+	uint8_t mask;
+
+	if (addr_len == 0 || addr->ss_family != f->family)
+		return 0;
+
+	ip = SA_IN_P_TYPE(addr, f->family);
+	if (memcmp(ip, f->ip, full) != 0)
+		return 0;
+
+	if (rem) {
+		mask = 0xff << (8 - rem);
+		if ((ip[full] & mask) != (f->ip[full] & mask))
+			return 0;
+	}
+
+	return 1;
+}
+
+static unsigned user_matches(const struct user_filter_st *f, struct proc_st *ctmp)
+{
+	if (f->username && strcmp(f->username, ctmp->username) != 0)
+		return 0;
+
+	if (f->groupname && strcmp(f->groupname, ctmp->groupname) != 0)
+		return 0;
+
+	if (f->vhost && strcmp(f->vhost, VHOSTNAME(ctmp->vhost)) != 0)
+		return 0;
+
+	if (f->has_ip) {
+		if (addr_in_prefix(f, &ctmp->remote_addr, ctmp->remote_addr_len))
+			return 1;
+		if (ctmp->ipv4 && addr_in_prefix(f, &ctmp->ipv4->rip, ctmp->ipv4->rip_len))
+			return 1;
+		if (ctmp->ipv6 && addr_in_prefix(f, &ctmp->ipv6->rip, ctmp->ipv6->rip_len))
+			return 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Sends a page of the users matching the request's filters. The
+ * connection remains open, so that the client can request the next
+ * pages, each processed on a separate event loop iteration.
+ */
+static void method_list_page(method_ctx *ctx, int cfd, uint8_t * msg,
+			     unsigned msg_size)
+{
+	UserListRep rep = USER_LIST_REP__INIT;
+	UserListReq *req;
+	struct user_filter_st filter;
+	struct proc_st *ctmp = NULL;
+	unsigned max;
+	int ret;
+
+	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-users (page)");
+
+	req = user_list_req__unpack(NULL, msg_size, msg);
+	if (req == NULL) {
+		mslog(ctx->s, NULL, LOG_ERR, "error parsing list page request");
+		return;
+	}
+
+	memset(&filter, 0, sizeof(filter));
+	filter.username = req->username;
+	filter.groupname = req->groupname;
+	filter.vhost = req->vhost;
+	if (req->ip && parse_ip_filter(&filter, req->ip) < 0) {
+		mslog(ctx->s, NULL, LOG_INFO, "ctl: invalid IP filter '%s'", req->ip);
+		goto send;
+	}
+
+	max = req->max_users;
+	if (max == 0 || max > CTL_LIST_PAGE_MAX)
+		max = CTL_LIST_PAGE_MAX;
+
+	/* the list is in descending list_id order, and the cursor is
+	 * the list_id of the last user sent */
+	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
+		if (req->has_cursor && ctmp->list_id >= req->cursor)
+			continue;
+
+		if (!user_matches(&filter, ctmp))
+			continue;
+
+		if (rep.n_user == max) {
+			/* more users match; next_cursor is already set */
+			rep.has_next_cursor = 1;
+			break;
+		}
+
+		ret = append_user_info(ctx, &rep, ctmp, req->fields);
+		if (ret < 0) {
+			mslog(ctx->s, NULL, LOG_ERR,
+			      "error appending user info to reply");
+			goto cleanup;
+		}
+		rep.next_cursor = ctmp->list_id;
+	}
+
+ send:
+	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_REP, &rep,
+		       (pack_size_func) user_list_rep__get_packed_size,
+		       (pack_func) user_list_rep__pack);
+	if (ret < 0) {
+		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
+	}
+
+ cleanup:
+	user_list_req__free_unpacked(req, NULL);
+}
+
 static void method_top(method_ctx *ctx, int cfd, uint8_t * msg,
 			      unsigned msg_size)
 {
@@ -568,34 +795,42 @@ static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
 	int ret;
 	unsigned found_user = 0;
 	struct proc_st *ctmp = NULL;
+	struct user_sessions_st *u;
 
 	if (user != NULL)
 		mslog(ctx->s, NULL, LOG_INFO, "providing info for user '%s'", user);
 	else
 		mslog(ctx->s, NULL, LOG_INFO, "providing info for ID '%u'", id);
 
-	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
-		if (user == NULL) {	/* id */
-			if (id == 0 || id == -1 || id != ctmp->pid) {
-				continue;
+	if (user != NULL) {	/* username */
+		u = proc_search_user(ctx->s, user);
+		if (u != NULL) {
+			list_for_each(&u->procs, ctmp, user_list) {
+				ret = append_user_info(ctx, &rep, ctmp, USER_INFO_FIELD_ALL);
+				if (ret < 0) {
+					mslog(ctx->s, NULL, LOG_ERR,
+					      "error appending user info to reply");
+					goto error;
+				}
+
+				found_user = 1;
 			}
-		} else {	/* username */
-			if (strcmp(ctmp->username, user) != 0) {
-				continue;
-			}
-		}
-
-		ret = append_user_info(ctx, &rep, ctmp);
-		if (ret < 0) {
-			mslog(ctx->s, NULL, LOG_ERR,
-			      "error appending user info to reply");
-			goto error;
 		}
+	} else if (id != 0 && id != -1) {	/* id -> one a single element */
+		list_for_each(&ctx->s->proc_list.head, ctmp, list) {
+			if (id != ctmp->pid)
+				continue;
 
-		found_user = 1;
+			ret = append_user_info(ctx, &rep, ctmp, USER_INFO_FIELD_ALL);
+			if (ret < 0) {
+				mslog(ctx->s, NULL, LOG_ERR,
+				      "error appending user info to reply");
+				goto error;
+			}
 
-		if (id != 0)	/* id -> one a single element */
+			found_user = 1;
 			break;
+		}
 	}
 
 	if (found_user == 0) {
@@ -696,6 +931,8 @@ static void method_disconnect_user_name(method_ctx *ctx,
 	BoolMsg rep = BOOL_MSG__INIT;
 	struct proc_st *cpos;
 	struct proc_st *ctmp = NULL;
+	struct user_sessions_st *u;
+	unsigned last;
 	int ret;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: disconnect_name");
@@ -708,10 +945,17 @@ static void method_disconnect_user_name(method_ctx *ctx,
 	}
 
 	/* got the name. Try to disconnect */
-	list_for_each_safe(&ctx->s->proc_list.head, ctmp, cpos, list) {
-		if (strcmp(ctmp->username, req->username) == 0) {
+	u = proc_search_user(ctx->s, req->username);
+	if (u != NULL) {
+		list_for_each_safe(&u->procs, ctmp, cpos, user_list) {
+			/* terminating the last session may free u */
+			last = (ctmp == list_tail(&u->procs, struct proc_st, user_list));
+
 			terminate_proc(ctx->s, ctmp);
 			rep.status = 1;
+
+			if (last)
+				break;
 		}
 	}
 
@@ -906,7 +1150,7 @@ void ctl_handler_notify (main_server_st* s, struct proc_st *proc, unsigned conne
 		rep.discon_reason_txt = (char*)discon_reason_to_str(proc->discon_reason);
 	}
 
-	ret = append_user_info(&ctx, &list, proc);
+	ret = append_user_info(&ctx, &list, proc, USER_INFO_FIELD_ALL);
 	if (ret < 0) {
 		mslog(s, NULL, LOG_ERR,
 		      "error appending user info to reply");
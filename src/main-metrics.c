@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cloexec.h>
+#include <main.h>
+#include <main-ban.h>
+#include <main-metrics.h>
+#include <metrics.h>
+#include <str.h>
+
+/* The metrics endpoint. It is a unix socket which answers any request
+ * with an HTTP/1.0 response in the Prometheus text format, and closes
+ * the connection. The counters of the workers and sec-mod are read
+ * from the shared mapping, thus a scrape requires no IPC with them.
+ */
+
+struct metrics_shm_st *metrics_shm = NULL;
+
+struct metrics_conn_st {
+	int fd;
+	ev_io io;
+};
+
+void metrics_shm_init(main_server_st *s)
+{
+	void *p;
+	int e;
+
+	if (GETPCONFIG(s)->metrics_socket_file == NULL)
+		return;
+
+	p = mmap(NULL, sizeof(struct metrics_shm_st), PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not allocate metrics memory: %s",
+		      strerror(e));
+		return;
+	}
+
+	memset(p, 0, sizeof(struct metrics_shm_st));
+	metrics_shm = p;
+}
+
+static void sum_workers(struct worker_metrics_st *t)
+{
+	unsigned i;
+	struct worker_metrics_st *w;
+
+	memset(t, 0, sizeof(*t));
+	for (i=0;i<METRICS_SLOTS;i++) {
+		w = &metrics_shm->workers[i];
+#define SUM(field) t->field += __atomic_load_n(&w->field, __ATOMIC_RELAXED)
+		SUM(rx_packets);
+		SUM(rx_bytes);
+		SUM(tx_packets);
+		SUM(tx_bytes);
+		SUM(dtls_rx_packets);
+		SUM(dtls_tx_packets);
+		SUM(comp_in_bytes);
+		SUM(comp_out_bytes);
+		SUM(mtu_changes);
+		SUM(dpd_sent);
+		SUM(dpd_timeouts);
+#undef SUM
+	}
+}
+
+#define HELP(name, type, help) \
+	str_append_printf(str, "# HELP ocserv_" name " " help "\n# TYPE ocserv_" name " " type "\n")
+
+static int format_metrics(main_server_st *s, str_st *str)
+{
+	struct worker_metrics_st w;
+	struct secmod_metrics_st *sm = &metrics_shm->secmod;
+	static const unsigned bounds[] = METRICS_AUTH_BUCKETS;
+	uint64_t count = 0;
+	unsigned i;
+
+	sum_workers(&w);
+
+	HELP("rx_packets_total", "counter", "Packets received from the clients.");
+	str_append_printf(str, "ocserv_rx_packets_total{transport=\"dtls\"} %lu\n",
+			  (unsigned long)w.dtls_rx_packets);
+	str_append_printf(str, "ocserv_rx_packets_total{transport=\"cstp\"} %lu\n",
+			  (unsigned long)(w.rx_packets - w.dtls_rx_packets));
+
+	HELP("tx_packets_total", "counter", "Packets sent to the clients.");
+	str_append_printf(str, "ocserv_tx_packets_total{transport=\"dtls\"} %lu\n",
+			  (unsigned long)w.dtls_tx_packets);
+	str_append_printf(str, "ocserv_tx_packets_total{transport=\"cstp\"} %lu\n",
+			  (unsigned long)(w.tx_packets - w.dtls_tx_packets));
+
+	HELP("rx_bytes_total", "counter", "Bytes received from the clients.");
+	str_append_printf(str, "ocserv_rx_bytes_total %lu\n", (unsigned long)w.rx_bytes);
+	HELP("tx_bytes_total", "counter", "Bytes sent to the clients.");
+	str_append_printf(str, "ocserv_tx_bytes_total %lu\n", (unsigned long)w.tx_bytes);
+
+	HELP("compression_bytes_total", "counter", "Bytes compressed and their compressed size.");
+	str_append_printf(str, "ocserv_compression_bytes_total{stage=\"in\"} %lu\n",
+			  (unsigned long)w.comp_in_bytes);
+	str_append_printf(str, "ocserv_compression_bytes_total{stage=\"out\"} %lu\n",
+			  (unsigned long)w.comp_out_bytes);
+
+	HELP("mtu_changes_total", "counter", "Changes of the data MTU of the sessions.");
+	str_append_printf(str, "ocserv_mtu_changes_total %lu\n", (unsigned long)w.mtu_changes);
+	HELP("dpd_sent_total", "counter", "Dead peer detection requests sent.");
+	str_append_printf(str, "ocserv_dpd_sent_total %lu\n", (unsigned long)w.dpd_sent);
+	HELP("dpd_timeouts_total", "counter", "Sessions closed due to dead peer detection.");
+	str_append_printf(str, "ocserv_dpd_timeouts_total %lu\n", (unsigned long)w.dpd_timeouts);
+
+	HELP("auth_latency_seconds", "histogram", "The time taken by the authentications.");
+	for (i=0;i<METRICS_AUTH_BUCKETS_SIZE;i++) {
+		count += __atomic_load_n(&sm->auth_latency[i], __ATOMIC_RELAXED);
+		if (i < METRICS_AUTH_BUCKETS_SIZE - 1)
+			str_append_printf(str, "ocserv_auth_latency_seconds_bucket{le=\"%g\"} %lu\n",
+					  bounds[i] / 1000.0, (unsigned long)count);
+		else
+			str_append_printf(str, "ocserv_auth_latency_seconds_bucket{le=\"+Inf\"} %lu\n",
+					  (unsigned long)count);
+	}
+	str_append_printf(str, "ocserv_auth_latency_seconds_sum %.3f\n",
+			  __atomic_load_n(&sm->auth_latency_sum_ms, __ATOMIC_RELAXED) / 1000.0);
+	str_append_printf(str, "ocserv_auth_latency_seconds_count %lu\n", (unsigned long)count);
+
+	HELP("secmod_queue_depth", "gauge", "The security module requests queued to or running on its threads.");
+	str_append_printf(str, "ocserv_secmod_queue_depth %lu\n",
+			  (unsigned long)__atomic_load_n(&sm->auth_queue_depth, __ATOMIC_RELAXED));
+	HELP("secmod_client_entries", "gauge", "The client entries of the security module.");
+	str_append_printf(str, "ocserv_secmod_client_entries %u\n", s->stats.secmod_client_entries);
+
+	HELP("active_sessions", "gauge", "The connected clients.");
+	str_append_printf(str, "ocserv_active_sessions %u\n", s->stats.active_clients);
+	HELP("sessions_closed_total", "counter", "Sessions closed since the server was started.");
+	str_append_printf(str, "ocserv_sessions_closed_total %lu\n",
+			  (unsigned long)s->stats.total_sessions_closed);
+	HELP("auth_failures_total", "counter", "Authentication failures since the server was started.");
+	str_append_printf(str, "ocserv_auth_failures_total %lu\n",
+			  (unsigned long)s->stats.total_auth_failures);
+	HELP("banned_ips", "gauge", "The IPs with a ban score.");
+	return str_append_printf(str, "ocserv_banned_ips %u\n", main_ban_db_elems(s));
+}
+
+static void metrics_conn_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct metrics_conn_st *conn = container_of(w, struct metrics_conn_st, io);
+	static const char head[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Connection: close\r\n\r\n";
+	char buf[1024];
+	str_st str;
+	int ret;
+
+	/* the request itself is not interpreted */
+	ret = recv(conn->fd, buf, sizeof(buf), 0);
+	if (ret <= 0)
+		goto cleanup;
+
+	str_init(&str, conn);
+	ret = str_append_data(&str, head, sizeof(head)-1);
+	if (ret < 0 || format_metrics(s, &str) < 0) {
+		mslog(s, NULL, LOG_ERR, "metrics: memory error");
+		goto cleanup;
+	}
+
+	ret = force_write(conn->fd, str.data, str.length);
+	if (ret < 0)
+		mslog(s, NULL, LOG_DEBUG, "metrics: error sending reply");
+
+ cleanup:
+	close(conn->fd);
+	ev_io_stop(EV_A_ w);
+	talloc_free(conn);
+}
+
+static void metrics_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct metrics_conn_st *conn;
+	int fd, e;
+
+	fd = accept(s->metrics.fd, NULL, NULL);
+	if (fd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR,
+		      "error accepting metrics connection: %s", strerror(e));
+		return;
+	}
+
+	set_cloexec_flag(fd, 1);
+
+	conn = talloc(s, struct metrics_conn_st);
+	if (conn == NULL) {
+		close(fd);
+		return;
+	}
+	conn->fd = fd;
+
+	ev_io_init(&conn->io, metrics_conn_cb, fd, EV_READ);
+	ev_io_start(loop, &conn->io);
+}
+
+/* Initializes the listening socket; it must be called after the event
+ * loop is initialized. The socket is accessible by the user and group
+ * the workers run as. */
+int metrics_handler_init(main_server_st *s)
+{
+	const char *file = GETPCONFIG(s)->metrics_socket_file;
+	struct sockaddr_un sa;
+	mode_t old_mask;
+	int sd, ret, e;
+
+	s->metrics.fd = -1;
+	if (metrics_shm == NULL)
+		return 0;
+
+	mslog(s, NULL, LOG_DEBUG, "initializing metrics unix socket: %s", file);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strlcpy(sa.sun_path, file, sizeof(sa.sun_path));
+	remove(file);
+
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not create socket '%s': %s",
+		      file, strerror(e));
+		return -1;
+	}
+	set_cloexec_flag(sd, 1);
+
+	old_mask = umask(0117);
+	ret = bind(sd, (struct sockaddr *)&sa, SUN_LEN(&sa));
+	umask(old_mask);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind socket '%s': %s",
+		      file, strerror(e));
+		goto fail;
+	}
+
+	ret = chown(file, GETPCONFIG(s)->uid, GETPCONFIG(s)->gid);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not chown socket '%s': %s",
+		      file, strerror(e));
+	}
+
+	ret = listen(sd, 64);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not listen to socket '%s': %s",
+		      file, strerror(e));
+		goto fail;
+	}
+
+	s->metrics.fd = sd;
+	ev_io_init(&s->metrics.io, metrics_accept_cb, sd, EV_READ);
+	ev_io_start(loop, &s->metrics.io);
+	return 0;
+
+ fail:
+	close(sd);
+	return -1;
+}
+
+/* Closes the listening socket; the mapping is kept as the children
+ * which call it keep updating their counters. */
+void metrics_handler_deinit(main_server_st *s)
+{
+	if (s->metrics.fd == -1)
+		return;
+
+	if (loop)
+		ev_io_stop(loop, &s->metrics.io);
+	close(s->metrics.fd);
+	s->metrics.fd = -1;
+}
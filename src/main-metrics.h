@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_METRICS_H
+# define MAIN_METRICS_H
+
+#include <main.h>
+
+/* Allocates the counters; it must be called before sec-mod and the
+ * workers are forked. */
+void metrics_shm_init(main_server_st *s);
+
+int metrics_handler_init(main_server_st *s);
+void metrics_handler_deinit(main_server_st *s);
+
+#endif
@@ -75,6 +75,7 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 	ctmp->tun_lease.fd = -1;
 	ctmp->fd = cmd_fd;
 	set_cloexec_flag (cmd_fd, 1);
+	ctmp->cmd_ring_efd = -1;
 	ctmp->conn_time = time(0);
 
 	memcpy(&ctmp->remote_addr, remote_addr, remote_addr_len);
@@ -83,6 +84,9 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 	memcpy(&ctmp->our_addr, our_addr, our_addr_len);
 	ctmp->our_addr_len = our_addr_len;
 
+	/* the list is kept in descending list_id order, which is
+	 * used as the cursor of the paginated occtl listing */
+	ctmp->list_id = ++s->proc_list.last_id;
 	list_add(&s->proc_list.head, &(ctmp->list));
 
 	/* initially we put into the "default" vhost cgroup. We
@@ -98,9 +102,10 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
  */
 void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 {
-	pid_t pid;
+	uint32_t script_id;
 
 	ev_io_stop(EV_A_ &proc->io);
+	ev_io_stop(EV_A_ &proc->cmd_ring_io);
 	ev_child_stop(EV_A_ &proc->ev_child);
 
 	list_del(&proc->list);
@@ -120,22 +125,14 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	mslog(s, proc, LOG_INFO, "user disconnected (reason: %s, rx: %"PRIu64", tx: %"PRIu64")",
 		discon_reason_to_str(proc->discon_reason), proc->bytes_in, proc->bytes_out);
 
-	pid = remove_from_script_list(s, proc);
-	if (proc->status == PS_AUTH_COMPLETED || pid > 0) {
-		if (pid > 0) {
-			int wstatus;
-			/* we were called during the connect script being run.
-			 * wait for it to finish and if it returns zero run the
-			 * disconnect script */
-			 if (waitpid(pid, &wstatus, 0) > 0) {
-			 	if (WEXITSTATUS(wstatus) == 0)
-					user_disconnected(s, proc);
-			 }
-		} else { /* pid > 0 or status == PS_AUTH_COMPLETED are mutually exclusive
-		          * since PS_AUTH_COMPLETED is set only after a successful script run.
-		          */
-			user_disconnected(s, proc);
-		}
+	script_id = remove_from_script_list(s, proc);
+	if (proc->status == PS_AUTH_COMPLETED || script_id != 0) {
+		/* if we were called while the connect script is being run,
+		 * the script runner terminates it, and runs the disconnect
+		 * script only if it still succeeds. Otherwise script_id is
+		 * zero, since PS_AUTH_COMPLETED is set only after a successful
+		 * script run. */
+		user_disconnected(s, proc, script_id);
 	}
 
 	/* close the intercomm fd */
@@ -144,6 +141,10 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	proc->fd = -1;
 	proc->pid = -1;
 
+	cmd_ring_free(proc->cmd_ring, proc->cmd_ring_efd);
+	proc->cmd_ring = NULL;
+	proc->cmd_ring_efd = -1;
+
 	remove_iroutes(s, proc);
 
 	if (proc->ipv4 || proc->ipv6)
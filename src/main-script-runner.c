@@ -0,0 +1,731 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <talloc.h>
+#include <system.h>
+#include <cloexec.h>
+#include <gettime.h>
+#include "common.h"
+#include "setproctitle.h"
+#include <script-list.h>
+#include <main-script-runner.h>
+
+#include <vpn.h>
+#include <main.h>
+#include <ccan/list/list.h>
+
+#ifdef HAVE_MALLOC_TRIM
+# include <malloc.h>
+#endif
+
+/* The connect, disconnect and host-update scripts are executed by a
+ * helper process, forked early from main, so that main does not fork
+ * its own image for every script. Main sends each script with its
+ * environment as a job; the runner spawns it, and reports the exit
+ * status once it completes. The runner enforces the configured limit
+ * of concurrently running scripts, and queues the rest.
+ */
+
+extern char **environ;
+
+static void script_runner_cb(EV_P_ ev_io *w, int revents);
+static void script_runner_child_cb(EV_P_ ev_child *w, int revents);
+
+/* Reads a message from the socket between main and the script runner.
+ * Returns the length of the data, or a negative error code.
+ */
+static int read_runner_msg(main_server_st *s, int fd, void *pool, uint8_t *cmd, uint8_t **raw)
+{
+	struct iovec iov[2];
+	struct msghdr hdr;
+	uint32_t length;
+	int ret, e;
+
+	iov[0].iov_base = cmd;
+	iov[0].iov_len = 1;
+
+	iov[1].iov_base = &length;
+	iov[1].iov_len = 4;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = 2;
+
+	do {
+		ret = recvmsg(fd, &hdr, 0);
+	} while(ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "cannot obtain metadata from script runner socket: %s",
+		      strerror(e));
+		return ERR_BAD_COMMAND;
+	}
+
+	if (ret == 0)
+		return ERR_PEER_TERMINATED;
+
+	if (ret < 5) {
+		mslog(s, NULL, LOG_ERR, "received invalid message from script runner socket");
+		return ERR_BAD_COMMAND;
+	}
+
+	*raw = talloc_size(pool, length);
+	if (*raw == NULL)
+		return ERR_MEM;
+
+	ret = force_read_timeout(fd, *raw, length, DEFAULT_SOCKET_TIMEOUT);
+	if (ret != length) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR,
+		      "cannot obtain data of cmd %u with length %u from script runner socket: %s",
+		      (unsigned)*cmd, (unsigned)length, strerror(e));
+		return ERR_BAD_COMMAND;
+	}
+
+	return length;
+}
+
+/* The script runner process */
+
+#define RECENT_JOBS 1024
+
+struct runner_job_st {
+	ev_child ev_child; /* must be first */
+	struct list_node list;
+
+	uint32_t id;
+	char *script;
+	char **envp;
+	struct timespec start;
+
+	/* executed after this job, if it succeeds */
+	struct runner_job_st *next;
+};
+
+static struct {
+	int fd;
+	struct list_head running;
+	struct list_head queue;
+	unsigned n_running;
+	unsigned n_queued;
+	unsigned max_concurrency;
+	unsigned queue_size;
+
+	/* the results of the recently completed jobs; a job may be
+	 * submitted chained to a job whose result is still on its way
+	 * to main */
+	struct {
+		uint32_t id;
+		unsigned status;
+	} recent[RECENT_JOBS];
+	unsigned recent_pos;
+} runner;
+
+static void send_result(main_server_st *s, uint32_t id, unsigned status, int runtime_ms)
+{
+	ScriptResultMsg msg = SCRIPT_RESULT_MSG__INIT;
+	int ret;
+
+	runner.recent[runner.recent_pos].id = id;
+	runner.recent[runner.recent_pos].status = status;
+	runner.recent_pos = (runner.recent_pos + 1) % RECENT_JOBS;
+
+	msg.id = id;
+	msg.status = status;
+	if (runtime_ms >= 0) {
+		msg.runtime_ms = runtime_ms;
+		msg.has_runtime_ms = 1;
+	}
+
+	ret = send_msg(NULL, runner.fd, CMD_SCRIPT_RESULT, &msg,
+		       (pack_size_func)script_result_msg__get_packed_size,
+		       (pack_func)script_result_msg__pack);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "script runner: could not send result to main");
+		exit(1);
+	}
+}
+
+/* frees the job and the jobs chained to it */
+static void drop_job(struct runner_job_st *job)
+{
+	struct runner_job_st *next;
+
+	while (job != NULL) {
+		next = job->next;
+		talloc_free(job);
+		job = next;
+	}
+}
+
+static struct runner_job_st *new_job(main_server_st *s, ScriptJobMsg *msg)
+{
+	struct runner_job_st *job;
+	unsigned i, j, n_environ, n;
+	const char *eq;
+
+	job = talloc_zero(s, struct runner_job_st);
+	if (job == NULL)
+		return NULL;
+
+	job->id = msg->id;
+	job->script = talloc_strdup(job, msg->script);
+	if (job->script == NULL)
+		goto fail;
+
+	for (n_environ=0;environ[n_environ]!=NULL;n_environ++);
+
+	job->envp = talloc_array(job, char *, msg->n_env + n_environ + 1);
+	if (job->envp == NULL)
+		goto fail;
+
+	for (n=0;n<msg->n_env;n++) {
+		job->envp[n] = talloc_strdup(job, msg->env[n]);
+		if (job->envp[n] == NULL)
+			goto fail;
+	}
+
+	/* the variables of the job override the inherited ones */
+	for (i=0;i<n_environ;i++) {
+		eq = strchr(environ[i], '=');
+		if (eq == NULL)
+			continue;
+
+		for (j=0;j<msg->n_env;j++) {
+			if (strncmp(msg->env[j], environ[i], eq - environ[i] + 1) == 0)
+				break;
+		}
+		if (j == msg->n_env)
+			job->envp[n++] = environ[i];
+	}
+	job->envp[n] = NULL;
+
+	return job;
+ fail:
+	talloc_free(job);
+	return NULL;
+}
+
+static void job_exit_cb(EV_P_ ev_child *w, int revents);
+
+static int start_job(main_server_st *s, struct runner_job_st *job)
+{
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	char *argv[2];
+	pid_t pid;
+	int ret;
+
+	argv[0] = job->script;
+	argv[1] = NULL;
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setsigmask(&attr, &sig_default_set);
+
+	/* set stdout to be stderr to avoid confusing scripts - note we have stdout closed */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+	ret = posix_spawn(&pid, job->script, &actions, &attr, argv, job->envp);
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (ret != 0) {
+		mslog(s, NULL, LOG_ERR, "Could not execute script %s: %s", job->script, strerror(ret));
+		send_result(s, job->id, 1, -1);
+		drop_job(job);
+		return -1;
+	}
+
+	gettime(&job->start);
+	ev_child_init(&job->ev_child, job_exit_cb, pid, 0);
+	ev_child_start(loop, &job->ev_child);
+
+	list_add_tail(&runner.running, &job->list);
+	runner.n_running++;
+
+	return 0;
+}
+
+/* starts the queued jobs up to the concurrency limit */
+static void schedule_jobs(main_server_st *s)
+{
+	struct runner_job_st *job;
+
+	while (runner.max_concurrency == 0 || runner.n_running < runner.max_concurrency) {
+		job = list_top(&runner.queue, struct runner_job_st, list);
+		if (job == NULL)
+			break;
+		list_del(&job->list);
+		runner.n_queued--;
+
+		start_job(s, job);
+	}
+}
+
+static void job_exit_cb(EV_P_ ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct runner_job_st *job = (struct runner_job_st*)w;
+	struct timespec now;
+	unsigned estatus;
+
+	estatus = WEXITSTATUS(w->rstatus);
+	if (WIFSIGNALED(w->rstatus))
+		estatus = 1;
+
+	ev_child_stop(loop, w);
+	list_del(&job->list);
+	runner.n_running--;
+
+	gettime(&now);
+	send_result(s, job->id, estatus, timespec_sub_ms(&now, &job->start));
+
+	if (job->next) {
+		if (estatus == 0) {
+			list_add(&runner.queue, &job->next->list);
+			runner.n_queued++;
+		} else {
+			drop_job(job->next);
+		}
+		job->next = NULL;
+	}
+	talloc_free(job);
+
+	schedule_jobs(s);
+}
+
+static struct runner_job_st *find_job(struct list_head *head, uint32_t id)
+{
+	struct runner_job_st *job = NULL, *chained;
+
+	list_for_each(head, job, list) {
+		for (chained=job;chained!=NULL;chained=chained->next) {
+			if (chained->id == id)
+				return chained;
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns the exit status of a recently completed job, or -1 if
+ * it is not known */
+static int find_recent(uint32_t id)
+{
+	unsigned i;
+
+	for (i=0;i<RECENT_JOBS;i++) {
+		if (runner.recent[i].id == id)
+			return runner.recent[i].status;
+	}
+
+	return -1;
+}
+
+static void handle_job(main_server_st *s, ScriptJobMsg *msg)
+{
+	struct runner_job_st *job, *prev = NULL;
+
+	job = new_job(s, msg);
+	if (job == NULL) {
+		mslog(s, NULL, LOG_ERR, "script runner: memory error");
+		send_result(s, msg->id, 1, -1);
+		return;
+	}
+
+	if (msg->has_after_id) {
+		prev = find_job(&runner.running, msg->after_id);
+		if (prev == NULL)
+			prev = find_job(&runner.queue, msg->after_id);
+	}
+
+	if (prev != NULL) {
+		while (prev->next != NULL)
+			prev = prev->next;
+		prev->next = job;
+		return;
+	}
+
+	/* the job it is chained to has already completed; it is executed
+	 * only if that succeeded */
+	if (msg->has_after_id && find_recent(msg->after_id) != 0) {
+		mslog(s, NULL, LOG_DEBUG, "script runner: job %u failed or is unknown; not executing %s",
+		      (unsigned)msg->after_id, job->script);
+		send_result(s, job->id, 1, -1);
+		talloc_free(job);
+		return;
+	}
+
+	if (runner.queue_size != 0 && runner.n_queued >= runner.queue_size) {
+		mslog(s, NULL, LOG_ERR, "script runner: queue is full; cannot execute %s", job->script);
+		send_result(s, job->id, 1, -1);
+		talloc_free(job);
+		return;
+	}
+
+	list_add_tail(&runner.queue, &job->list);
+	runner.n_queued++;
+
+	schedule_jobs(s);
+}
+
+static void cancel_job(main_server_st *s, uint32_t id)
+{
+	struct runner_job_st *job = NULL, *pos;
+
+	list_for_each(&runner.running, job, list) {
+		if (job->id == id) {
+			/* job_exit_cb() handles the rest */
+			kill(job->ev_child.pid, SIGTERM);
+			return;
+		}
+	}
+
+	list_for_each_safe(&runner.queue, job, pos, list) {
+		if (job->id == id) {
+			list_del(&job->list);
+			runner.n_queued--;
+			send_result(s, id, 1, -1);
+			drop_job(job);
+			return;
+		}
+	}
+}
+
+static void runner_cmd_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	void *pool;
+	PROTOBUF_ALLOCATOR(pa, NULL);
+	ScriptJobMsg *jmsg;
+	ScriptRunnerConfigMsg *cmsg;
+	ScriptCancelMsg *xmsg;
+	uint8_t cmd, *raw = NULL;
+	int ret;
+
+	pool = talloc_new(s);
+	if (pool == NULL)
+		return;
+	pa.allocator_data = pool;
+
+	ret = read_runner_msg(s, runner.fd, pool, &cmd, &raw);
+	if (ret == ERR_PEER_TERMINATED) {
+		/* main exited */
+		exit(0);
+	} else if (ret < 0) {
+		exit(1);
+	}
+
+	switch (cmd) {
+	case CMD_SCRIPT_JOB:
+		jmsg = script_job_msg__unpack(&pa, ret, raw);
+		if (jmsg == NULL) {
+			mslog(s, NULL, LOG_ERR, "script runner: error unpacking job");
+			break;
+		}
+		handle_job(s, jmsg);
+		break;
+	case CMD_SCRIPT_CANCEL:
+		xmsg = script_cancel_msg__unpack(&pa, ret, raw);
+		if (xmsg == NULL) {
+			mslog(s, NULL, LOG_ERR, "script runner: error unpacking cancel");
+			break;
+		}
+		cancel_job(s, xmsg->id);
+		break;
+	case CMD_SCRIPT_RUNNER_CONFIG:
+		cmsg = script_runner_config_msg__unpack(&pa, ret, raw);
+		if (cmsg == NULL) {
+			mslog(s, NULL, LOG_ERR, "script runner: error unpacking config");
+			break;
+		}
+		runner.max_concurrency = cmsg->max_concurrency;
+		runner.queue_size = cmsg->queue_size;
+		schedule_jobs(s);
+		break;
+	default:
+		mslog(s, NULL, LOG_ERR, "script runner: unknown CMD 0x%x", (unsigned)cmd);
+		break;
+	}
+
+	talloc_free(pool);
+}
+
+static void run_script_runner(main_server_st *s, int fd)
+{
+	ev_io cmd_watcher;
+
+	runner.fd = fd;
+	list_head_init(&runner.running);
+	list_head_init(&runner.queue);
+
+	/* the loop of main was destroyed by clear_lists() */
+	loop = ev_default_loop(0);
+	if (loop == NULL) {
+		mslog(s, NULL, LOG_ERR, "script runner: could not initialise libev");
+		exit(1);
+	}
+	ev_set_userdata(loop, s);
+
+	ev_io_init(&cmd_watcher, runner_cmd_cb, fd, EV_READ);
+	ev_io_start(loop, &cmd_watcher);
+
+	ev_run(loop, 0);
+	exit(0);
+}
+
+/* The main process side */
+
+void script_runner_start(main_server_st *s)
+{
+	int fd[2], ret, e;
+	pid_t pid;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+	if (ret < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "error creating script runner socket: %s", strerror(e));
+		return;
+	}
+
+	pid = fork();
+	if (pid == 0) {		/* child */
+		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+		clear_lists(s);
+		close(s->sec_mod_fd);
+		close(s->sec_mod_fd_sync);
+		kill_on_parent_kill(SIGTERM);
+
+#ifdef HAVE_MALLOC_TRIM
+		/* try to return all the pages we've freed to
+		 * the operating system. */
+		malloc_trim(0);
+#endif
+		setproctitle(PACKAGE_NAME "-scripts");
+		close(fd[1]);
+		set_cloexec_flag (fd[0], 1);
+		run_script_runner(s, fd[0]);
+		exit(0);
+	} else if (pid > 0) {	/* parent */
+		close(fd[0]);
+		set_cloexec_flag (fd[1], 1);
+
+		s->script_runner.fd = fd[1];
+		s->script_runner.pid = pid;
+
+		ev_io_init(&s->script_runner.io, script_runner_cb, fd[1], EV_READ);
+		ev_io_start(loop, &s->script_runner.io);
+
+		ev_child_init(&s->script_runner.ev_child, script_runner_child_cb, pid, 0);
+		ev_child_start(loop, &s->script_runner.ev_child);
+
+		script_runner_config(s);
+	} else {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "error in fork(): %s", strerror(e));
+		close(fd[0]);
+		close(fd[1]);
+	}
+}
+
+void script_runner_deinit(main_server_st *s)
+{
+	if (s->script_runner.fd == -1)
+		return;
+
+	ev_io_stop(loop, &s->script_runner.io);
+	ev_child_stop(loop, &s->script_runner.ev_child);
+	close(s->script_runner.fd);
+	s->script_runner.fd = -1;
+}
+
+void script_runner_config(main_server_st *s)
+{
+	ScriptRunnerConfigMsg msg = SCRIPT_RUNNER_CONFIG_MSG__INIT;
+	int ret;
+
+	if (s->script_runner.fd == -1)
+		return;
+
+	msg.max_concurrency = GETCONFIG(s)->script_max_concurrency;
+	msg.queue_size = GETCONFIG(s)->script_queue_size;
+
+	ret = send_msg(NULL, s->script_runner.fd, CMD_SCRIPT_RUNNER_CONFIG, &msg,
+		       (pack_size_func)script_runner_config_msg__get_packed_size,
+		       (pack_func)script_runner_config_msg__pack);
+	if (ret < 0)
+		mslog(s, NULL, LOG_ERR, "could not send config to script runner");
+}
+
+uint32_t script_runner_submit(main_server_st *s, ScriptJobMsg *msg)
+{
+	int ret;
+
+	if (s->script_runner.fd == -1)
+		return 0;
+
+	if (++s->script_runner.next_id == 0)
+		s->script_runner.next_id = 1;
+	msg->id = s->script_runner.next_id;
+
+	ret = send_msg(NULL, s->script_runner.fd, CMD_SCRIPT_JOB, msg,
+		       (pack_size_func)script_job_msg__get_packed_size,
+		       (pack_func)script_job_msg__pack);
+	if (ret < 0)
+		return 0;
+
+	return msg->id;
+}
+
+void script_runner_cancel(main_server_st *s, uint32_t id)
+{
+	ScriptCancelMsg msg = SCRIPT_CANCEL_MSG__INIT;
+	int ret;
+
+	if (s->script_runner.fd == -1)
+		return;
+
+	msg.id = id;
+
+	ret = send_msg(NULL, s->script_runner.fd, CMD_SCRIPT_CANCEL, &msg,
+		       (pack_size_func)script_cancel_msg__get_packed_size,
+		       (pack_func)script_cancel_msg__pack);
+	if (ret < 0)
+		mslog(s, NULL, LOG_ERR, "could not send cancel to script runner");
+}
+
+static void update_runtimes(main_server_st *s, unsigned ms)
+{
+	unsigned i, bound = 10;
+
+	for (i=0;i<SCRIPT_RUNTIME_BUCKETS-1 && ms >= bound;i++)
+		bound *= 10;
+
+	s->stats.script_runtimes[i]++;
+}
+
+/* Handles the result of a connect script; the results of the other
+ * scripts are only accounted. */
+static void handle_script_result(main_server_st *s, ScriptResultMsg *msg)
+{
+	struct script_wait_st *stmp = NULL;
+	struct proc_st *proc = NULL;
+	int ret;
+
+	if (msg->has_runtime_ms)
+		update_runtimes(s, msg->runtime_ms);
+
+	list_for_each(&s->script_list.head, stmp, list) {
+		if (stmp->id == msg->id) {
+			proc = stmp->proc;
+			list_del(&stmp->list);
+			talloc_free(stmp);
+			break;
+		}
+	}
+	if (proc == NULL)
+		return;
+
+	mslog(s, proc, LOG_DEBUG, "connect-script exit status: %u", (unsigned)msg->status);
+
+	ret = handle_script_exit(s, proc, msg->status);
+	if (ret < 0) {
+		/* takes care of free */
+		remove_proc(s, proc, RPROC_KILL);
+	}
+}
+
+static void script_runner_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	void *pool;
+	PROTOBUF_ALLOCATOR(pa, NULL);
+	ScriptResultMsg *msg;
+	uint8_t cmd, *raw = NULL;
+	int ret;
+
+	pool = talloc_new(s);
+	if (pool == NULL)
+		return;
+	pa.allocator_data = pool;
+
+	ret = read_runner_msg(s, s->script_runner.fd, pool, &cmd, &raw);
+	if (ret < 0) {
+		/* the runner is restarted by script_runner_child_cb() */
+		ev_io_stop(loop, w);
+		goto cleanup;
+	}
+
+	if (cmd != CMD_SCRIPT_RESULT) {
+		mslog(s, NULL, LOG_ERR, "unknown CMD from script runner 0x%x", (unsigned)cmd);
+		goto cleanup;
+	}
+
+	msg = script_result_msg__unpack(&pa, ret, raw);
+	if (msg == NULL) {
+		mslog(s, NULL, LOG_ERR, "error unpacking script runner data");
+		goto cleanup;
+	}
+
+	handle_script_result(s, msg);
+
+ cleanup:
+	talloc_free(pool);
+}
+
+static void script_runner_child_cb(EV_P_ ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct script_wait_st *stmp = NULL, *spos;
+	struct proc_st *proc;
+
+	if (WIFSIGNALED(w->rstatus))
+		mslog(s, NULL, LOG_ERR, "script runner %u died with signal %d", (unsigned)w->pid, (int)WTERMSIG(w->rstatus));
+	else
+		mslog(s, NULL, LOG_ERR, "script runner %u exited unexpectedly", (unsigned)w->pid);
+
+	script_runner_deinit(s);
+	script_runner_start(s);
+
+	/* the connect scripts in progress are considered failed */
+	list_for_each_safe(&s->script_list.head, stmp, spos, list) {
+		proc = stmp->proc;
+		list_del(&stmp->list);
+		talloc_free(stmp);
+
+		if (handle_script_exit(s, proc, 1) < 0)
+			remove_proc(s, proc, RPROC_KILL);
+	}
+}
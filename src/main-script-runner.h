@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_SCRIPT_RUNNER_H
+# define MAIN_SCRIPT_RUNNER_H
+
+#include <main.h>
+#include <ipc.pb-c.h>
+
+/* Forks the script runner process; it must be called after the
+ * event loop is initialized. */
+void script_runner_start(main_server_st *s);
+void script_runner_deinit(main_server_st *s);
+
+/* Sends the concurrency limits of the current configuration */
+void script_runner_config(main_server_st *s);
+
+/* Assigns an id to the job and sends it to the script runner. Returns
+ * the id, or zero on error. */
+uint32_t script_runner_submit(main_server_st *s, ScriptJobMsg *msg);
+
+/* Terminates the job with the given id if it is running, or removes
+ * it from the queue. */
+void script_runner_cancel(main_server_st *s, uint32_t id);
+
+#endif
@@ -45,6 +45,7 @@
 #include <main-ctl.h>
 #include <ip-lease.h>
 #include <script-list.h>
+#include <main-script-runner.h>
 #include <ccan/list/list.h>
 
 #define OCSERV_FW_SCRIPT "/usr/bin/ocserv-fw"
@@ -53,7 +54,7 @@
 			ret = str_append_str(str, val); \
 			if (ret < 0) { \
 				mslog(s, proc, LOG_ERR, "could not append value to environment\n"); \
-				exit(1); \
+				return -1; \
 			}
 
 typedef enum script_type_t {
@@ -64,7 +65,25 @@ typedef enum script_type_t {
 
 static const char *type_name[] = {"up", "host-update", "down"};
 
-static void export_fw_info(main_server_st *s, struct proc_st* proc)
+/* Appends NAME=value to the environment of the script */
+static int env_add(void *pool, ScriptJobMsg *msg, const char *name, const char *value)
+{
+	char **env;
+
+	env = talloc_realloc(pool, msg->env, char *, msg->n_env + 1);
+	if (env == NULL)
+		return -1;
+	msg->env = env;
+
+	env[msg->n_env] = talloc_asprintf(pool, "%s=%s", name, value);
+	if (env[msg->n_env] == NULL)
+		return -1;
+	msg->n_env++;
+
+	return 0;
+}
+
+static int export_fw_info(main_server_st *s, struct proc_st* proc, void *pool, ScriptJobMsg *msg)
 {
 	str_st str4;
 	str_st str6;
@@ -72,9 +91,9 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 	unsigned i, negate = 0;
 	int ret;
 
-	str_init(&str4, proc);
-	str_init(&str6, proc);
-	str_init(&str_common, proc);
+	str_init(&str4, pool);
+	str_init(&str6, pool);
+	str_init(&str_common, pool);
 
 	/* We use different export strings for IPv4 and IPv6 to ease handling
 	 * with legacy software such as iptables and ip6tables. */
@@ -93,19 +112,19 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_ROUTES4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_add(pool, msg, "OCSERV_ROUTES4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_ROUTES6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_add(pool, msg, "OCSERV_ROUTES6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_ROUTES", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_add(pool, msg, "OCSERV_ROUTES", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
 	/* export the No-routes */
@@ -128,25 +147,25 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_NO_ROUTES4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_add(pool, msg, "OCSERV_NO_ROUTES4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_NO_ROUTES6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_add(pool, msg, "OCSERV_NO_ROUTES6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_NO_ROUTES", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_add(pool, msg, "OCSERV_NO_ROUTES", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
 	if (proc->config->restrict_user_to_routes) {
-		if (setenv("OCSERV_RESTRICT_TO_ROUTES", "1", 1) == -1) {
+		if (env_add(pool, msg, "OCSERV_RESTRICT_TO_ROUTES", "1") < 0) {
 			mslog(s, proc, LOG_ERR, "could not export OCSERV_RESTRICT_TO_ROUTES\n");
-			exit(1);
+			return -1;
 		}
 	}
 	/* export the DNS servers */
@@ -170,19 +189,19 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_DNS4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_add(pool, msg, "OCSERV_DNS4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_DNS6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_add(pool, msg, "OCSERV_DNS6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_DNS", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_add(pool, msg, "OCSERV_DNS", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
 	str_clear(&str4);
@@ -223,34 +242,47 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 
 			if (ret < 0) {
 				mslog(s, proc, LOG_ERR, "could not append value to environment\n");
-				exit(1);
+				return -1;
 			}
 		}
 	}
 
 	if (str_common.length > 0) {
 		if (negate) {
-			if (setenv("OCSERV_DENY_PORTS", (char*)str_common.data, 1) == -1) {
+			if (env_add(pool, msg, "OCSERV_DENY_PORTS", (char*)str_common.data) < 0) {
 				mslog(s, proc, LOG_ERR, "could not export DENY_PORTS\n");
-				exit(1);
+				return -1;
 			}
 		} else {
-			if (setenv("OCSERV_ALLOW_PORTS", (char*)str_common.data, 1) == -1) {
+			if (env_add(pool, msg, "OCSERV_ALLOW_PORTS", (char*)str_common.data) < 0) {
 				mslog(s, proc, LOG_ERR, "could not export ALLOW_PORTS\n");
-				exit(1);
+				return -1;
 			}
 		}
 	}
 
 	str_clear(&str_common);
+
+	return 0;
 }
 
+/* Submits the script of the given type to the script runner. For
+ * SCRIPT_CONNECT it returns ERR_WAIT_FOR_SCRIPT, and the result is
+ * handled by handle_script_exit(). If @after_id is non-zero, the script
+ * is executed once the job with that id completes, and only if it
+ * succeeds.
+ */
 static
-int call_script(main_server_st *s, struct proc_st* proc, script_type_t type)
+int call_script(main_server_st *s, struct proc_st* proc, script_type_t type, uint32_t after_id)
 {
-pid_t pid;
+ScriptJobMsg msg = SCRIPT_JOB_MSG__INIT;
 int ret;
+uint32_t id;
+void *pool;
 const char* script, *next_script = NULL;
+char real[64] = "";
+char local[64] = "";
+char remote[64] = "";
 
 	if (type == SCRIPT_CONNECT)
 		script = GETCONFIG(s)->connect_script;
@@ -269,132 +301,140 @@ const char* script, *next_script = NULL;
 	if (script == NULL)
 		return 0;
 
-	pid = fork();
-	if (pid == 0) {
-		char real[64] = "";
-		char local[64] = "";
-		char remote[64] = "";
+	pool = talloc_new(proc);
+	if (pool == NULL)
+		return -1;
 
-		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	msg.script = (char*)script;
+	if (after_id != 0) {
+		msg.after_id = after_id;
+		msg.has_after_id = 1;
+	}
 
-		snprintf(real, sizeof(real), "%u", (unsigned)proc->pid);
-		setenv("ID", real, 1);
+#define ENV_ADD(name, value) \
+	if (env_add(pool, &msg, name, value) < 0) { \
+		ret = -1; \
+		goto fail; \
+	}
 
-		if (proc->remote_addr_len > 0) {
-			if ((ret=getnameinfo((void*)&proc->remote_addr, proc->remote_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
-				mslog(s, proc, LOG_DEBUG, "cannot determine peer address: %s; script failed", gai_strerror(ret));
-				exit(1);
-			}
-			setenv("IP_REAL", real, 1);
-		}
+	snprintf(real, sizeof(real), "%u", (unsigned)proc->pid);
+	ENV_ADD("ID", real);
 
-		if (proc->our_addr_len > 0) {
-			if ((ret=getnameinfo((void*)&proc->our_addr, proc->our_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
-				mslog(s, proc, LOG_DEBUG, "cannot determine our address: %s", gai_strerror(ret));
-			} else {
-				setenv("IP_REAL_LOCAL", real, 1);
-			}
+	if (proc->remote_addr_len > 0) {
+		if ((ret=getnameinfo((void*)&proc->remote_addr, proc->remote_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
+			mslog(s, proc, LOG_DEBUG, "cannot determine peer address: %s; script failed", gai_strerror(ret));
+			ret = -1;
+			goto fail;
 		}
+		ENV_ADD("IP_REAL", real);
+	}
 
-		if (proc->ipv4 != NULL || proc->ipv6 != NULL) {
-			if (proc->ipv4 && proc->ipv4->lip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv4->lip, proc->ipv4->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
-					exit(1);
-				}
-				setenv("IP_LOCAL", local, 1);
-			}
+	if (proc->our_addr_len > 0) {
+		if ((ret=getnameinfo((void*)&proc->our_addr, proc->our_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
+			mslog(s, proc, LOG_DEBUG, "cannot determine our address: %s", gai_strerror(ret));
+		} else {
+			ENV_ADD("IP_REAL_LOCAL", real);
+		}
+	}
 
-			if (proc->ipv6 && proc->ipv6->lip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv6->lip, proc->ipv6->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
-					exit(1);
-				}
-				if (local[0] == 0)
-					setenv("IP_LOCAL", local, 1);
-				setenv("IPV6_LOCAL", local, 1);
+	if (proc->ipv4 != NULL || proc->ipv6 != NULL) {
+		if (proc->ipv4 && proc->ipv4->lip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv4->lip, proc->ipv4->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
+				ret = -1;
+				goto fail;
 			}
+			ENV_ADD("IP_LOCAL", local);
+		}
 
-			if (proc->ipv4 && proc->ipv4->rip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv4->rip, proc->ipv4->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
-					exit(1);
-				}
-				setenv("IP_REMOTE", remote, 1);
-			}
-			if (proc->ipv6 && proc->ipv6->rip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv6->rip, proc->ipv6->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
-					exit(1);
-				}
-				if (remote[0] == 0)
-					setenv("IP_REMOTE", remote, 1);
-				setenv("IPV6_REMOTE", remote, 1);
-
-				snprintf(remote, sizeof(remote), "%u", proc->ipv6->prefix);
-				setenv("IPV6_PREFIX", remote, 1);
+		if (proc->ipv6 && proc->ipv6->lip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv6->lip, proc->ipv6->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
+				ret = -1;
+				goto fail;
 			}
+			if (local[0] == 0)
+				ENV_ADD("IP_LOCAL", local);
+			ENV_ADD("IPV6_LOCAL", local);
 		}
 
-		if (proc->vhost)
-			setenv("VHOST", VHOSTNAME(proc->vhost), 1);
-		setenv("USERNAME", proc->username, 1);
-		setenv("GROUPNAME", proc->groupname, 1);
-		setenv("HOSTNAME", proc->hostname, 1);
-		setenv("DEVICE", proc->tun_lease.name, 1);
-		if (type == SCRIPT_CONNECT) {
-			setenv("REASON", "connect", 1);
-		} else if (type == SCRIPT_HOST_UPDATE) {
-			setenv("REASON", "host-update", 1);
-		} else if (type == SCRIPT_DISCONNECT) {
-			/* use remote as temp buffer */
-			snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_in);
-			setenv("STATS_BYTES_IN", remote, 1);
-			snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_out);
-			setenv("STATS_BYTES_OUT", remote, 1);
-			if (proc->conn_time > 0) {
-				snprintf(remote, sizeof(remote), "%lu", (unsigned long)(time(0)-proc->conn_time));
-				setenv("STATS_DURATION", remote, 1);
+		if (proc->ipv4 && proc->ipv4->rip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv4->rip, proc->ipv4->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
+				ret = -1;
+				goto fail;
 			}
-			setenv("REASON", "disconnect", 1);
+			ENV_ADD("IP_REMOTE", remote);
 		}
+		if (proc->ipv6 && proc->ipv6->rip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv6->rip, proc->ipv6->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
+				ret = -1;
+				goto fail;
+			}
+			if (remote[0] == 0)
+				ENV_ADD("IP_REMOTE", remote);
+			ENV_ADD("IPV6_REMOTE", remote);
 
-		/* export DNS and route info */
-		export_fw_info(s, proc);
-
-		/* set stdout to be stderr to avoid confusing scripts - note we have stdout closed */
-		if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
-			int e = errno;
-			mslog(s, proc, LOG_INFO, "cannot dup2(STDERR_FILENO, STDOUT_FILENO): %s", strerror(e));
+			snprintf(remote, sizeof(remote), "%u", proc->ipv6->prefix);
+			ENV_ADD("IPV6_PREFIX", remote);
 		}
+	}
 
-		if (next_script) {
-			setenv("OCSERV_NEXT_SCRIPT", next_script, 1);
-			mslog(s, proc, LOG_DEBUG, "executing script %s %s (next: %s)", type_name[type], script, next_script);
-		} else
-			mslog(s, proc, LOG_DEBUG, "executing script %s %s", type_name[type], script);
-
-		ret = execl(script, script, NULL);
-		if (ret == -1) {
-			mslog(s, proc, LOG_ERR, "Could not execute script %s", script);
-			exit(1);
+	if (proc->vhost)
+		ENV_ADD("VHOST", VHOSTNAME(proc->vhost));
+	ENV_ADD("USERNAME", proc->username);
+	ENV_ADD("GROUPNAME", proc->groupname);
+	ENV_ADD("HOSTNAME", proc->hostname);
+	ENV_ADD("DEVICE", proc->tun_lease.name);
+	if (type == SCRIPT_CONNECT) {
+		ENV_ADD("REASON", "connect");
+	} else if (type == SCRIPT_HOST_UPDATE) {
+		ENV_ADD("REASON", "host-update");
+	} else if (type == SCRIPT_DISCONNECT) {
+		/* use remote as temp buffer */
+		snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_in);
+		ENV_ADD("STATS_BYTES_IN", remote);
+		snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_out);
+		ENV_ADD("STATS_BYTES_OUT", remote);
+		if (proc->conn_time > 0) {
+			snprintf(remote, sizeof(remote), "%lu", (unsigned long)(time(0)-proc->conn_time));
+			ENV_ADD("STATS_DURATION", remote);
 		}
-			
-		exit(77);
-	} else if (pid == -1) {
-		mslog(s, proc, LOG_ERR, "Could not fork()");
-		return -1;
+		ENV_ADD("REASON", "disconnect");
 	}
-	
+
+	/* export DNS and route info */
+	ret = export_fw_info(s, proc, pool, &msg);
+	if (ret < 0)
+		goto fail;
+
+	if (next_script) {
+		ENV_ADD("OCSERV_NEXT_SCRIPT", next_script);
+		mslog(s, proc, LOG_DEBUG, "executing script %s %s (next: %s)", type_name[type], script, next_script);
+	} else
+		mslog(s, proc, LOG_DEBUG, "executing script %s %s", type_name[type], script);
+#undef ENV_ADD
+
+	id = script_runner_submit(s, &msg);
+	if (id == 0) {
+		mslog(s, proc, LOG_ERR, "could not submit script %s", script);
+		ret = -1;
+		goto fail;
+	}
+
 	if (type == SCRIPT_CONNECT) {
-		add_to_script_list(s, pid, proc);
-		return ERR_WAIT_FOR_SCRIPT;
+		add_to_script_list(s, id, proc);
+		ret = ERR_WAIT_FOR_SCRIPT;
 	} else {
-		/* we don't add a specific handler for SCRIPT_CONNECT and SCRIPT_HOST_UPDATE
-		 * childs. We rely on libev's child reaping of unwatched children.
-		 */
-		return 0;
+		/* the results of the SCRIPT_DISCONNECT and SCRIPT_HOST_UPDATE
+		 * jobs are not tracked */
+		ret = 0;
 	}
+
+ fail:
+	talloc_free(pool);
+	return ret;
 }
 
 static void
@@ -474,7 +514,7 @@ int ret;
 	ctl_handler_notify(s,proc, 1);
 	add_utmp_entry(s, proc);
 
-	ret = call_script(s, proc, SCRIPT_CONNECT);
+	ret = call_script(s, proc, SCRIPT_CONNECT, 0);
 	if (ret < 0)
 		return ret;
 
@@ -485,14 +525,20 @@ void user_hostname_update(main_server_st *s, struct proc_st* proc)
 {
 	if (proc->host_updated != 0)
 		return;
-	call_script(s, proc, SCRIPT_HOST_UPDATE);
+	call_script(s, proc, SCRIPT_HOST_UPDATE, 0);
 	proc->host_updated = 1;
 }
 
-void user_disconnected(main_server_st *s, struct proc_st* proc)
+/* @connect_id is the job of the connect script if it has not
+ * completed yet, or zero. In that case the user was never reported
+ * as connected, and the disconnect script runs only if the connect
+ * script succeeds. */
+void user_disconnected(main_server_st *s, struct proc_st* proc, uint32_t connect_id)
 {
-	ctl_handler_notify(s,proc, 0);
-	remove_utmp_entry(s, proc);
-	call_script(s, proc, SCRIPT_DISCONNECT);
+	if (connect_id == 0) {
+		ctl_handler_notify(s,proc, 0);
+		remove_utmp_entry(s, proc);
+	}
+	call_script(s, proc, SCRIPT_DISCONNECT, connect_id);
 }
 
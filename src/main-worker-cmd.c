@@ -162,7 +162,9 @@ static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
 	}
 
 	ret = open_tun(s, proc);
-	if (ret < 0) {
+	if (ret == ERR_WAIT_FOR_PING) {
+		return ret;
+	} else if (ret < 0) {
 		return -1;
 	}
 
@@ -224,6 +226,11 @@ static int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
 		 * The notification of peer will be done in handle_script_exit().
 		 */
 		ret = 0;
+	} else if (ret == ERR_WAIT_FOR_PING) {
+		/* we will wait for the probe of our IP lease to complete;
+		 * the authentication will resume in resume_accept_user().
+		 */
+		ret = 0;
 	} else {
 		/* no script was called. Handle it as a successful script call. */
 		ret = handle_script_exit(s, proc, ret);
@@ -234,6 +241,78 @@ static int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
 	return ret;
 }
 
+/* Resumes the acceptance of the user, which was suspended while one of
+ * the selected IP leases was being probed (see icmp_ping_start()).
+ */
+int resume_accept_user(main_server_st *s, struct proc_st *proc)
+{
+	return handle_cookie_auth_res(s, proc, AUTH_COOKIE_REQ, 0);
+}
+
+static void update_comp_stats(struct proc_st *proc, uint64_t attempted,
+			      uint64_t skipped, uint64_t saved_bytes)
+{
+	proc->comp_attempted = attempted;
+	proc->comp_skipped = skipped;
+	proc->comp_saved_bytes = saved_bytes;
+}
+
+/* Reads the messages the worker has put in its command ring. The
+ * ring is read before every message on the command socket is handled,
+ * so that messages are processed in the order they were sent. At most
+ * CMD_RING_SIZE messages are read per call, so that a worker which keeps
+ * filling the ring cannot hold main; the rest are read on the next
+ * wakeup.
+ */
+int handle_worker_ring(main_server_st * s, struct proc_st *proc)
+{
+	struct cmd_ring_msg_st msg;
+	unsigned i;
+	int ret;
+
+	if (proc->cmd_ring == NULL)
+		return 0;
+
+	for (i=0;i<CMD_RING_SIZE;i++) {
+		ret = cmd_ring_get(proc->cmd_ring, &proc->cmd_ring_tail, &msg);
+		if (ret < 0) {
+			mslog(s, proc, LOG_ERR, "the worker's command ring is corrupted");
+			return ERR_BAD_COMMAND;
+		}
+
+		if (ret == 0) {
+			if (cmd_ring_sleep(proc->cmd_ring, proc->cmd_ring_efd,
+					   proc->cmd_ring_tail) == 0)
+				return 0;
+			continue;
+		}
+
+		if (proc->status != PS_AUTH_COMPLETED) {
+			mslog(s, proc, LOG_ERR,
+			      "received ring message in unauthenticated state.");
+			return ERR_BAD_COMMAND;
+		}
+
+		switch (msg.cmd) {
+		case CMD_TUN_MTU:
+			set_tun_mtu(s, proc, msg.m.mtu);
+			break;
+		case CMD_COMP_STATS:
+			update_comp_stats(proc, msg.m.comp.attempted,
+					  msg.m.comp.skipped,
+					  msg.m.comp.saved_bytes);
+			break;
+		default:
+			mslog(s, proc, LOG_ERR, "unknown ring CMD from worker: 0x%x", (unsigned)msg.cmd);
+			return ERR_BAD_COMMAND;
+		}
+	}
+
+	/* handle the other events before reading the rest */
+	cmd_ring_wakeup(proc->cmd_ring_efd);
+	return 0;
+}
+
 int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 {
 	uint8_t cmd;
@@ -243,6 +322,10 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 	int ret, raw_len, e;
 	PROTOBUF_ALLOCATOR(pa, proc);
 
+	ret = handle_worker_ring(s, proc);
+	if (ret < 0)
+		return ret;
+
 	ret = recv_msg_headers(proc->fd, &cmd, MAX_WAIT_SECS);
 	if (ret < 0) {
 		if (ret == ERR_PEER_TERMINATED)
@@ -337,6 +420,30 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 			tun_mtu_msg__free_unpacked(tmsg, &pa);
 		}
 
+		break;
+	case CMD_COMP_STATS:{
+			CompStatsMsg *tmsg;
+
+			if (proc->status != PS_AUTH_COMPLETED) {
+				mslog(s, proc, LOG_ERR,
+				      "received compression stats in unauthenticated state.");
+				ret = ERR_BAD_COMMAND;
+				goto cleanup;
+			}
+
+			tmsg = comp_stats_msg__unpack(&pa, raw_len, raw);
+			if (tmsg == NULL) {
+				mslog(s, proc, LOG_ERR, "error unpacking data");
+				ret = ERR_BAD_COMMAND;
+				goto cleanup;
+			}
+
+			update_comp_stats(proc, tmsg->attempted, tmsg->skipped,
+					  tmsg->saved_bytes);
+
+			comp_stats_msg__free_unpacked(tmsg, &pa);
+		}
+
 		break;
 	case CMD_SESSION_INFO:{
 			SessionInfoMsg *tmsg;
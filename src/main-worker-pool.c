@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <common.h>
+#include <cloexec.h>
+#include <ipc.pb-c.h>
+#include <vpn.h>
+#include <worker.h>
+#include <main.h>
+#include <main-worker-pool.h>
+#include <setproctitle.h>
+
+/* A pool of worker processes which are forked (and have dropped their
+ * privileges) ahead of time, so that the accept path does not need to
+ * fork(). An accepted connection is handed over to an idle worker using
+ * its command socket, and the pool is refilled when the main loop is
+ * idle. The pool is recycled on reload and on maintenance, so that
+ * the idle workers do not keep a stale copy of the configuration.
+ */
+
+struct pooled_worker_st {
+	ev_child ev_child; /* must be first */
+	struct list_node list;
+
+	pid_t pid;
+	int fd; /* main's side of the command socket */
+	struct cmd_ring_st *cmd_ring;
+	int cmd_ring_efd;
+};
+
+static void free_pooled_worker(main_server_st *s, struct pooled_worker_st *p)
+{
+	ev_child_stop(loop, &p->ev_child);
+	list_del(&p->list);
+	s->worker_pool.total--;
+
+	/* the worker exits once it reads EOF */
+	close(p->fd);
+	cmd_ring_free(p->cmd_ring, p->cmd_ring_efd);
+	talloc_free(p);
+}
+
+static void pooled_worker_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct pooled_worker_st *p = (struct pooled_worker_st *)w;
+
+	mslog(s, NULL, LOG_DEBUG, "pre-forked worker %u exited", (unsigned)w->pid);
+	free_pooled_worker(s, p);
+
+	if (GETCONFIG(s)->worker_pool_size > 0)
+		ev_idle_start(loop, &s->worker_pool.refill);
+}
+
+/* Runs in the pre-forked worker; waits for a connection and serves it */
+static void pooled_worker_main(struct worker_st *ws)
+{
+	WorkerStartMsg *msg = NULL;
+	int fd = -1;
+	int ret;
+	PROTOBUF_ALLOCATOR(pa, ws);
+
+	ret = recv_socket_msg(ws, ws->cmd_fd, CMD_WORKER_START, &fd,
+			      (void *)&msg,
+			      (unpack_func) worker_start_msg__unpack, 0);
+	if (ret < 0 || fd == -1) {
+		/* pool was flushed */
+		exit(0);
+	}
+
+	if (msg->remote_addr.len > sizeof(ws->remote_addr) ||
+	    msg->our_addr.len > sizeof(ws->our_addr)) {
+		syslog(LOG_ERR, "worker: received invalid addresses from main");
+		exit(1);
+	}
+
+	set_cloexec_flag(fd, 1);
+
+	memcpy(&ws->remote_addr, msg->remote_addr.data, msg->remote_addr.len);
+	ws->remote_addr_len = msg->remote_addr.len;
+	if (msg->has_our_addr) {
+		memcpy(&ws->our_addr, msg->our_addr.data, msg->our_addr.len);
+		ws->our_addr_len = msg->our_addr.len;
+	} else {
+		ws->our_addr_len = 0;
+	}
+
+	ws->conn_fd = fd;
+	ws->conn_type = msg->conn_type;
+	worker_start_msg__free_unpacked(msg, &pa);
+
+	setproctitle(PACKAGE_NAME"-worker");
+	vpn_server(ws);
+	exit(0);
+}
+
+static void refill_watcher_cb(struct ev_loop *loop, ev_idle *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct pooled_worker_st *p;
+	struct worker_st *ws;
+	int cmd_fd[2];
+	pid_t pid;
+
+	/* one worker per iteration, to not stall the loop */
+	if (s->worker_pool.total >= GETCONFIG(s)->worker_pool_size) {
+		ev_idle_stop(loop, w);
+		return;
+	}
+
+	p = talloc_zero(s, struct pooled_worker_st);
+	if (p == NULL)
+		goto fail;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd) < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		talloc_free(p);
+		goto fail;
+	}
+
+	p->cmd_ring_efd = -1;
+	if (GETCONFIG(s)->worker_cmd_ring &&
+	    cmd_ring_new(&p->cmd_ring, &p->cmd_ring_efd) < 0) {
+		mslog(s, NULL, LOG_WARNING, "could not create the worker's command ring");
+		p->cmd_ring = NULL;
+		p->cmd_ring_efd = -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(cmd_fd[0]);
+
+		ws = init_worker_process(s, cmd_fd[1], p->cmd_ring, p->cmd_ring_efd);
+		setproctitle(PACKAGE_NAME"-worker-idle");
+
+		pooled_worker_main(ws);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(cmd_fd[0]);
+		close(cmd_fd[1]);
+		cmd_ring_free(p->cmd_ring, p->cmd_ring_efd);
+		talloc_free(p);
+		goto fail;
+	}
+
+	close(cmd_fd[1]);
+	set_cloexec_flag(cmd_fd[0], 1);
+
+	p->pid = pid;
+	p->fd = cmd_fd[0];
+
+	ev_child_init(&p->ev_child, pooled_worker_watcher_cb, pid, 0);
+	ev_child_start(loop, &p->ev_child);
+
+	list_add_tail(&s->worker_pool.head, &p->list);
+	s->worker_pool.total++;
+	return;
+
+ fail:
+	/* retry when a worker is taken, or on maintenance */
+	ev_idle_stop(loop, w);
+}
+
+/* The pool list is initialized with the other lists in main() */
+void worker_pool_init(main_server_st *s)
+{
+	ev_idle_init(&s->worker_pool.refill, refill_watcher_cb);
+	if (GETCONFIG(s)->worker_pool_size > 0)
+		ev_idle_start(loop, &s->worker_pool.refill);
+}
+
+/* Releases the idle workers; they exit once they notice that
+ * their command socket is closed. */
+void worker_pool_deinit(main_server_st *s)
+{
+	struct pooled_worker_st *p, *pos;
+
+	list_for_each_safe(&s->worker_pool.head, p, pos, list) {
+		free_pooled_worker(s, p);
+	}
+
+	if (loop)
+		ev_idle_stop(loop, &s->worker_pool.refill);
+}
+
+/* Replaces the idle workers with ones which use the current configuration */
+void worker_pool_flush(main_server_st *s)
+{
+	worker_pool_deinit(s);
+
+	if (GETCONFIG(s)->worker_pool_size > 0)
+		ev_idle_start(loop, &s->worker_pool.refill);
+}
+
+int worker_pool_take(main_server_st *s, int fd, int conn_type,
+		     struct worker_st *ws, pid_t *pid, int *cmd_fd,
+		     struct cmd_ring_st **cmd_ring, int *cmd_ring_efd)
+{
+	struct pooled_worker_st *p;
+	WorkerStartMsg msg = WORKER_START_MSG__INIT;
+	int ret;
+
+	if (GETCONFIG(s)->worker_pool_size == 0)
+		return -1;
+
+	ev_idle_start(loop, &s->worker_pool.refill);
+
+	msg.remote_addr.data = (void *)&ws->remote_addr;
+	msg.remote_addr.len = ws->remote_addr_len;
+	if (ws->our_addr_len > 0) {
+		msg.our_addr.data = (void *)&ws->our_addr;
+		msg.our_addr.len = ws->our_addr_len;
+		msg.has_our_addr = 1;
+	}
+	msg.conn_type = conn_type;
+
+	while ((p = list_top(&s->worker_pool.head, struct pooled_worker_st, list)) != NULL) {
+		ret = send_socket_msg(s, p->fd, CMD_WORKER_START, fd, &msg,
+				      (pack_size_func) worker_start_msg__get_packed_size,
+				      (pack_func) worker_start_msg__pack);
+		if (ret < 0) {
+			/* the worker is gone; try the next one */
+			free_pooled_worker(s, p);
+			continue;
+		}
+
+		*pid = p->pid;
+		*cmd_fd = p->fd;
+		*cmd_ring = p->cmd_ring;
+		*cmd_ring_efd = p->cmd_ring_efd;
+
+		/* the worker is now owned by a proc_st */
+		ev_child_stop(loop, &p->ev_child);
+		list_del(&p->list);
+		s->worker_pool.total--;
+		talloc_free(p);
+		return 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_WORKER_POOL_H
+# define MAIN_WORKER_POOL_H
+
+#include <main.h>
+
+void worker_pool_init(main_server_st *s);
+void worker_pool_deinit(main_server_st *s);
+void worker_pool_flush(main_server_st *s);
+
+/* Hands the accepted connection @fd over to an idle pre-forked worker.
+ * Returns zero on success, setting @pid and @cmd_fd to the worker's pid
+ * and main's side of its command socket, and @cmd_ring and @cmd_ring_efd
+ * to its command ring (if any), or -1 if no worker is available.
+ */
+int worker_pool_take(main_server_st *s, int fd, int conn_type,
+		     struct worker_st *ws, pid_t *pid, int *cmd_fd,
+		     struct cmd_ring_st **cmd_ring, int *cmd_ring_efd);
+
+#endif
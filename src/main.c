@@ -55,13 +55,19 @@
 #include <main.h>
 #include <main-ctl.h>
 #include <main-ban.h>
+#include <main-worker-pool.h>
 #include <route-add.h>
 #include <worker.h>
 #include <proc-search.h>
 #include <tun.h>
 #include <grp.h>
 #include <ip-lease.h>
+#include <icmp-ping.h>
+#include <main-script-runner.h>
+#include <main-metrics.h>
+#include <resume-shm.h>
 #include <ccan/list/list.h>
+#include <ccan/container_of/container_of.h>
 
 #ifdef HAVE_GSSAPI
 # include <libtasn1.h>
@@ -612,9 +618,11 @@ void clear_lists(main_server_st *s)
 			close(ctmp->fd);
 		if (ctmp->tun_lease.fd >= 0)
 			close(ctmp->tun_lease.fd);
+		cmd_ring_free(ctmp->cmd_ring, ctmp->cmd_ring_efd);
 		list_del(&ctmp->list);
 		ev_child_stop(EV_A_ &ctmp->ev_child);
 		ev_io_stop(EV_A_ &ctmp->io);
+		ev_io_stop(EV_A_ &ctmp->cmd_ring_io);
 		safe_memset(ctmp, 0, sizeof(*ctmp));
 		talloc_free(ctmp);
 		s->proc_list.total--;
@@ -622,14 +630,18 @@ void clear_lists(main_server_st *s)
 
 	list_for_each_safe(&s->script_list.head, script_tmp, script_pos, list) {
 		list_del(&script_tmp->list);
-		ev_child_stop(loop, &script_tmp->ev_child);
 		talloc_free(script_tmp);
 	}
 
+	script_runner_deinit(s);
+	metrics_handler_deinit(s);
+	icmp_ping_deinit(s);
+	route_nl_deinit(s);
 	ip_lease_deinit(&s->ip_leases);
 	proc_table_deinit(s);
 	ctl_handler_deinit(s);
 	main_ban_db_deinit(s);
+	worker_pool_deinit(s);
 
 	/* clear libev state */
 	if (loop) {
@@ -949,31 +961,6 @@ static void sec_mod_child_watcher_cb(struct ev_loop *loop, ev_child *w, int reve
 
 }
 
-void script_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
-{
-	main_server_st *s = ev_userdata(loop);
-	int ret;
-	struct script_wait_st *stmp = (struct script_wait_st*)w;
-	unsigned estatus;
-
-	estatus = WEXITSTATUS(w->rstatus);
-	if (WIFSIGNALED(w->rstatus))
-		estatus = 1;
-
-	/* check if someone was waiting for that pid */
-	mslog(s, stmp->proc, LOG_DEBUG, "connect-script exit status: %u", estatus);
-	list_del(&stmp->list);
-	ev_child_stop(loop, &stmp->ev_child);
-
-	ret = handle_script_exit(s, stmp->proc, estatus);
-	if (ret < 0) {
-		/* takes care of free */
-		remove_proc(s, stmp->proc, RPROC_KILL);
-	} else {
-		talloc_free(stmp);
-	}
-}
-
 static void worker_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
@@ -1001,6 +988,9 @@ static void kill_children(main_server_st* s)
 		}
 	}
 	kill(s->sec_mod_pid, SIGTERM);
+
+	/* the script runner exits once its socket is closed */
+	script_runner_deinit(s);
 }
 
 static void term_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revents)
@@ -1009,6 +999,7 @@ static void term_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revents)
 	unsigned total = 10;
 
 	mslog(s, NULL, LOG_INFO, "termination request received; waiting for children to die");
+	worker_pool_deinit(s);
 	kill_children(s);
 
 	while (waitpid(-1, NULL, WNOHANG) >= 0) {
@@ -1041,6 +1032,58 @@ static void reload_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revent
 	}
 
 	reload_cfg_file(s->config_pool, s->vconfig, 0);
+	script_runner_config(s);
+
+	/* the idle workers have a copy of the old configuration */
+	worker_pool_flush(s);
+}
+
+/* Prepares a newly forked worker process; it closes any open descriptors,
+ * erases sensitive data and drops privileges. Returns the worker's
+ * state, which is no longer allocated under @s.
+ */
+struct worker_st *init_worker_process(main_server_st *s, int cmd_fd,
+				      struct cmd_ring_st *cmd_ring, int cmd_ring_efd)
+{
+	struct worker_st *ws = s->ws;
+
+	sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	clear_lists(s);
+	if (s->top_fd != -1) close(s->top_fd);
+	close(s->sec_mod_fd);
+	close(s->sec_mod_fd_sync);
+
+	kill_on_parent_kill(SIGTERM);
+
+	/* write sec-mod's address */
+	memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
+	ws->secmod_addr_len = s->secmod_addr_len;
+
+	ws->main_pool = s->main_pool;
+
+	ws->vconfig = s->vconfig;
+
+	ws->cmd_fd = cmd_fd;
+	ws->cmd_ring = cmd_ring;
+	ws->cmd_ring_efd = cmd_ring_efd;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+
+	/* Drop privileges after this point */
+	drop_privileges(s);
+
+	/* creds and config are not allocated
+	 * under s.
+	 */
+	talloc_free(s);
+#ifdef HAVE_MALLOC_TRIM
+	/* try to return all the pages we've freed to
+	 * the operating system, to prevent the child from
+	 * accessing them. That's totally unreliable, so
+	 * sensitive data have to be overwritten anyway. */
+	malloc_trim(0);
+#endif
+	return ws;
 }
 
 static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
@@ -1056,6 +1099,18 @@ static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
 	}
 }
 
+static void cmd_ring_watcher_cb (EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct proc_st *ctmp = container_of(w, struct proc_st, cmd_ring_io);
+	int ret;
+
+	ret = handle_worker_ring(s, ctmp);
+	if (ret < 0) {
+		remove_proc(s, ctmp, RPROC_KILL);
+	}
+}
+
 static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
@@ -1064,6 +1119,8 @@ static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
 	struct worker_st *ws = s->ws;
 	int fd, ret;
 	int cmd_fd[2];
+	struct cmd_ring_st *cmd_ring = NULL;
+	int cmd_ring_efd = -1;
 	pid_t pid;
 
 	if (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX) {
@@ -1107,6 +1164,12 @@ static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
 			}
 		}
 
+		if (worker_pool_take(s, fd, stype, ws, &pid, &cmd_fd[0],
+				     &cmd_ring, &cmd_ring_efd) == 0) {
+			cmd_fd[1] = -1;
+			goto forked;
+		}
+
 		/* Create a command socket */
 		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
 		if (ret < 0) {
@@ -1115,56 +1178,31 @@ static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
 			return;
 		}
 
+		if (GETCONFIG(s)->worker_cmd_ring &&
+		    cmd_ring_new(&cmd_ring, &cmd_ring_efd) < 0) {
+			mslog(s, NULL, LOG_WARNING, "could not create the worker's command ring");
+			cmd_ring = NULL;
+			cmd_ring_efd = -1;
+		}
+
 		pid = fork();
 		if (pid == 0) {	/* child */
-			/* close any open descriptors, and erase
-			 * sensitive data before running the worker
-			 */
-			sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
 			close(cmd_fd[0]);
-			clear_lists(s);
-			if (s->top_fd != -1) close(s->top_fd);
-			close(s->sec_mod_fd);
-			close(s->sec_mod_fd_sync);
-
-			setproctitle(PACKAGE_NAME"-worker");
-			kill_on_parent_kill(SIGTERM);
 
-			/* write sec-mod's address */
-			memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
-			ws->secmod_addr_len = s->secmod_addr_len;
-
-			ws->main_pool = s->main_pool;
-
-			ws->vconfig = s->vconfig;
-
-			ws->cmd_fd = cmd_fd[1];
-			ws->tun_fd = -1;
-			ws->dtls_tptr.fd = -1;
+			ws = init_worker_process(s, cmd_fd[1], cmd_ring, cmd_ring_efd);
 			ws->conn_fd = fd;
 			ws->conn_type = stype;
 
-			/* Drop privileges after this point */
-			drop_privileges(s);
-
-			/* creds and config are not allocated
-			 * under s.
-			 */
-			talloc_free(s);
-#ifdef HAVE_MALLOC_TRIM
-			/* try to return all the pages we've freed to
-			 * the operating system, to prevent the child from
-			 * accessing them. That's totally unreliable, so
-			 * sensitive data have to be overwritten anyway. */
-			malloc_trim(0);
-#endif
+			setproctitle(PACKAGE_NAME"-worker");
 			vpn_server(ws);
 			exit(0);
 		} else if (pid == -1) {
 fork_failed:
 			mslog(s, NULL, LOG_ERR, "fork failed");
 			close(cmd_fd[0]);
+			cmd_ring_free(cmd_ring, cmd_ring_efd);
 		} else { /* parent */
+ forked:
 			/* add_proc */
 			ctmp = new_proc(s, pid, cmd_fd[0], 
 					&ws->remote_addr, ws->remote_addr_len,
@@ -1178,10 +1216,18 @@ fork_failed:
 			ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd[0], EV_READ);
 			ev_io_start(loop, &ctmp->io);
 
+			if (cmd_ring != NULL) {
+				ctmp->cmd_ring = cmd_ring;
+				ctmp->cmd_ring_efd = cmd_ring_efd;
+				ev_io_init(&ctmp->cmd_ring_io, cmd_ring_watcher_cb, cmd_ring_efd, EV_READ);
+				ev_io_start(loop, &ctmp->cmd_ring_io);
+			}
+
 			ev_child_init(&ctmp->ev_child, worker_child_watcher_cb, pid, 0);
 			ev_child_start(loop, &ctmp->ev_child);
 		}
-		close(cmd_fd[1]);
+		if (cmd_fd[1] != -1)
+			close(cmd_fd[1]);
 		close(fd);
 	} else if (ltmp->sock_type == SOCK_TYPE_UDP) {
 		/* connection on UDP port */
@@ -1220,6 +1266,7 @@ static void perform_maintenance(main_server_st *s)
 	mslog(s, NULL, LOG_DEBUG, "performing maintenance (banned IPs: %d)", main_ban_db_elems(s));
 	cleanup_banned_entries(s);
 	clear_old_configs(s->vconfig);
+	worker_pool_flush(s);
 
 	list_for_each_rev(s->vconfig, vhost, list) {
 		tls_reload_crl(s, vhost, 0);
@@ -1290,9 +1337,14 @@ int main(int argc, char** argv)
 	s->stats.start_time = s->stats.last_reset = time(0);
 	s->top_fd = -1;
 	s->ctl_fd = -1;
+	s->script_runner.fd = -1;
+	s->metrics.fd = -1;
 
 	list_head_init(&s->proc_list.head);
 	list_head_init(&s->script_list.head);
+	list_head_init(&s->worker_pool.head);
+	icmp_ping_init(s);
+	route_nl_init(s);
 	ip_lease_init(&s->ip_leases);
 	proc_table_init(s);
 	main_ban_db_init(s);
@@ -1358,6 +1410,11 @@ int main(int argc, char** argv)
 
 	write_pid_file();
 
+	metrics_shm_init(s);
+
+	if (resume_shm_init(GETPCONFIG(s)->tls_session_cache_size) < 0)
+		mslog(s, NULL, LOG_ERR, "could not allocate the TLS session cache; using sec-mod");
+
 	s->sec_mod_fd = run_sec_mod(s, &s->sec_mod_fd_sync);
 	ret = ctl_handler_init(s);
 	if (ret < 0) {
@@ -1419,6 +1476,18 @@ int main(int argc, char** argv)
 	ev_set_userdata (loop, s);
 	ev_set_syserr_cb(syserr_cb);
 
+	script_runner_start(s);
+	if (s->script_runner.fd == -1) {
+		mslog(s, NULL, LOG_ERR, "could not start the script runner");
+		exit(1);
+	}
+
+	ret = metrics_handler_init(s);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "could not initialize the metrics socket");
+		exit(1);
+	}
+
 	ev_init(&ctl_watcher, ctl_watcher_cb);
 	ev_init(&sec_mod_watcher, sec_mod_watcher_cb);
 
@@ -1459,6 +1528,8 @@ int main(int argc, char** argv)
 	ev_signal_set (&maintenance_sig_watcher, SIGUSR2);
 	ev_signal_start (loop, &maintenance_sig_watcher);
 
+	worker_pool_init(s);
+
 	/* Main server loop */
 	ev_run (loop, 0);
 
@@ -1467,6 +1538,8 @@ int main(int argc, char** argv)
 	 */
 	remove(s->full_socket_file);
 	remove(GETPCONFIG(s)->occtl_socket_file);
+	if (GETPCONFIG(s)->metrics_socket_file)
+		remove(GETPCONFIG(s)->metrics_socket_file);
 	remove_pid_file();
 
 	clear_lists(s);
@@ -33,6 +33,7 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <ev.h>
+#include <cmd-ring.h>
 
 #include "vhost.h"
 
@@ -70,16 +71,50 @@ struct listen_list_st {
 	unsigned int total;
 };
 
+/* A connect script whose result is awaited */
 struct script_wait_st {
-	/* must be first so that this structure can behave as ev_child */
-	struct ev_child ev_child;
-
 	struct list_node list;
 
-	pid_t pid;
+	uint32_t id; /* the script runner job */
 	struct proc_st* proc;
 };
 
+struct ping_probe_st;
+
+/* The long-lived raw sockets used to probe the IP leases prior
+ * to assigning them (ping-leases). */
+struct ping_list_st {
+	struct list_head head; /* the probes in flight */
+
+	int fd4;
+	int fd6;
+	ev_io io4;
+	ev_io io6;
+};
+
+/* The rtnetlink socket used to apply the iroutes (route-netlink) */
+struct route_nl_st {
+	struct list_head head; /* the procs with requests in flight */
+
+	int fd;
+	ev_io io;
+	uint32_t seq;
+};
+
+/* The listening socket of metrics-socket-file */
+struct metrics_st {
+	int fd;
+	ev_io io;
+};
+
+/* The idle pre-forked worker processes (worker-pool-size) */
+struct worker_pool_st {
+	struct list_head head;
+	unsigned total;
+
+	ev_idle refill; /* active while the pool is not full */
+};
+
 /* Each worker process maps to a unique proc_st structure.
  */
 typedef struct proc_st {
@@ -88,8 +123,16 @@ typedef struct proc_st {
 	struct ev_child ev_child;
 
 	struct list_node list;
+	uint64_t list_id; /* increases with the insertion to proc_list */
 	int fd; /* the command file descriptor */
 	pid_t pid;
+
+	/* with worker-cmd-ring: the ring the worker sends its frequent
+	 * messages to, and the eventfd it signals */
+	struct cmd_ring_st *cmd_ring;
+	int cmd_ring_efd;
+	uint32_t cmd_ring_tail; /* our consumer index in cmd_ring */
+	ev_io cmd_ring_io;
 	time_t udp_fd_receive_time; /* when the corresponding process has received a UDP fd */
 	
 	time_t conn_time; /* the time the user connected */
@@ -99,6 +142,7 @@ typedef struct proc_st {
 	struct ip_lease_st *ipv4;
 	struct ip_lease_st *ipv6;
 	unsigned leases_in_use; /* someone else got our IP leases */
+	struct ping_probe_st *ping; /* the in flight probe of one of our leases */
 
 	struct sockaddr_storage remote_addr; /* peer address (CSTP) */
 	socklen_t remote_addr_len;
@@ -127,6 +171,10 @@ typedef struct proc_st {
 	char groupname[MAX_GROUPNAME_SIZE]; /* the owner's group */
 	char hostname[MAX_HOSTNAME_SIZE]; /* the requested hostname */
 
+	/* the entry of username in proc_table (if added) */
+	struct user_sessions_st *user_sessions;
+	struct list_node user_list;
+
 	/* the following are copied here from the worker process for reporting
 	 * purposes (from main-ctl-handler). */
 	char user_agent[MAX_AGENT_NAME];
@@ -136,6 +184,11 @@ typedef struct proc_st {
 	char dtls_compr[8];
 	unsigned mtu;
 
+	/* compression counters, as reported by the worker */
+	uint64_t comp_attempted;
+	uint64_t comp_skipped;
+	uint64_t comp_saved_bytes;
+
 	/* if the session is initiated by a cookie the following two are set
 	 * and are considered when generating an IP address. That is used to
 	 * generate the same address as previously allocated.
@@ -151,6 +204,12 @@ typedef struct proc_st {
 	uint32_t discon_reason; /* filled on session close */
 	
 	unsigned applied_iroutes; /* whether the iroutes in the config have been successfully applied */
+	/* with route-netlink: the IROUTE_* state of each iroute, and the
+	 * netlink sequence number of the first iroute's request */
+	uint8_t *iroutes_state;
+	uint32_t iroutes_seq;
+	unsigned iroutes_pending; /* requests not yet acknowledged by the kernel */
+	struct list_node iroutes_list; /* in route_nl_st while requests are pending */
 
 	/* The following we rely on talloc for deallocation */
 	GroupCfgSt *config; /* custom user/group config */
@@ -162,25 +221,48 @@ typedef struct proc_st {
 
 struct ip_lease_db_st {
 	struct htable ht;
+	struct list_head pools; /* struct ip_pool_st */
 };
 
 struct proc_list_st {
 	struct list_head head;
 	unsigned int total;
+	uint64_t last_id; /* the list_id of the newest entry */
 };
 
 struct script_list_st {
 	struct list_head head;
 };
 
+/* The number of buckets in the histogram of script run times; the
+ * upper bounds are 10ms, 100ms, 1s, 10s and infinity. */
+#define SCRIPT_RUNTIME_BUCKETS 5
+
+/* The helper process which executes the scripts */
+struct script_runner_st {
+	int fd;
+	pid_t pid;
+	ev_io io;
+	ev_child ev_child;
+	uint32_t next_id;
+};
+
 struct proc_hash_db_st {
 	struct htable *db_ip;
 	struct htable *db_dtls_ip;
 	struct htable *db_dtls_id;
 	struct htable *db_sid;
+	struct htable *db_user; /* of struct user_sessions_st */
 	unsigned total;
 };
 
+/* The sessions of a single username in proc_table */
+struct user_sessions_st {
+	struct list_head procs; /* of proc_st, linked via user_list */
+	unsigned sessions;
+	char username[MAX_USERNAME_SIZE];
+};
+
 struct main_stats_st {
 	uint64_t session_timeouts; /* sessions with timeout */
 	uint64_t session_idle_timeouts; /* sessions with idle timeout */
@@ -208,6 +290,7 @@ struct main_stats_st {
 	/* These are counted since start time */
 	uint64_t total_auth_failures; /* authentication failures since start_time */
 	uint64_t total_sessions_closed; /* sessions closed since start_time */
+	uint64_t script_runtimes[SCRIPT_RUNTIME_BUCKETS]; /* scripts executed since start_time */
 };
 
 typedef struct main_server_st {
@@ -217,10 +300,19 @@ typedef struct main_server_st {
 	struct ip_lease_db_st ip_leases;
 
 	struct htable *ban_db;
+	/* the ban_db entries in a min-heap on their cleanup time */
+	struct ban_entry_st **ban_heap;
+	unsigned ban_heap_size;
+	unsigned ban_heap_max;
 
 	struct listen_list_st listen_list;
 	struct proc_list_st proc_list;
 	struct script_list_st script_list;
+	struct script_runner_st script_runner;
+	struct ping_list_st ping_list;
+	struct route_nl_st route_nl;
+	struct metrics_st metrics;
+	struct worker_pool_st worker_pool;
 	/* maps DTLS session IDs to proc entries */
 	struct proc_hash_db_st proc_table;
 	
@@ -251,13 +343,16 @@ typedef struct main_server_st {
 } main_server_st;
 
 void clear_lists(main_server_st *s);
+struct worker_st *init_worker_process(main_server_st *s, int cmd_fd,
+				      struct cmd_ring_st *cmd_ring, int cmd_ring_efd);
 
 int handle_worker_commands(main_server_st *s, struct proc_st* cur);
+int handle_worker_ring(main_server_st *s, struct proc_st* cur);
 int handle_sec_mod_commands(main_server_st *s);
 
 int user_connected(main_server_st *s, struct proc_st* cur);
 void user_hostname_update(main_server_st *s, struct proc_st* cur);
-void user_disconnected(main_server_st *s, struct proc_st* cur);
+void user_disconnected(main_server_st *s, struct proc_st* cur, uint32_t connect_id);
 
 int send_udp_fd(main_server_st* s, struct proc_st * proc, int fd);
 
@@ -302,6 +397,7 @@ int handle_auth_cookie_req(main_server_st* s, struct proc_st* proc,
 
 int check_multiple_users(main_server_st *s, struct proc_st* proc);
 int handle_script_exit(main_server_st *s, struct proc_st* proc, int code);
+int resume_accept_user(main_server_st *s, struct proc_st* proc);
 
 int run_sec_mod(main_server_st * s, int *sync_fd);
 
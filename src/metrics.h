@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H
+# define METRICS_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+/* The counters are kept in a shared anonymous mapping which main creates
+ * before forking sec-mod and the workers, and reads when it is scraped.
+ * Each worker writes to the slot of its pid; since the slots are shared
+ * by several workers over time, all updates are atomic adds and main
+ * only ever sums them.
+ */
+#define METRICS_SLOTS 256
+
+struct worker_metrics_st {
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t dtls_rx_packets; /* the share of rx_packets received over DTLS */
+	uint64_t dtls_tx_packets;
+	uint64_t comp_in_bytes; /* the sizes of the packets before and after */
+	uint64_t comp_out_bytes; /* compression */
+	uint64_t mtu_changes;
+	uint64_t dpd_sent;
+	uint64_t dpd_timeouts;
+} __attribute__((aligned(64)));
+
+/* the upper bounds of the auth latency buckets in milliseconds; the
+ * last bucket is +Inf */
+#define METRICS_AUTH_BUCKETS {50, 100, 250, 500, 1000, 2000, 5000, 10000, 30000, 60000}
+#define METRICS_AUTH_BUCKETS_SIZE 11
+
+struct secmod_metrics_st {
+	uint64_t auth_latency[METRICS_AUTH_BUCKETS_SIZE];
+	uint64_t auth_latency_sum_ms;
+	uint64_t auth_queue_depth;
+} __attribute__((aligned(64)));
+
+struct metrics_shm_st {
+	struct secmod_metrics_st secmod;
+	struct worker_metrics_st workers[METRICS_SLOTS];
+};
+
+/* NULL when metrics-socket-file is not set */
+extern struct metrics_shm_st *metrics_shm;
+
+#define METRIC_ADD(m, field, n) do { \
+	if ((m) != NULL) \
+		__atomic_fetch_add(&(m)->field, (n), __ATOMIC_RELAXED); \
+	} while(0)
+
+#define METRIC_SET(m, field, n) do { \
+	if ((m) != NULL) \
+		__atomic_store_n(&(m)->field, (n), __ATOMIC_RELAXED); \
+	} while(0)
+
+inline static struct worker_metrics_st *worker_metrics_slot(pid_t pid)
+{
+	if (metrics_shm == NULL)
+		return NULL;
+	return &metrics_shm->workers[(unsigned)pid % METRICS_SLOTS];
+}
+
+inline static struct secmod_metrics_st *secmod_metrics(void)
+{
+	if (metrics_shm == NULL)
+		return NULL;
+	return &metrics_shm->secmod;
+}
+
+#endif
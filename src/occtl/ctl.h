@@ -16,6 +16,7 @@ enum {
 	CTL_CMD_UNBAN_IP,
 	CTL_CMD_TOP,
 	CTL_CMD_LIST_COOKIES,
+	CTL_CMD_LIST_PAGE,
 
 	CTL_CMD_STATUS_REP = 101,
 	CTL_CMD_RELOAD_REP,
@@ -29,4 +30,12 @@ enum {
 	CTL_CMD_LIST_COOKIES_REP
 };
 
+/* The optional fields of user_info_rep in CTL_CMD_LIST_PAGE replies */
+#define USER_INFO_FIELD_SESSION 1 /* host, user agent, ciphersuites, compression, MTU */
+#define USER_INFO_FIELD_CONFIG (1<<1) /* rates, DNS, routes, iroutes, firewall ports */
+#define USER_INFO_FIELD_ALL (USER_INFO_FIELD_SESSION|USER_INFO_FIELD_CONFIG)
+
+/* The maximum number of users in a CTL_CMD_LIST_PAGE reply */
+#define CTL_LIST_PAGE_MAX 256
+
 #endif
@@ -57,7 +57,7 @@ static const commands_st commands[] = {
 	      "Reloads the server configuration", 1, 1),
 	ENTRY("show status", NULL, handle_status_cmd,
 	      "Prints the status and statistics of the server", 1, 1),
-	ENTRY("show users", NULL, handle_list_users_cmd,
+	ENTRY("show users", "[FILTERS]", handle_list_users_cmd,
 	      "Prints the connected users", 1, 1),
 	ENTRY("show ip bans", NULL, handle_list_banned_ips_cmd,
 	      "Prints the banned IP addresses", 1, 1),
@@ -72,6 +72,7 @@ static uint8_t msg_map[] = {
         [CTL_CMD_RELOAD] = CTL_CMD_RELOAD_REP,
         [CTL_CMD_STOP] = CTL_CMD_STOP_REP,
         [CTL_CMD_LIST] = CTL_CMD_LIST_REP,
+        [CTL_CMD_LIST_PAGE] = CTL_CMD_LIST_REP,
         [CTL_CMD_LIST_COOKIES] = CTL_CMD_LIST_COOKIES_REP,
         [CTL_CMD_LIST_BANNED] = CTL_CMD_LIST_BANNED_REP,
         [CTL_CMD_USER_INFO] = CTL_CMD_LIST_REP,
@@ -206,6 +207,7 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 	char buf[MAX_TMPSTR_SIZE];
 	time_t t;
 	struct tm *tm;
+	unsigned i;
 	PROTOBUF_ALLOCATOR(pa, ctx);
 
 	init_reply(&raw);
@@ -246,6 +248,25 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 		print_single_value_int(stdout, params, "Total sessions", rep->total_sessions_closed, 1);
 		print_single_value_int(stdout, params, "Total authentication failures", rep->total_auth_failures, 1);
 		print_single_value_int(stdout, params, "IPs in ban list", rep->banned_ips, 1);
+		for (i=0;i<rep->n_ip_pools;i++) {
+			IpPoolRep *p = rep->ip_pools[i];
+			char name[96];
+
+			if (strchr(p->network, ':') != NULL)
+				snprintf(name, sizeof(name), "IP pool %s (/%u)", p->network, (unsigned)p->subnet_prefix);
+			else
+				snprintf(name, sizeof(name), "IP pool %s", p->network);
+			snprintf(buf, sizeof(buf), "%u/%u (%u%%)", (unsigned)p->used, (unsigned)p->size,
+				 p->size > 0 ? (unsigned)((uint64_t)p->used * 100 / p->size) : 0);
+			print_single_value(stdout, params, name, buf, 1);
+		}
+		if (rep->n_script_runtimes == 5) {
+			snprintf(buf, sizeof(buf), "<10ms: %lu, <100ms: %lu, <1s: %lu, <10s: %lu, >=10s: %lu",
+				 (unsigned long)rep->script_runtimes[0], (unsigned long)rep->script_runtimes[1],
+				 (unsigned long)rep->script_runtimes[2], (unsigned long)rep->script_runtimes[3],
+				 (unsigned long)rep->script_runtimes[4]);
+			print_single_value(stdout, params, "Script runtimes", buf, 1);
+		}
 		if (params && params->debug) {
 			print_single_value_int(stdout, params, "Sec-mod client entries", rep->secmod_client_entries, 1);
 			print_single_value_int(stdout, params, "TLS DB entries", rep->stored_tls_sessions, 1);
@@ -627,26 +648,115 @@ void common_user_list(struct unix_ctx *ctx, UserListRep *rep, FILE *out, cmd_par
 	}
 }
 
+/* Parses the filters of 'show users'; a space separated list of
+ * user=NAME, group=NAME, vhost=NAME and ip=ADDRESS[/PREFIX].
+ */
+static int parse_user_filters(void *pool, const char *arg, UserListReq *req)
+{
+	char *str, *tok, *sp = NULL;
+
+	if (arg == NULL)
+		return 0;
+
+	str = talloc_strdup(pool, arg);
+	if (str == NULL)
+		return -1;
+
+	for (tok = strtok_r(str, " \t", &sp); tok != NULL; tok = strtok_r(NULL, " \t", &sp)) {
+		if (strncmp(tok, "user=", 5) == 0) {
+			req->username = tok + 5;
+		} else if (strncmp(tok, "group=", 6) == 0) {
+			req->groupname = tok + 6;
+		} else if (strncmp(tok, "vhost=", 6) == 0) {
+			req->vhost = tok + 6;
+		} else if (strncmp(tok, "ip=", 3) == 0) {
+			req->ip = tok + 3;
+		} else {
+			fprintf(stderr, "unknown filter '%s'; the available are user=, group=, vhost= and ip=\n", tok);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Retrieves the users matching @req a page at a time, so that the
+ * server is not blocked by a large reply, and returns them as a single
+ * list allocated under @pool.
+ */
+static UserListRep *fetch_user_list(struct unix_ctx *ctx, void *pool, UserListReq *req)
+{
+	struct cmd_reply_st raw;
+	UserListRep *all, *rep;
+	UserInfoRep **users;
+	PROTOBUF_ALLOCATOR(pa, pool);
+	int ret;
+
+	all = talloc(pool, UserListRep);
+	if (all == NULL)
+		return NULL;
+	user_list_rep__init(all);
+
+	req->max_users = CTL_LIST_PAGE_MAX;
+	req->has_max_users = 1;
+
+	do {
+		init_reply(&raw);
+
+		ret = send_cmd(ctx, CTL_CMD_LIST_PAGE, req,
+			       (pack_size_func)user_list_req__get_packed_size,
+			       (pack_func)user_list_req__pack, &raw);
+		if (ret < 0)
+			return NULL;
+
+		rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+		free_reply(&raw);
+		if (rep == NULL)
+			return NULL;
+
+		users = talloc_realloc(pool, all->user, UserInfoRep *, all->n_user + rep->n_user);
+		if (users == NULL)
+			return NULL;
+		memcpy(&users[all->n_user], rep->user, rep->n_user * sizeof(UserInfoRep *));
+		all->user = users;
+		all->n_user += rep->n_user;
+
+		req->cursor = rep->next_cursor;
+		req->has_cursor = 1;
+	} while (rep->has_next_cursor);
+
+	return all;
+}
+
 int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
-	struct cmd_reply_st raw;
 	UserListRep *rep = NULL;
+	UserListReq req = USER_LIST_REQ__INIT;
 	FILE *out;
-	PROTOBUF_ALLOCATOR(pa, ctx);
+	void *pool;
 
-	init_reply(&raw);
+	pool = talloc_new(ctx);
+	if (pool == NULL)
+		return 1;
+
+	if (parse_user_filters(pool, arg, &req) < 0) {
+		talloc_free(pool);
+		return 1;
+	}
+
+	/* the table lists only some of the session fields */
+	if (HAVE_JSON(params))
+		req.fields = USER_INFO_FIELD_ALL;
+	else
+		req.fields = USER_INFO_FIELD_SESSION;
+	req.has_fields = 1;
 
 	entries_clear();
 
 	out = pager_start(params);
 
-	ret = send_cmd(ctx, CTL_CMD_LIST, NULL, NULL, NULL, &raw);
-	if (ret < 0) {
-		goto error;
-	}
-
-	rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+	rep = fetch_user_list(ctx, pool, &req);
 	if (rep == NULL)
 		goto error;
 
@@ -660,10 +770,7 @@ int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *
 	fprintf(stderr, ERR_SERVER_UNREACHABLE);
 
  cleanup:
-	if (rep != NULL)
-		user_list_rep__free_unpacked(rep, &pa);
-
-	free_reply(&raw);
+	talloc_free(pool);
 	pager_stop(out);
 
 	return ret;
@@ -834,25 +941,25 @@ int handle_list_all_sessions_cmd(struct unix_ctx *ctx, const char *arg, cmd_para
 int handle_list_iroutes_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
-	struct cmd_reply_st raw;
 	UserListRep *rep = NULL;
+	UserListReq req = USER_LIST_REQ__INIT;
 	FILE *out;
 	unsigned i, j;
-	PROTOBUF_ALLOCATOR(pa, ctx);
+	void *pool;
 
-	init_reply(&raw);
+	pool = talloc_new(ctx);
+	if (pool == NULL)
+		return 1;
 
 	entries_clear();
 
 	out = pager_start(params);
 
-	/* get all user info */
-	ret = send_cmd(ctx, CTL_CMD_LIST, NULL, NULL, NULL, &raw);
-	if (ret < 0) {
-		goto error;
-	}
+	/* get the iroutes of all users */
+	req.fields = USER_INFO_FIELD_CONFIG;
+	req.has_fields = 1;
 
-	rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+	rep = fetch_user_list(ctx, pool, &req);
 	if (rep == NULL)
 		goto error;
 
@@ -908,10 +1015,7 @@ int handle_list_iroutes_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 	fprintf(stderr, ERR_SERVER_UNREACHABLE);
 
  cleanup:
-	if (rep != NULL)
-		user_list_rep__free_unpacked(rep, &pa);
-
-	free_reply(&raw);
+	talloc_free(pool);
 	pager_stop(out);
 
 	return ret;
@@ -1152,6 +1256,17 @@ int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
 		print_single_value(out, params, "TLS ciphersuite", args->user[i]->tls_ciphersuite, 1);
 		print_single_value(out, params, "DTLS cipher", args->user[i]->dtls_ciphersuite, 1);
 		print_pair_value(out, params, "CSTP compression", args->user[i]->cstp_compr, "DTLS compression", args->user[i]->dtls_compr, 1);
+		if (args->user[i]->has_comp_attempted) {
+			char buf1[32];
+			char buf2[32];
+
+			snprintf(buf1, sizeof(buf1), "%lu", (unsigned long)args->user[i]->comp_attempted);
+			snprintf(buf2, sizeof(buf2), "%lu", (unsigned long)args->user[i]->comp_skipped);
+			print_pair_value(out, params, "Compressed packets", buf1, "Skipped packets", buf2, 1);
+
+			bytes2human(args->user[i]->comp_saved_bytes, tmpbuf, sizeof(tmpbuf), NULL);
+			print_single_value(out, params, "Compression savings", tmpbuf, 1);
+		}
 
 		print_separator(out, params);
 		/* user network info */
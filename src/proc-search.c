@@ -38,6 +38,11 @@ struct find_sid_st {
 	const uint8_t *sid;
 };
 
+static size_t hash_username(const char *username)
+{
+	return hash_any(username, strlen(username), 0);
+}
+
 
 static size_t rehash_ip(const void* _p, void* unused)
 {
@@ -71,16 +76,33 @@ static size_t rehash_sid(const void* _p, void* unused)
 	return hash_any(proc->sid, sizeof(proc->sid), 0);
 }
 
+static size_t rehash_user(const void* _p, void* unused)
+{
+	const struct user_sessions_st * u = _p;
+
+	return hash_username(u->username);
+}
+
+static bool user_cmp(const void* _c1, void* _c2)
+{
+	const struct user_sessions_st* c1 = _c1;
+	const char* c2 = _c2;
+
+	return strcmp(c1->username, c2) == 0;
+}
+
 void proc_table_init(main_server_st *s)
 {
 	s->proc_table.db_ip = talloc(s, struct htable);
 	s->proc_table.db_dtls_ip = talloc(s, struct htable);
 	s->proc_table.db_dtls_id = talloc(s, struct htable);
 	s->proc_table.db_sid = talloc(s, struct htable);
+	s->proc_table.db_user = talloc(s, struct htable);
 	htable_init(s->proc_table.db_ip, rehash_ip, NULL);
 	htable_init(s->proc_table.db_dtls_ip, rehash_dtls_ip, NULL);
 	htable_init(s->proc_table.db_dtls_id, rehash_dtls_id, NULL);
 	htable_init(s->proc_table.db_sid, rehash_sid, NULL);
+	htable_init(s->proc_table.db_user, rehash_user, NULL);
 	s->proc_table.total = 0;
 }
 
@@ -90,14 +112,65 @@ void proc_table_deinit(main_server_st *s)
 	htable_clear(s->proc_table.db_dtls_ip);
 	htable_clear(s->proc_table.db_dtls_id);
 	htable_clear(s->proc_table.db_sid);
+	htable_clear(s->proc_table.db_user);
 	talloc_free(s->proc_table.db_ip);
 	talloc_free(s->proc_table.db_dtls_ip);
 	talloc_free(s->proc_table.db_dtls_id);
 	talloc_free(s->proc_table.db_sid);
+	/* the user_sessions_st entries are allocated under db_user */
+	talloc_free(s->proc_table.db_user);
+}
+
+/* Links the proc into the sessions of its username, creating the
+ * entry if this is the first session of the user.
+ */
+static int user_sessions_add(main_server_st *s, struct proc_st *proc)
+{
+	struct user_sessions_st *u;
+	size_t h = hash_username(proc->username);
+
+	u = htable_get(s->proc_table.db_user, h, user_cmp, proc->username);
+	if (u == NULL) {
+		u = talloc(s->proc_table.db_user, struct user_sessions_st);
+		if (u == NULL)
+			return -1;
+
+		list_head_init(&u->procs);
+		u->sessions = 0;
+		strlcpy(u->username, proc->username, sizeof(u->username));
+
+		if (htable_add(s->proc_table.db_user, h, u) == 0) {
+			talloc_free(u);
+			return -1;
+		}
+	}
+
+	list_add_tail(&u->procs, &proc->user_list);
+	u->sessions++;
+	proc->user_sessions = u;
+
+	return 0;
+}
+
+static void user_sessions_del(main_server_st *s, struct proc_st *proc)
+{
+	struct user_sessions_st *u = proc->user_sessions;
+
+	if (u == NULL)
+		return;
+
+	list_del(&proc->user_list);
+	proc->user_sessions = NULL;
+
+	if (--u->sessions == 0) {
+		htable_del(s->proc_table.db_user, hash_username(u->username), u);
+		talloc_free(u);
+	}
 }
 
-/* Adds the IP of the CSTP channel into the IPs hash table and
- * the session ID into the IDs hash table.
+/* Adds the IP of the CSTP channel into the IPs hash table,
+ * the session ID into the IDs hash table, and the proc into
+ * the sessions of its username.
  */
 int proc_table_add(main_server_st *s, struct proc_st *proc)
 {
@@ -119,6 +192,13 @@ int proc_table_add(main_server_st *s, struct proc_st *proc)
 		return -1;
 	}
 
+	if (user_sessions_add(s, proc) < 0) {
+		htable_del(s->proc_table.db_ip, ip_hash, proc);
+		htable_del(s->proc_table.db_dtls_id, dtls_id_hash, proc);
+		htable_del(s->proc_table.db_sid, rehash_sid(proc, NULL), proc);
+		return -1;
+	}
+
 	s->proc_table.total++;
 
 	return 0;
@@ -207,6 +287,7 @@ void proc_table_del(main_server_st *s, struct proc_st *proc)
 	htable_del(s->proc_table.db_ip, rehash_ip(proc, NULL), proc);
 	htable_del(s->proc_table.db_dtls_id, rehash_dtls_id(proc, NULL), proc);
 	htable_del(s->proc_table.db_sid, rehash_sid(proc, NULL), proc);
+	user_sessions_del(s, proc);
 }
 
 static bool local_ip_cmp(const void* _c1, void* _c2)
@@ -318,3 +399,13 @@ struct proc_st *proc_search_sid(struct main_server_st *s,
 	return htable_get(s->proc_table.db_sid, hash_any(sid, SID_SIZE, 0), sid_cmp, &fsid);
 }
 
+
+/* Returns the sessions of the given username, or NULL if there
+ * are none.
+ */
+struct user_sessions_st *proc_search_user(struct main_server_st *s,
+					  const char *username)
+{
+	return htable_get(s->proc_table.db_user, hash_username(username),
+			  user_cmp, (void*)username);
+}
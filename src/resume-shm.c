@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+#include <vpn.h>
+#include <common.h>
+#include <ip-util.h>
+#include <resume-shm.h>
+
+#ifdef HAVE_LIBPTHREAD
+# include <pthread.h>
+
+#define TAG_SIZE 16
+#define KEY_SIZE 16
+#define NONCE_SIZE 12
+#define AUTH_SIZE 16
+
+/* how long to wait for the lock of a set, before treating the
+ * operation as a cache miss */
+#define LOCK_TIMEOUT_MS 20
+
+struct resume_shm_entry_st {
+	uint8_t tag[TAG_SIZE]; /* keyed hash of the session ID */
+	uint8_t used;
+	uint8_t referenced; /* the clock bit */
+	uint32_t size; /* of the encrypted data */
+	uint64_t stored; /* the time the entry was stored */
+	uint8_t nonce[NONCE_SIZE];
+	uint8_t auth[AUTH_SIZE];
+	uint8_t data[MAX_SESSION_DATA_SIZE];
+};
+
+struct resume_shm_set_st {
+	pthread_mutex_t lock;
+	uint32_t hand;
+	struct resume_shm_entry_st e[RESUME_SHM_WAYS];
+};
+
+/* These are copied to the workers on fork, and never read from the
+ * mapping, which any worker can write to. */
+static struct resume_shm_set_st *sets = NULL;
+static unsigned sets_size = 0;
+static uint8_t secret[32];
+
+int resume_shm_init(unsigned entries)
+{
+	pthread_mutexattr_t attr;
+	struct resume_shm_set_st *p;
+	unsigned i, n;
+	int ret;
+
+	if (entries == 0)
+		return 0;
+
+	n = (entries + RESUME_SHM_WAYS - 1) / RESUME_SHM_WAYS;
+
+	ret = gnutls_rnd(GNUTLS_RND_KEY, secret, sizeof(secret));
+	if (ret < 0)
+		return -1;
+
+	p = mmap(NULL, n * sizeof(struct resume_shm_set_st), PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	/* a worker may be killed while holding the lock */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+	for (i = 0; i < n; i++) {
+		ret = pthread_mutex_init(&p[i].lock, &attr);
+		if (ret != 0) {
+			pthread_mutexattr_destroy(&attr);
+			munmap(p, n * sizeof(struct resume_shm_set_st));
+			return -1;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	sets = p;
+	sets_size = n;
+	return 0;
+}
+
+unsigned resume_shm_enabled(void)
+{
+	return sets != NULL;
+}
+
+/* The lock is in the mapping, so a worker may hold it, or corrupt it;
+ * it is never waited on for more than LOCK_TIMEOUT_MS. */
+static int lock_set(struct resume_shm_set_st *set)
+{
+	struct timespec ts;
+	int ret;
+
+	ret = pthread_mutex_trylock(&set->lock);
+	if (ret == EBUSY) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOCK_TIMEOUT_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		ret = pthread_mutex_timedlock(&set->lock, &ts);
+	}
+	if (ret == EOWNERDEAD) {
+		/* the entry it was writing will fail to decrypt */
+		pthread_mutex_consistent(&set->lock);
+		return 0;
+	}
+
+	return ret == 0 ? 0 : -1;
+}
+
+/* Returns the set of the session ID, and its tag in @tag */
+static struct resume_shm_set_st *id_to_set(const gnutls_datum_t *id, uint8_t tag[TAG_SIZE])
+{
+	uint8_t digest[32];
+	uint32_t h;
+
+	if (gnutls_hmac_fast(GNUTLS_MAC_SHA256, secret, sizeof(secret),
+			     id->data, id->size, digest) < 0)
+		return NULL;
+
+	memcpy(tag, digest, TAG_SIZE);
+	memcpy(&h, digest+TAG_SIZE, sizeof(h));
+
+	return &sets[h % sets_size];
+}
+
+static int derive_key(const gnutls_datum_t *id,
+		      const struct sockaddr_storage *addr, unsigned addr_len,
+		      const char *vhost, uint8_t key[KEY_SIZE])
+{
+	gnutls_hmac_hd_t h;
+	uint8_t digest[32];
+	uint8_t len;
+
+	if (gnutls_hmac_init(&h, GNUTLS_MAC_SHA256, secret, sizeof(secret)) < 0)
+		return -1;
+
+	len = id->size;
+	gnutls_hmac(h, &len, 1);
+	gnutls_hmac(h, id->data, id->size);
+	if (vhost)
+		gnutls_hmac(h, vhost, strlen(vhost)+1);
+	else
+		gnutls_hmac(h, "", 1);
+	gnutls_hmac(h, SA_IN_P_GENERIC(addr, addr_len), SA_IN_SIZE(addr_len));
+	gnutls_hmac_deinit(h, digest);
+
+	memcpy(key, digest, KEY_SIZE);
+	safe_memset(digest, 0, sizeof(digest));
+	return 0;
+}
+
+static gnutls_cipher_hd_t cipher_init(const uint8_t key[KEY_SIZE],
+				      const uint8_t nonce[NONCE_SIZE],
+				      const uint8_t tag[TAG_SIZE])
+{
+	gnutls_cipher_hd_t h;
+	gnutls_datum_t k, iv;
+
+	k.data = (void*)key;
+	k.size = KEY_SIZE;
+	iv.data = (void*)nonce;
+	iv.size = NONCE_SIZE;
+
+	if (gnutls_cipher_init(&h, GNUTLS_CIPHER_AES_128_GCM, &k, &iv) < 0)
+		return NULL;
+
+	if (gnutls_cipher_add_auth(h, tag, TAG_SIZE) < 0) {
+		gnutls_cipher_deinit(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static unsigned auth_cmp(const uint8_t *a, const uint8_t *b)
+{
+	unsigned i, d = 0;
+
+	for (i = 0; i < AUTH_SIZE; i++)
+		d |= a[i] ^ b[i];
+
+	return d;
+}
+
+static struct resume_shm_entry_st *find_entry(struct resume_shm_set_st *set,
+					      const uint8_t tag[TAG_SIZE])
+{
+	unsigned i;
+
+	for (i = 0; i < RESUME_SHM_WAYS; i++) {
+		if (set->e[i].used && memcmp(set->e[i].tag, tag, TAG_SIZE) == 0)
+			return &set->e[i];
+	}
+
+	return NULL;
+}
+
+int resume_shm_fetch(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, time_t expiration, gnutls_datum_t *data)
+{
+	struct resume_shm_set_st *set;
+	struct resume_shm_entry_st *e;
+	uint8_t tag[TAG_SIZE], key[KEY_SIZE], nonce[NONCE_SIZE];
+	uint8_t auth[AUTH_SIZE], auth2[AUTH_SIZE];
+	gnutls_cipher_hd_t h;
+	unsigned size;
+	uint64_t stored;
+	uint8_t *p;
+	int ret = -1;
+
+	if (sets == NULL || addr_len == 0)
+		return -1;
+
+	set = id_to_set(id, tag);
+	if (set == NULL)
+		return -1;
+
+	p = gnutls_malloc(MAX_SESSION_DATA_SIZE);
+	if (p == NULL)
+		return -1;
+
+	/* copy the entry under the lock, and decrypt it afterwards */
+	if (lock_set(set) < 0)
+		goto cleanup;
+
+	e = find_entry(set, tag);
+	if (e == NULL) {
+		pthread_mutex_unlock(&set->lock);
+		goto cleanup;
+	}
+
+	size = e->size;
+	stored = e->stored;
+	if (size > MAX_SESSION_DATA_SIZE) {
+		e->used = 0;
+		pthread_mutex_unlock(&set->lock);
+		goto cleanup;
+	}
+
+	e->referenced = 1;
+	memcpy(nonce, e->nonce, NONCE_SIZE);
+	memcpy(auth, e->auth, AUTH_SIZE);
+	memcpy(p, e->data, size);
+	pthread_mutex_unlock(&set->lock);
+
+	if (time(0) - (time_t)stored > expiration)
+		goto cleanup;
+
+	if (derive_key(id, addr, addr_len, vhost, key) < 0)
+		goto cleanup;
+
+	h = cipher_init(key, nonce, tag);
+	safe_memset(key, 0, sizeof(key));
+	if (h == NULL)
+		goto cleanup;
+
+	if (gnutls_cipher_decrypt2(h, p, size, p, size) < 0 ||
+	    gnutls_cipher_tag(h, auth2, AUTH_SIZE) < 0 ||
+	    auth_cmp(auth, auth2) != 0) {
+		gnutls_cipher_deinit(h);
+		goto cleanup;
+	}
+	gnutls_cipher_deinit(h);
+
+	data->data = p;
+	data->size = size;
+	p = NULL;
+	ret = 0;
+
+ cleanup:
+	if (p != NULL) {
+		safe_memset(p, 0, MAX_SESSION_DATA_SIZE);
+		gnutls_free(p);
+	}
+	return ret;
+}
+
+int resume_shm_store(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, const gnutls_datum_t *data)
+{
+	struct resume_shm_set_st *set;
+	struct resume_shm_entry_st *e;
+	uint8_t tag[TAG_SIZE], key[KEY_SIZE], nonce[NONCE_SIZE];
+	uint8_t auth[AUTH_SIZE];
+	uint8_t *p;
+	gnutls_cipher_hd_t h;
+	time_t now = time(0);
+	unsigned i, hand;
+	int ret = -1;
+
+	if (sets == NULL || addr_len == 0 || data->size == 0 ||
+	    data->size > MAX_SESSION_DATA_SIZE)
+		return -1;
+
+	set = id_to_set(id, tag);
+	if (set == NULL)
+		return -1;
+
+	/* encrypt out of the lock */
+	p = gnutls_malloc(data->size);
+	if (p == NULL)
+		return -1;
+
+	if (derive_key(id, addr, addr_len, vhost, key) < 0)
+		goto cleanup;
+
+	if (gnutls_rnd(GNUTLS_RND_NONCE, nonce, sizeof(nonce)) < 0)
+		goto cleanup;
+
+	h = cipher_init(key, nonce, tag);
+	safe_memset(key, 0, sizeof(key));
+	if (h == NULL)
+		goto cleanup;
+
+	if (gnutls_cipher_encrypt2(h, data->data, data->size, p, data->size) < 0 ||
+	    gnutls_cipher_tag(h, auth, AUTH_SIZE) < 0) {
+		gnutls_cipher_deinit(h);
+		goto cleanup;
+	}
+	gnutls_cipher_deinit(h);
+
+	if (lock_set(set) < 0)
+		goto cleanup;
+
+	e = find_entry(set, tag);
+	if (e == NULL) {
+		/* an unused entry, otherwise the first one without
+		 * its clock bit set */
+		hand = set->hand % RESUME_SHM_WAYS;
+		for (i = 0; i < 2*RESUME_SHM_WAYS; i++) {
+			e = &set->e[hand];
+			hand = (hand + 1) % RESUME_SHM_WAYS;
+
+			if (!e->used || e->referenced == 0)
+				break;
+			e->referenced = 0;
+		}
+		set->hand = hand;
+	}
+
+	memcpy(e->tag, tag, TAG_SIZE);
+	memcpy(e->nonce, nonce, NONCE_SIZE);
+	memcpy(e->auth, auth, AUTH_SIZE);
+	memcpy(e->data, p, data->size);
+	e->size = data->size;
+	e->stored = now;
+	e->referenced = 0;
+	e->used = 1;
+
+	pthread_mutex_unlock(&set->lock);
+	ret = 0;
+
+ cleanup:
+	gnutls_free(p);
+	return ret;
+}
+
+void resume_shm_delete(const gnutls_datum_t *id)
+{
+	struct resume_shm_set_st *set;
+	struct resume_shm_entry_st *e;
+	uint8_t tag[TAG_SIZE];
+
+	if (sets == NULL)
+		return;
+
+	set = id_to_set(id, tag);
+	if (set == NULL)
+		return;
+
+	if (lock_set(set) < 0)
+		return;
+
+	e = find_entry(set, tag);
+	if (e != NULL) {
+		e->used = 0;
+		e->size = 0;
+	}
+
+	pthread_mutex_unlock(&set->lock);
+}
+
+#else
+
+int resume_shm_init(unsigned entries)
+{
+	return entries == 0 ? 0 : -1;
+}
+
+unsigned resume_shm_enabled(void)
+{
+	return 0;
+}
+
+int resume_shm_fetch(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, time_t expiration, gnutls_datum_t *data)
+{
+	return -1;
+}
+
+int resume_shm_store(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, const gnutls_datum_t *data)
+{
+	return -1;
+}
+
+void resume_shm_delete(const gnutls_datum_t *id)
+{
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RESUME_SHM_H
+# define RESUME_SHM_H
+
+#include <config.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <gnutls/gnutls.h>
+
+/* The TLS session resumption cache of tls-session-cache-size. It is a
+ * shared anonymous mapping which main creates before forking the
+ * workers, and which the workers read and update directly, instead of
+ * sending each lookup to sec-mod.
+ *
+ * The entries are split in sets of RESUME_SHM_WAYS, each with its own
+ * lock, and a session ID maps to a single set; when a set is full the
+ * entry to replace is selected using the clock algorithm. The entries
+ * are encrypted with a key derived from the session ID, the client's
+ * address and the virtual host, thus a worker can only read the entries
+ * of sessions it has seen, and entries do not resume from another
+ * address or virtual host.
+ *
+ * This limits what a worker can read from the cache, not what it can
+ * break: any worker can overwrite the entries and the locks of the
+ * sets. The locks are thus only waited on for a short time, and a set
+ * which cannot be locked is treated as a cache miss.
+ */
+#define RESUME_SHM_WAYS 16
+
+/* Returns -1 if the cache could not be allocated */
+int resume_shm_init(unsigned entries);
+
+/* non-zero if the cache is in use */
+unsigned resume_shm_enabled(void);
+
+/* Returns 0 and an allocated @data on success */
+int resume_shm_fetch(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, time_t expiration, gnutls_datum_t *data);
+
+int resume_shm_store(const gnutls_datum_t *id,
+		     const struct sockaddr_storage *addr, unsigned addr_len,
+		     const char *vhost, const gnutls_datum_t *data);
+
+void resume_shm_delete(const gnutls_datum_t *id);
+
+#endif
@@ -33,6 +33,15 @@
 #include <main.h>
 #include <str.h>
 #include <common.h>
+#include <ip-util.h>
+#include <cloexec.h>
+
+#ifdef __linux__
+# include <net/if.h>
+# include <arpa/inet.h>
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
 
 static
 int call_script(main_server_st *s, proc_st *proc, const char *cmd)
@@ -155,6 +164,406 @@ int route_del(struct main_server_st* s, proc_st *proc, const char* route, const
 	return route_adddel(s, proc, GETCONFIG(s)->route_del_cmd, route, dev);
 }
 
+#ifdef __linux__
+/* The iroutes are applied using a long-lived rtnetlink socket when
+ * route-netlink is set. The requests for all the iroutes of a session
+ * are sent in a single message, and the outcome of each route is
+ * recorded in proc->iroutes_state. The kernel processes the requests
+ * when they are sent, so the acknowledgements are normally read right
+ * after; any which arrive later are processed from the event loop.
+ */
+
+#define ROUTE_NL_MSG_SIZE (NLMSG_SPACE(sizeof(struct rtmsg)) + \
+			   RTA_SPACE(sizeof(struct in6_addr)) + RTA_SPACE(sizeof(uint32_t)))
+#define ROUTE_NL_RCVBUF (1024*1024)
+#define MAX_ROUTE_NL_READS 16
+
+/* Parses an iroute in the address/mask or address/prefix format */
+static int parse_route(void *pool, const char *route, int *family,
+		       uint8_t addr[16], unsigned *prefix)
+{
+	char *cidr, *p;
+	unsigned max;
+	int ret = -1;
+
+	cidr = ipv4_route_to_cidr(pool, route);
+	if (cidr == NULL)
+		return -1;
+
+	p = strchr(cidr, '/');
+	if (p != NULL)
+		*p++ = 0;
+
+	if (inet_pton(AF_INET, cidr, addr) == 1) {
+		*family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, cidr, addr) == 1) {
+		*family = AF_INET6;
+		max = 128;
+	} else {
+		goto fail;
+	}
+
+	if (p == NULL) {
+		*prefix = max;
+	} else {
+		if (*p < '0' || *p > '9')
+			goto fail;
+		*prefix = atoi(p);
+		if (*prefix > max)
+			goto fail;
+	}
+
+	ret = 0;
+ fail:
+	talloc_free(cidr);
+	return ret;
+}
+
+static void add_rtattr(struct nlmsghdr *nh, int type, const void *data, unsigned len)
+{
+	struct rtattr *rta = (struct rtattr *)(((uint8_t *)nh) + NLMSG_ALIGN(nh->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+/* Appends a route request to @buf; returns its size or zero on error */
+static unsigned route_nl_msg(main_server_st *s, proc_st *proc, uint8_t *buf,
+			     int cmd, const char *route, int ifindex, uint32_t seq)
+{
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	struct rtmsg *rtm;
+	uint8_t addr[16];
+	uint32_t oif = ifindex;
+	unsigned prefix;
+	int family;
+
+	if (parse_route(proc, route, &family, addr, &prefix) < 0) {
+		mslog(s, proc, LOG_ERR, "cannot parse iroute '%s'", route);
+		return 0;
+	}
+
+	memset(buf, 0, ROUTE_NL_MSG_SIZE);
+	nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	nh->nlmsg_type = cmd;
+	nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (cmd == RTM_NEWROUTE)
+		nh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+	nh->nlmsg_seq = seq;
+
+	rtm = NLMSG_DATA(nh);
+	rtm->rtm_family = family;
+	rtm->rtm_dst_len = prefix;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_BOOT;
+	rtm->rtm_scope = RT_SCOPE_LINK;
+	rtm->rtm_type = RTN_UNICAST;
+
+	add_rtattr(nh, RTA_DST, addr, family == AF_INET ? 4 : 16);
+	add_rtattr(nh, RTA_OIF, &oif, sizeof(oif));
+
+	return NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+static void route_nl_done(main_server_st *s, proc_st *proc)
+{
+	unsigned i, failed = 0;
+
+	list_del(&proc->iroutes_list);
+	proc->iroutes_pending = 0;
+
+	for (i=0;i<proc->config->n_iroutes;i++) {
+		if (proc->iroutes_state[i] == IROUTE_FAILED)
+			failed++;
+	}
+
+	if (failed > 0) {
+		mslog(s, proc, LOG_ERR, "%u of %u iroutes could not be applied",
+		      failed, (unsigned)proc->config->n_iroutes);
+
+		/* otherwise the failure is returned by route_nl_apply() */
+		if (proc->status == PS_AUTH_COMPLETED) {
+			mslog(s, proc, LOG_ERR, "could not apply routes for user; disconnecting");
+			terminate_proc(s, proc);
+		}
+	} else
+		mslog(s, proc, LOG_DEBUG, "applied %u iroutes", (unsigned)proc->config->n_iroutes);
+}
+
+static void route_nl_ack(main_server_st *s, uint32_t seq, int error)
+{
+	struct proc_st *proc;
+	uint32_t i;
+
+	list_for_each(&s->route_nl.head, proc, iroutes_list) {
+		i = seq - proc->iroutes_seq;
+		if (i >= proc->config->n_iroutes ||
+		    proc->iroutes_state[i] != IROUTE_PENDING)
+			continue;
+
+		if (error == 0) {
+			proc->iroutes_state[i] = IROUTE_APPLIED;
+		} else {
+			proc->iroutes_state[i] = IROUTE_FAILED;
+			mslog(s, proc, LOG_ERR, "could not add iroute %s: %s",
+			      proc->config->iroutes[i], strerror(-error));
+		}
+
+		if (--proc->iroutes_pending == 0)
+			route_nl_done(s, proc);
+		return;
+	}
+
+	/* a route removal */
+	if (error != 0 && error != -ESRCH)
+		mslog(s, NULL, LOG_DEBUG, "could not remove iroute: %s", strerror(-error));
+}
+
+static void route_nl_read(main_server_st *s, int fd)
+{
+	struct proc_st *proc, *pos;
+	uint8_t buf[8192];
+	struct nlmsghdr *nh;
+	struct nlmsgerr *err;
+	unsigned i, j;
+	int len;
+
+	for (i = 0; i < MAX_ROUTE_NL_READS; i++) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno != ENOBUFS)
+				break;
+
+			/* acknowledgements were lost; assume that the pending
+			 * routes were added, so that they are removed later */
+			mslog(s, NULL, LOG_ERR, "rtnetlink receive buffer overflow");
+			list_for_each_safe(&s->route_nl.head, proc, pos, iroutes_list) {
+				for (j=0;j<proc->config->n_iroutes;j++) {
+					if (proc->iroutes_state[j] == IROUTE_PENDING)
+						proc->iroutes_state[j] = IROUTE_APPLIED;
+				}
+				route_nl_done(s, proc);
+			}
+			continue;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type != NLMSG_ERROR ||
+			    nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+				continue;
+
+			err = NLMSG_DATA(nh);
+			route_nl_ack(s, nh->nlmsg_seq, err->error);
+		}
+	}
+}
+
+static void route_nl_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	route_nl_read(s, w->fd);
+}
+
+static int open_route_nl_socket(main_server_st *s)
+{
+	struct sockaddr_nl sa;
+	int fd, e, val;
+
+	if (s->route_nl.fd != -1)
+		return s->route_nl.fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not open rtnetlink socket: %s", strerror(e));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind rtnetlink socket: %s", strerror(e));
+		close(fd);
+		return -1;
+	}
+
+	val = ROUTE_NL_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+#ifdef NETLINK_CAP_ACK
+	/* the acknowledgements need not include our requests */
+	val = 1;
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &val, sizeof(val));
+#endif
+
+	set_non_block(fd);
+	set_cloexec_flag(fd, 1);
+
+	s->route_nl.fd = fd;
+	ev_io_init(&s->route_nl.io, route_nl_watcher_cb, fd, EV_READ);
+	ev_io_start(loop, &s->route_nl.io);
+
+	return fd;
+}
+
+static int route_nl_send(main_server_st *s, proc_st *proc, uint8_t *buf, unsigned size)
+{
+	int ret, e;
+
+	do {
+		ret = send(s->route_nl.fd, buf, size, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1) {
+		e = errno;
+		mslog(s, proc, LOG_ERR, "could not send rtnetlink request: %s", strerror(e));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void route_nl_remove(main_server_st *s, proc_st *proc);
+
+static int route_nl_apply(main_server_st *s, proc_st *proc)
+{
+	unsigned i, n = proc->config->n_iroutes, size = 0, len;
+	uint8_t *buf;
+	int ifindex;
+
+	/* already applied */
+	if (proc->applied_iroutes != 0 || proc->iroutes_pending > 0)
+		return 0;
+
+	if (open_route_nl_socket(s) < 0)
+		return -1;
+
+	ifindex = if_nametoindex(proc->tun_lease.name);
+	if (ifindex == 0) {
+		mslog(s, proc, LOG_ERR, "could not find the index of %s", proc->tun_lease.name);
+		return -1;
+	}
+
+	talloc_free(proc->iroutes_state);
+	proc->iroutes_state = talloc_zero_array(proc, uint8_t, n);
+	buf = talloc_size(proc, n * ROUTE_NL_MSG_SIZE);
+	if (proc->iroutes_state == NULL || buf == NULL) {
+		talloc_free(buf);
+		return -1;
+	}
+
+	proc->iroutes_seq = s->route_nl.seq;
+	s->route_nl.seq += n;
+
+	for (i=0;i<n;i++) {
+		len = route_nl_msg(s, proc, buf + size, RTM_NEWROUTE,
+				   proc->config->iroutes[i], ifindex, proc->iroutes_seq + i);
+		if (len == 0) {
+			proc->iroutes_state[i] = IROUTE_FAILED;
+			continue;
+		}
+		proc->iroutes_state[i] = IROUTE_PENDING;
+		proc->iroutes_pending++;
+		size += len;
+	}
+
+	if (size > 0 && route_nl_send(s, proc, buf, size) < 0) {
+		talloc_free(buf);
+		proc->iroutes_pending = 0;
+		return -1;
+	}
+	talloc_free(buf);
+	proc->applied_iroutes = 1;
+
+	if (proc->iroutes_pending > 0) {
+		list_add_tail(&s->route_nl.head, &proc->iroutes_list);
+		route_nl_read(s, s->route_nl.fd);
+	}
+
+	/* if not yet acknowledged, a failure disconnects the session
+	 * from route_nl_done() */
+	if (proc->iroutes_pending > 0)
+		return 0;
+
+	for (i=0;i<n;i++) {
+		if (proc->iroutes_state[i] == IROUTE_FAILED) {
+			/* as with route-add-cmd, the session is denied */
+			route_nl_remove(s, proc);
+			proc->applied_iroutes = 0;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void route_nl_remove(main_server_st *s, proc_st *proc)
+{
+	unsigned i, n = proc->config->n_iroutes, size = 0;
+	uint8_t *buf;
+	int ifindex;
+
+	if (proc->iroutes_state == NULL || s->route_nl.fd == -1)
+		return;
+
+	/* the routes are removed by the kernel with the device */
+	ifindex = if_nametoindex(proc->tun_lease.name);
+	if (ifindex == 0)
+		return;
+
+	buf = talloc_size(proc, n * ROUTE_NL_MSG_SIZE);
+	if (buf == NULL)
+		return;
+
+	/* the routes still pending are removed as well */
+	for (i=0;i<n;i++) {
+		if (proc->iroutes_state[i] != IROUTE_APPLIED &&
+		    proc->iroutes_state[i] != IROUTE_PENDING)
+			continue;
+
+		size += route_nl_msg(s, proc, buf + size, RTM_DELROUTE,
+				     proc->config->iroutes[i], ifindex, s->route_nl.seq++);
+	}
+
+	if (size > 0)
+		route_nl_send(s, proc, buf, size);
+
+	talloc_free(buf);
+}
+
+void route_nl_init(main_server_st *s)
+{
+	list_head_init(&s->route_nl.head);
+	s->route_nl.fd = -1;
+	s->route_nl.seq = time(0);
+}
+
+/* The procs in the list are not touched; they are released by the
+ * caller. */
+void route_nl_deinit(main_server_st *s)
+{
+	list_head_init(&s->route_nl.head);
+
+	if (s->route_nl.fd != -1) {
+		ev_io_stop(loop, &s->route_nl.io);
+		close(s->route_nl.fd);
+		s->route_nl.fd = -1;
+	}
+}
+#else
+void route_nl_init(main_server_st *s)
+{
+}
+
+void route_nl_deinit(main_server_st *s)
+{
+}
+#endif
+
 /* Executes the commands required to apply all the configured routes 
  * for this client locally.
  */
@@ -166,6 +575,11 @@ int ret;
 	if (proc->config->n_iroutes == 0)
 		return 0;
 
+#ifdef __linux__
+	if (GETCONFIG(s)->route_netlink)
+		return route_nl_apply(s, proc);
+#endif
+
 	for (i=0;i<proc->config->n_iroutes;i++) {
 		ret = route_add(s, proc, proc->config->iroutes[i], proc->tun_lease.name);
 		if (ret < 0)
@@ -188,9 +602,24 @@ void remove_iroutes(struct main_server_st* s, struct proc_st *proc)
 {
 unsigned i;
 
+#ifdef __linux__
+	if (proc->iroutes_pending > 0) {
+		list_del(&proc->iroutes_list);
+		proc->iroutes_pending = 0;
+	}
+#endif
+
 	if (proc->config == NULL || proc->config->n_iroutes == 0 || proc->applied_iroutes == 0)
 		return;
 
+#ifdef __linux__
+	if (proc->iroutes_state != NULL) {
+		route_nl_remove(s, proc);
+		proc->applied_iroutes = 0;
+		return;
+	}
+#endif
+
 	for (i=0;i<proc->config->n_iroutes;i++) {
 		route_del(s, proc, proc->config->iroutes[i], proc->tun_lease.name);
 	}
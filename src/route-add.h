@@ -24,6 +24,13 @@
 #include <vpn.h>
 #include <main.h>
 
+#define IROUTE_PENDING 1
+#define IROUTE_APPLIED 2
+#define IROUTE_FAILED 3
+
+void route_nl_init(main_server_st *s);
+void route_nl_deinit(main_server_st *s);
+
 int apply_iroutes(struct main_server_st* s, struct proc_st *proc);
 void remove_iroutes(struct main_server_st* s, struct proc_st *proc);
 
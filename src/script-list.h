@@ -22,14 +22,10 @@
 # define SCRIPT_LIST_H
 
 #include <main.h>
-#include <sys/types.h>
-#include <signal.h>
-#include <ev.h>
-
-void script_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents);
+#include <main-script-runner.h>
 
 inline static
-void add_to_script_list(main_server_st* s, pid_t pid, struct proc_st* proc)
+void add_to_script_list(main_server_st* s, uint32_t id, struct proc_st* proc)
 {
 struct script_wait_st *stmp;
 
@@ -38,30 +34,26 @@ struct script_wait_st *stmp;
 		return;
 	
 	stmp->proc = proc;
-	stmp->pid = pid;
-
-	ev_child_init(&stmp->ev_child, script_child_watcher_cb, pid, 0);
-	ev_child_start(loop, &stmp->ev_child);
+	stmp->id = id;
 
 	list_add(&s->script_list.head, &(stmp->list));
 }
 
-/* Removes the tracked connect script, and kills it. It returns the pid
- * of the removed script or -1.
+/* Removes the tracked connect script, and has the script runner
+ * terminate it. It returns the script runner job id of the removed
+ * script or zero.
  */
-inline static pid_t remove_from_script_list(main_server_st* s, struct proc_st* proc)
+inline static uint32_t remove_from_script_list(main_server_st* s, struct proc_st* proc)
 {
 	struct script_wait_st *stmp = NULL, *spos;
-	pid_t ret = -1;
+	uint32_t ret = 0;
 
 	list_for_each_safe(&s->script_list.head, stmp, spos, list) {
 		if (stmp->proc == proc) {
 			list_del(&stmp->list);
-			if (stmp->pid > 0) {
-				kill(stmp->pid, SIGTERM);
-				ret = stmp->pid;
-			}
+			ret = stmp->id;
 			talloc_free(stmp);
+			script_runner_cancel(s, ret);
 			break;
 		}
 	}
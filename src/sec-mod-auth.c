@@ -53,6 +53,8 @@
 #include <sec-mod-sup-config.h>
 #include <sec-mod-acct.h>
 #include <c-strcase.h>
+#include <metrics.h>
+#include <gettime.h>
 
 #ifdef HAVE_GSSAPI
 # include <gssapi/gssapi.h>
@@ -116,10 +118,23 @@ void sec_mod_add_score_to_ip(sec_mod_st *sec, client_entry_st *e, const char *ip
 	return;
 }
 
-static void update_auth_time_stats(sec_mod_st * sec, time_t secs)
+static void update_auth_time_stats(sec_mod_st * sec, client_entry_st *e)
 {
-	if (secs < 0)
-		return;
+	static const unsigned bounds[] = METRICS_AUTH_BUCKETS;
+	struct timespec now;
+	unsigned i, ms;
+	time_t secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = timespec_sub_ms(&now, &e->created_mono);
+	secs = ms / 1000;
+
+	for (i=0;i<METRICS_AUTH_BUCKETS_SIZE-1;i++) {
+		if (ms <= bounds[i])
+			break;
+	}
+	METRIC_ADD(secmod_metrics(), auth_latency[i], 1);
+	METRIC_ADD(secmod_metrics(), auth_latency_sum_ms, ms);
 
 	sec->total_authentications++;
 	if (sec->total_authentications == 0) { /* reset stats */
@@ -150,7 +165,7 @@ int send_sec_auth_reply(int cfd, sec_mod_st * sec, client_entry_st * entry, AUTH
 		}
 
 		/* calculate time in auth for this client */
-		update_auth_time_stats(sec, time(0) - entry->created);
+		update_auth_time_stats(sec, entry);
 
 		msg.has_sid = 1;
 		msg.sid.data = entry->sid;
@@ -531,6 +546,7 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 	/* refresh cookie validity */
 	e->exptime = time(0) + e->vhost->perm_config.config->cookie_timeout + AUTH_SLACK_TIME;
 	e->in_use++;
+	update_client_entry_expiry(sec, e);
 
 	return 0;
 }
@@ -671,9 +687,124 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t p
 	return 0;
 }
 
+/* An auth module call (auth_init or auth_pass), which is run on a sec-mod
+ * thread when the module may block. The job is not allocated under the
+ * sec-mod pools as it is used by the thread. */
+struct auth_job_st {
+	sec_mod_job_st job;
+
+	client_entry_st *e;
+	int cfd;
+	unsigned cmd; /* CMD_SEC_AUTH_INIT or CMD_SEC_AUTH_CONT */
+
+	common_auth_init_st st; /* auth_init() input */
+	void *auth_ctx; /* auth_init() output */
+	char *password; /* auth_pass() input */
+};
+
+static int auth_job_run(sec_mod_job_st *_job)
+{
+	struct auth_job_st *job = (struct auth_job_st *)_job;
+	client_entry_st *e = job->e;
+
+	/* e.g., certificate authentication */
+	if (e->module == NULL)
+		return 0;
+
+	if (job->cmd == CMD_SEC_AUTH_INIT)
+		return e->module->auth_init(&job->auth_ctx, job, e->vhost_auth_ctx, &job->st);
+	else
+		return e->module->auth_pass(e->auth_ctx, job->password,
+					    strlen(job->password));
+}
+
+/* Completes a job that was run and releases it. Returns the auth result
+ * to be passed to handle_sec_auth_res().
+ */
+static int finish_auth_job(sec_mod_st *sec, struct auth_job_st *job)
+{
+	client_entry_st *e = job->e;
+	int ret = job->job.result;
+
+	if (job->cmd == CMD_SEC_AUTH_INIT) {
+		if (job->auth_ctx != NULL)
+			e->auth_ctx = talloc_steal(e, job->auth_ctx);
+
+		if (ret != ERR_AUTH_CONTINUE && ret > 0)
+			ret = 0;
+	} else {
+		if (ret < 0 && ret != ERR_AUTH_CONTINUE) {
+			seclog(sec, LOG_DEBUG,
+			       "error in password given in auth cont for user '%s' "SESSION_STR,
+			       e->acct_info.username, e->acct_info.safe_id);
+		}
+		safe_memset(job->password, 0, strlen(job->password));
+	}
+
+	talloc_free(job);
+	return ret;
+}
+
+static void auth_job_done(sec_mod_st *sec, sec_mod_job_st *_job)
+{
+	struct auth_job_st *job = (struct auth_job_st *)_job;
+	client_entry_st *e = job->e;
+	int cfd = job->cfd;
+	int ret;
+
+	e->in_thread = 0;
+	/* in case the entry expired while on the thread */
+	update_client_entry_expiry(sec, e);
+
+	ret = finish_auth_job(sec, job);
+	ret = handle_sec_auth_res(cfd, sec, e, ret);
+	if (ret < 0) {
+		seclog(sec, LOG_DEBUG, "error processing auth for user '%s' "SESSION_STR" (%d)",
+		       e->acct_info.username, e->acct_info.safe_id, ret);
+	}
+
+	close(cfd);
+}
+
+static struct auth_job_st *new_auth_job(client_entry_st *e, int cfd, unsigned cmd)
+{
+	struct auth_job_st *job;
+
+	job = talloc_zero(NULL, struct auth_job_st);
+	if (job == NULL)
+		return NULL;
+
+	job->job.run = auth_job_run;
+	job->job.done = auth_job_done;
+	job->e = e;
+	job->cfd = cfd;
+	job->cmd = cmd;
+
+	return job;
+}
+
+/* Runs the auth module call, either on a thread if the module may
+ * block, or directly. Returns ERR_WAIT_FOR_THREAD if the job was queued;
+ * the reply is then sent to @cfd by auth_job_done(), which also closes it.
+ */
+static int run_auth_job(sec_mod_st *sec, struct auth_job_st *job)
+{
+	client_entry_st *e = job->e;
+
+	if (e->module != NULL && e->module->may_block &&
+	    sec_mod_job_submit(sec, &job->job) == 0) {
+		e->in_thread = 1;
+		return ERR_WAIT_FOR_THREAD;
+	}
+
+	job->job.result = auth_job_run(&job->job);
+	return finish_auth_job(sec, job);
+}
+
 int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 {
 	client_entry_st *e;
+	struct auth_job_st *job;
 	int ret;
 
 	if (req->sid.len != SID_SIZE) {
@@ -688,6 +819,13 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 		return -1;
 	}
 
+	if (e->in_thread) {
+		/* the previous request of this session is still being processed */
+		seclog(sec, LOG_ERR, "auth cont received for %s "SESSION_STR" while busy!",
+		       e->acct_info.username, e->acct_info.safe_id);
+		return -1;
+	}
+
 	if (e->status != PS_AUTH_INIT && e->status != PS_AUTH_CONT) {
 		seclog(sec, LOG_ERR, "auth cont received for %s "SESSION_STR" but we are on state %u!",
 		       e->acct_info.username, e->acct_info.safe_id, e->status);
@@ -712,18 +850,23 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 
 	e->status = PS_AUTH_CONT;
 
-	ret =
-	    e->module->auth_pass(e->auth_ctx, req->password,
-			      strlen(req->password));
-	if (ret < 0) {
-		if (ret != ERR_AUTH_CONTINUE) {
-			seclog(sec, LOG_DEBUG,
-			       "error in password given in auth cont for user '%s' "SESSION_STR,
-			       e->acct_info.username, e->acct_info.safe_id);
-		}
+	job = new_auth_job(e, cfd, CMD_SEC_AUTH_CONT);
+	if (job == NULL) {
+		ret = -1;
+		goto cleanup;
+	}
+
+	job->password = talloc_strdup(job, req->password);
+	if (job->password == NULL) {
+		talloc_free(job);
+		ret = -1;
 		goto cleanup;
 	}
 
+	ret = run_auth_job(sec, job);
+	if (ret == ERR_WAIT_FOR_THREAD)
+		return ret;
+
  cleanup:
 	return handle_sec_auth_res(cfd, sec, e, ret);
 }
@@ -757,8 +900,8 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 {
 	int ret = -1;
 	client_entry_st *e;
+	struct auth_job_st *job;
 	unsigned i;
-	unsigned need_continue = 0;
 	vhost_cfg_st *vhost;
 
 	vhost = find_vhost(sec->vconfig, req->vhost);
@@ -775,24 +918,6 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 		goto cleanup;
 	}
 
-	if (e->module) {
-		common_auth_init_st st;
-
-		st.username = req->user_name;
-		st.ip = req->ip;
-		st.our_ip = req->our_ip;
-		st.user_agent = req->user_agent;
-		st.id = pid;
-
-		ret =
-		    e->module->auth_init(&e->auth_ctx, e, e->vhost_auth_ctx, &st);
-		if (ret == ERR_AUTH_CONTINUE) {
-			need_continue = 1;
-		} else if (ret < 0) {
-			goto cleanup;
-		}
-	}
-
 	e->tls_auth_ok = req->tls_auth_ok;
 
 	if (req->user_agent != NULL)
@@ -828,12 +953,22 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 	       req->tls_auth_ok?"(with cert) ":"",
 	       e->acct_info.username, e->acct_info.safe_id, e->acct_info.groupname, req->ip);
 
-	if (need_continue != 0) {
-		ret = ERR_AUTH_CONTINUE;
+	job = new_auth_job(e, cfd, CMD_SEC_AUTH_INIT);
+	if (job == NULL) {
+		ret = -1;
 		goto cleanup;
 	}
 
-	ret = 0;
+	job->st.username = talloc_strdup(job, req->user_name);
+	job->st.ip = talloc_strdup(job, req->ip);
+	job->st.our_ip = talloc_strdup(job, req->our_ip);
+	job->st.user_agent = talloc_strdup(job, req->user_agent);
+	job->st.id = pid;
+
+	ret = run_auth_job(sec, job);
+	if (ret == ERR_WAIT_FOR_THREAD)
+		return ret;
+
  cleanup:
 	return handle_sec_auth_res(cfd, sec, e, ret);
 }
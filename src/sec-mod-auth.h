@@ -34,6 +34,8 @@ typedef struct passwd_msg_st {
 typedef struct auth_mod_st {
 	unsigned int type;
 	unsigned int allows_retries; /* whether the module allows retries of the same password */
+	unsigned int may_block; /* whether auth_init and auth_pass may block on an external server; these
+				 * are then run on the sec-mod threads, and must only access their own context */
 	void (*vhost_init)(void **vctx, void *pool, void* additional);
 	void (*vhost_deinit)(void *vctx);
 	int (*auth_init)(void **ctx, void *pool, void *vctx, const common_auth_init_st *);
@@ -54,6 +54,108 @@ static size_t rehash(const void *_e, void *unused)
 	return hash_any(e->sid, sizeof(e->sid), 0);
 }
 
+#define NOT_IN_HEAP ((unsigned)-1)
+
+/* The entries which may expire are kept in a binary min-heap on their
+ * expiration time, so that cleanup_client_entries() visits only the
+ * expired entries rather than the whole client_db. */
+static void heap_set(sec_mod_st *sec, unsigned idx, client_entry_st *e)
+{
+	sec->client_heap[idx] = e;
+	e->heap_idx = idx;
+}
+
+static void heap_sift_up(sec_mod_st *sec, unsigned idx)
+{
+	client_entry_st *e = sec->client_heap[idx];
+	unsigned parent;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (sec->client_heap[parent]->exptime <= e->exptime)
+			break;
+		heap_set(sec, idx, sec->client_heap[parent]);
+		idx = parent;
+	}
+	heap_set(sec, idx, e);
+}
+
+static void heap_sift_down(sec_mod_st *sec, unsigned idx)
+{
+	client_entry_st *e = sec->client_heap[idx];
+	unsigned child;
+
+	for (;;) {
+		child = 2 * idx + 1;
+		if (child >= sec->client_heap_size)
+			break;
+		if (child + 1 < sec->client_heap_size &&
+		    sec->client_heap[child + 1]->exptime < sec->client_heap[child]->exptime)
+			child++;
+		if (e->exptime <= sec->client_heap[child]->exptime)
+			break;
+		heap_set(sec, idx, sec->client_heap[child]);
+		idx = child;
+	}
+	heap_set(sec, idx, e);
+}
+
+static int heap_add(sec_mod_st *sec, client_entry_st *e)
+{
+	client_entry_st **heap;
+	unsigned max;
+
+	if (sec->client_heap_size >= sec->client_heap_max) {
+		max = sec->client_heap_max ? sec->client_heap_max * 2 : 64;
+		heap = talloc_realloc(sec, sec->client_heap, client_entry_st *, max);
+		if (heap == NULL)
+			return -1;
+		sec->client_heap = heap;
+		sec->client_heap_max = max;
+	}
+
+	heap_set(sec, sec->client_heap_size++, e);
+	heap_sift_up(sec, e->heap_idx);
+	return 0;
+}
+
+static void heap_remove(sec_mod_st *sec, client_entry_st *e)
+{
+	unsigned idx = e->heap_idx;
+	client_entry_st *last;
+
+	if (idx == NOT_IN_HEAP)
+		return;
+
+	e->heap_idx = NOT_IN_HEAP;
+	sec->client_heap_size--;
+	if (idx == sec->client_heap_size)
+		return;
+
+	last = sec->client_heap[sec->client_heap_size];
+	heap_set(sec, idx, last);
+	if (last->exptime < e->exptime)
+		heap_sift_up(sec, idx);
+	else
+		heap_sift_down(sec, idx);
+}
+
+/* To be called when the exptime of the entry changes, or when an
+ * entry which was in use may expire again.
+ */
+void update_client_entry_expiry(sec_mod_st *sec, client_entry_st * e)
+{
+	if (e->heap_idx == NOT_IN_HEAP) {
+		if (heap_add(sec, e) < 0)
+			seclog(sec, LOG_ERR, "could not add client entry to expiration heap");
+		return;
+	}
+
+	/* the exptime may have moved in either direction */
+	heap_sift_up(sec, e->heap_idx);
+	heap_sift_down(sec, e->heap_idx);
+}
+
 void *sec_mod_client_db_init(sec_mod_st *sec)
 {
 	struct htable *db = talloc(sec, struct htable);
@@ -72,6 +174,10 @@ struct htable *db = sec->client_db;
 
 	htable_clear(db);
 	talloc_free(db);
+
+	talloc_free(sec->client_heap);
+	sec->client_heap = NULL;
+	sec->client_heap_size = sec->client_heap_max = 0;
 }
 
 /* The number of elements */
@@ -123,10 +229,19 @@ client_entry_st *new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *vhost, c
 	now = time(0);
 	e->exptime = now + vhost->perm_config.config->cookie_timeout + AUTH_SLACK_TIME;
 	e->created = now;
+	clock_gettime(CLOCK_MONOTONIC, &e->created_mono);
+
+	e->heap_idx = NOT_IN_HEAP;
+	if (heap_add(sec, e) < 0) {
+		seclog(sec, LOG_ERR,
+		       "could not add client entry to expiration heap");
+		goto fail;
+	}
 
 	if (htable_add(db, rehash(e, NULL), e) == 0) {
 		seclog(sec, LOG_ERR,
 		       "could not add client entry to hash table");
+		heap_remove(sec, e);
 		goto fail;
 	}
 
@@ -168,17 +283,21 @@ void cleanup_client_entries(sec_mod_st *sec)
 {
 	struct htable *db = sec->client_db;
 	client_entry_st *t;
-	struct htable_iter iter;
 	time_t now = time(0);
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
+	while (sec->client_heap_size > 0) {
+		t = sec->client_heap[0];
+		if (t->exptime > now)
+			break;
+
+		heap_remove(sec, t);
+
+		/* entries which are in use are added back to the heap
+		 * by update_client_entry_expiry() once released */
 		if IS_CLIENT_ENTRY_EXPIRED_FULL(sec, t, now, 1) {
-			htable_delval(db, &iter);
+			htable_del(db, rehash(t, NULL), t);
 			clean_entry(sec, t);
 		}
-		t = htable_next(db, &iter);
-
 	}
 }
 
@@ -187,6 +306,7 @@ void del_client_entry(sec_mod_st *sec, client_entry_st * e)
 	struct htable *db = sec->client_db;
 
 	htable_del(db, rehash(e, NULL), e);
+	heap_remove(sec, e);
 	clean_entry(sec, e);
 }
 
@@ -215,6 +335,7 @@ void expire_client_entry(sec_mod_st *sec, client_entry_st * e)
 			} else {
 				e->exptime = now + e->vhost->perm_config.config->cookie_timeout + AUTH_SLACK_TIME;
 			}
+			update_client_entry_expiry(sec, e);
 			seclog(sec, LOG_INFO, "temporarily closing session for %s "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
 		}
 	}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <common.h>
+#include <sec-mod.h>
+#include <vhost.h>
+#include <ipc.pb-c.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+/* The private key operations of the workers. When threads are enabled
+ * (sec-mod-threads), the operations with keys held in memory are run on
+ * them, so that the handshakes of many workers are signed on several
+ * cores. The worker's connection is kept open until the operation
+ * completes and is closed once the reply is sent.
+ */
+
+/* A key operation which may run on a sec-mod thread. It is not allocated
+ * under the sec-mod pools as it is used by the thread. */
+struct keyop_job_st {
+	sec_mod_job_st job;
+
+	int cfd;
+	unsigned cmd;
+	gnutls_privkey_t key;
+	unsigned sig;
+	gnutls_datum_t data;
+	gnutls_datum_t out;
+};
+
+static int send_keyop_reply(void *pool, int cfd, sec_mod_st *sec, uint8_t type,
+			    uint8_t *rep, size_t rep_size)
+{
+	SecOpMsg msg = SEC_OP_MSG__INIT;
+	int ret;
+
+	msg.data.data = rep;
+	msg.data.len = rep_size;
+
+	ret = send_msg(pool, cfd, type, &msg,
+		       (pack_size_func) sec_op_msg__get_packed_size,
+		       (pack_func) sec_op_msg__pack);
+	if (ret < 0) {
+		seclog(sec, LOG_WARNING, "sec-mod error in sending reply");
+	}
+
+	return ret;
+}
+
+static int keyop_job_run(sec_mod_job_st *_job)
+{
+	struct keyop_job_st *job = (struct keyop_job_st *)_job;
+
+	switch (job->cmd) {
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	case CMD_SEC_SIGN_DATA:
+		return gnutls_privkey_sign_data2(job->key, job->sig, 0, &job->data, &job->out);
+	case CMD_SEC_SIGN_HASH:
+		return gnutls_privkey_sign_hash2(job->key, job->sig, 0, &job->data, &job->out);
+#endif
+	case CMD_SEC_DECRYPT:
+		return gnutls_privkey_decrypt_data(job->key, 0, &job->data, &job->out);
+	default:
+		return gnutls_privkey_sign_hash(job->key, 0,
+						GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
+						&job->data, &job->out);
+	}
+}
+
+static void keyop_job_free(struct keyop_job_st *job)
+{
+	safe_memset(job->data.data, 0, job->data.size);
+	gnutls_free(job->out.data);
+	talloc_free(job);
+}
+
+static void keyop_job_done(sec_mod_st *sec, sec_mod_job_st *_job)
+{
+	struct keyop_job_st *job = (struct keyop_job_st *)_job;
+	int ret = job->job.result;
+
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "error in crypto operation: %s",
+		       gnutls_strerror(ret));
+	} else {
+		send_keyop_reply(job, job->cfd, sec, job->cmd, job->out.data, job->out.size);
+	}
+
+	close(job->cfd);
+	keyop_job_free(job);
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+static int handle_get_pk(void *pool, sec_mod_st *sec, int cfd,
+			 uint8_t *buffer, size_t buffer_size)
+{
+	SecGetPkMsg *pkm;
+	vhost_cfg_st *vhost;
+	unsigned bits, i;
+	int ret;
+	PROTOBUF_ALLOCATOR(pa, pool);
+
+	pkm = sec_get_pk_msg__unpack(&pa, buffer_size, buffer);
+	if (pkm == NULL) {
+		seclog(sec, LOG_INFO, "error unpacking sec get pk\n");
+		return -1;
+	}
+
+	vhost = find_vhost(sec->vconfig, pkm->vhost);
+
+	i = pkm->key_idx;
+	if (i >= vhost->key_size) {
+		seclog(sec, LOG_INFO,
+		       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
+		sec_get_pk_msg__free_unpacked(pkm, &pa);
+		return -1;
+	}
+
+	pkm->pk = gnutls_privkey_get_pk_algorithm(vhost->key[i], &bits);
+	pkm->bits = bits;
+
+	ret = send_msg(pool, cfd, CMD_SEC_GET_PK, pkm,
+		       (pack_size_func) sec_get_pk_msg__get_packed_size,
+		       (pack_func) sec_get_pk_msg__pack);
+
+	sec_get_pk_msg__free_unpacked(pkm, &pa);
+
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "error sending reply: %s",
+		       gnutls_strerror(ret));
+		return -1;
+	}
+
+	return ret;
+}
+#endif
+
+/* Runs the operation on a thread if possible, or directly. Returns
+ * ERR_WAIT_FOR_THREAD if it was queued; the job then closes @cfd. */
+int handle_sec_keyop(void *pool, sec_mod_st *sec, int cfd, cmd_request_t cmd,
+		     uint8_t *buffer, size_t buffer_size)
+{
+	struct keyop_job_st *job;
+	vhost_cfg_st *vhost;
+	SecOpMsg *op;
+	unsigned i;
+	int ret;
+	PROTOBUF_ALLOCATOR(pa, pool);
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	if (cmd == CMD_SEC_GET_PK)
+		return handle_get_pk(pool, sec, cfd, buffer, buffer_size);
+#else
+	if (cmd == CMD_SEC_GET_PK || cmd == CMD_SEC_SIGN_DATA || cmd == CMD_SEC_SIGN_HASH) {
+		seclog(sec, LOG_INFO, "unsupported key operation %s", cmd_request_to_str(cmd));
+		return -1;
+	}
+#endif
+
+	op = sec_op_msg__unpack(&pa, buffer_size, buffer);
+	if (op == NULL) {
+		seclog(sec, LOG_INFO, "error unpacking sec op\n");
+		return -1;
+	}
+
+	vhost = find_vhost(sec->vconfig, op->vhost);
+
+	i = op->key_idx;
+	if (op->has_key_idx == 0 || i >= vhost->key_size) {
+		seclog(sec, LOG_INFO,
+		       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
+		sec_op_msg__free_unpacked(op, &pa);
+		return -1;
+	}
+
+	job = talloc_zero(NULL, struct keyop_job_st);
+	if (job == NULL) {
+		sec_op_msg__free_unpacked(op, &pa);
+		return -1;
+	}
+
+	job->job.run = keyop_job_run;
+	job->job.done = keyop_job_done;
+	job->cfd = cfd;
+	job->cmd = cmd;
+	job->key = vhost->key[i];
+	job->sig = op->sig;
+	job->data.size = op->data.len;
+	job->data.data = talloc_memdup(job, op->data.data, op->data.len);
+	sec_op_msg__free_unpacked(op, &pa);
+
+	if (job->data.data == NULL && job->data.size > 0) {
+		talloc_free(job);
+		return -1;
+	}
+
+	/* the keys on tokens may not be used by several threads */
+	if (gnutls_privkey_get_type(job->key) == GNUTLS_PRIVKEY_X509 &&
+	    sec_mod_job_submit(sec, &job->job) == 0)
+		return ERR_WAIT_FOR_THREAD;
+
+	ret = keyop_job_run(&job->job);
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "error in crypto operation: %s",
+		       gnutls_strerror(ret));
+		keyop_job_free(job);
+		return -1;
+	}
+
+	ret = send_keyop_reply(pool, cfd, sec, cmd, job->out.data, job->out.size);
+	keyop_job_free(job);
+
+	return ret;
+}
@@ -58,6 +58,7 @@ int handle_resume_delete_req(sec_mod_st *sec,
 			cache->session_id_size = 0;
 
 			htable_delval(sec->tls_db.ht, &iter);
+			list_del(&cache->list);
 			talloc_free(cache);
 			sec->tls_db.entries--;
 			return 0;
@@ -165,7 +166,11 @@ int handle_resume_store_req(sec_mod_st *sec,
 	       req->session_data.len);
 	memcpy(&cache->remote_addr, req->cli_addr.data, req->cli_addr.len);
 
-	htable_add(sec->tls_db.ht, key, cache);
+	if (htable_add(sec->tls_db.ht, key, cache) == 0) {
+		talloc_free(cache);
+		return -1;
+	}
+	list_add_tail(&sec->tls_db.list, &cache->list);
 	sec->tls_db.entries++;
 
 	seclog_hex(sec, LOG_DEBUG, "TLS session DB storing",
@@ -175,16 +180,17 @@ int handle_resume_store_req(sec_mod_st *sec,
 	return 0;
 }
 
+/* The entries are stored in the list in the order they were created,
+ * and they all share the same expiration time, so we only need to
+ * visit the expired entries at the head of the list. */
 void expire_tls_sessions(sec_mod_st *sec)
 {
-	tls_cache_st *cache;
-	struct htable_iter iter;
+	tls_cache_st *cache, *next;
 	time_t now, exp;
 
 	now = time(0);
 
-	cache = htable_first(sec->tls_db.ht, &iter);
-	while (cache != NULL) {
+	list_for_each_safe(&sec->tls_db.list, cache, next, list) {
 		gnutls_datum_t d;
 
 		d.data = (void *)cache->session_data;
@@ -192,16 +198,17 @@ void expire_tls_sessions(sec_mod_st *sec)
 
 		exp = gnutls_db_check_entry_time(&d);
 
-		if (now - exp > TLS_SESSION_EXPIRATION_TIME(GETCONFIG(sec))) {
-			cache->session_id_size = 0;
+		if (now - exp <= TLS_SESSION_EXPIRATION_TIME(GETCONFIG(sec)))
+			break;
 
-			htable_delval(sec->tls_db.ht, &iter);
+		htable_del(sec->tls_db.ht, hash_any(cache->session_id, cache->session_id_size, 0), cache);
+		list_del(&cache->list);
 
-			safe_memset(cache->session_data, 0, cache->session_data_size);
-			talloc_free(cache);
-			sec->tls_db.entries--;
-		}
-		cache = htable_next(sec->tls_db.ht, &iter);
+		cache->session_id_size = 0;
+
+		safe_memset(cache->session_data, 0, cache->session_data_size);
+		talloc_free(cache);
+		sec->tls_db.entries--;
 	}
 
 	return;
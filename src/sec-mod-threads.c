@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <common.h>
+#include <cloexec.h>
+#include <sec-mod.h>
+#include <metrics.h>
+
+/* A bounded pool of threads which runs the sec-mod jobs that may block
+ * (i.e., calls to authentication modules which contact an external
+ * server). Jobs are queued by the sec-mod loop, and once run() completes
+ * on a thread, the job is sent back over a pipe, so that its done()
+ * function is called from the sec-mod loop. Only the run() functions
+ * are executed on the threads; all other sec-mod state is accessed by
+ * the sec-mod loop alone.
+ */
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+
+/* The maximum number of jobs per thread which may be pending; if exceeded
+ * the jobs are run by the caller. */
+#define MAX_JOBS_PER_THREAD 64
+
+typedef struct sec_mod_threads_st {
+	pthread_t *threads;
+	unsigned nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head queue; /* protected by lock */
+	unsigned quit; /* protected by lock */
+
+	unsigned pending; /* jobs submitted but not completed; used by sec-mod loop only */
+	int done_fd[2]; /* the completed jobs are written to done_fd[1] */
+} sec_mod_threads_st;
+
+static void *sec_mod_thread(void *arg)
+{
+	sec_mod_threads_st *t = arg;
+	sec_mod_job_st *job;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		while (list_empty(&t->queue) && t->quit == 0)
+			pthread_cond_wait(&t->cond, &t->lock);
+
+		job = list_top(&t->queue, sec_mod_job_st, list);
+		if (job != NULL)
+			list_del(&job->list);
+		pthread_mutex_unlock(&t->lock);
+
+		if (job == NULL) /* quit */
+			break;
+
+		job->result = job->run(job);
+
+		do {
+			ret = write(t->done_fd[1], &job, sizeof(job));
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret != sizeof(job)) {
+			syslog(LOG_ERR, "sec-mod: could not notify for completed job");
+			abort();
+		}
+	}
+
+	return NULL;
+}
+
+int sec_mod_threads_init(sec_mod_st *sec, unsigned nthreads)
+{
+	sec_mod_threads_st *t;
+	sigset_t set, oldset;
+	unsigned i;
+	int ret;
+
+	t = talloc_zero(sec, sec_mod_threads_st);
+	if (t == NULL)
+		return -1;
+
+	t->threads = talloc_array(t, pthread_t, nthreads);
+	if (t->threads == NULL)
+		goto fail;
+
+	list_head_init(&t->queue);
+
+	if (pipe(t->done_fd) == -1)
+		goto fail;
+	set_cloexec_flag(t->done_fd[0], 1);
+	set_cloexec_flag(t->done_fd[1], 1);
+	set_non_block(t->done_fd[0]);
+
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+
+	/* signals are handled by the sec-mod loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+	for (i=0;i<nthreads;i++) {
+		ret = pthread_create(&t->threads[i], NULL, sec_mod_thread, t);
+		if (ret != 0) {
+			seclog(sec, LOG_ERR, "could not create thread: %s", strerror(ret));
+			break;
+		}
+	}
+	t->nthreads = i;
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	sec->threads = t;
+	if (t->nthreads == 0) {
+		sec_mod_threads_deinit(sec);
+		return -1;
+	}
+
+	seclog(sec, LOG_DEBUG, "initialized %u threads", t->nthreads);
+	return 0;
+
+ fail:
+	talloc_free(t);
+	return -1;
+}
+
+int sec_mod_threads_fd(sec_mod_st *sec)
+{
+	if (sec->threads == NULL)
+		return -1;
+	return sec->threads->done_fd[0];
+}
+
+/* Queues the provided job to be run on a thread. Returns 0 on success,
+ * or -1 if the job was not queued and must be run by the caller.
+ */
+int sec_mod_job_submit(sec_mod_st *sec, sec_mod_job_st *job)
+{
+	sec_mod_threads_st *t = sec->threads;
+
+	if (t == NULL || t->pending >= t->nthreads * MAX_JOBS_PER_THREAD)
+		return -1;
+
+	pthread_mutex_lock(&t->lock);
+	list_add_tail(&t->queue, &job->list);
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	t->pending++;
+	METRIC_SET(secmod_metrics(), auth_queue_depth, t->pending);
+	return 0;
+}
+
+/* Calls the done() function of the completed jobs. It is called when
+ * the done fd is readable.
+ */
+void sec_mod_threads_complete(sec_mod_st *sec)
+{
+	sec_mod_threads_st *t = sec->threads;
+	sec_mod_job_st *jobs[32];
+	ssize_t ret;
+	unsigned i;
+
+	if (t == NULL)
+		return;
+
+	do {
+		ret = read(t->done_fd[0], jobs, sizeof(jobs));
+		if (ret <= 0)
+			break;
+
+		for (i=0;i<ret/sizeof(jobs[0]);i++) {
+			t->pending--;
+			jobs[i]->done(sec, jobs[i]);
+		}
+	} while (ret == sizeof(jobs));
+
+	METRIC_SET(secmod_metrics(), auth_queue_depth, t->pending);
+}
+
+/* Waits until all the submitted jobs are completed */
+void sec_mod_threads_drain(sec_mod_st *sec)
+{
+	sec_mod_threads_st *t = sec->threads;
+	struct pollfd pfd;
+
+	if (t == NULL)
+		return;
+
+	while (t->pending > 0) {
+		pfd.fd = t->done_fd[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			break;
+
+		sec_mod_threads_complete(sec);
+	}
+}
+
+void sec_mod_threads_deinit(sec_mod_st *sec)
+{
+	sec_mod_threads_st *t = sec->threads;
+	unsigned i;
+
+	if (t == NULL)
+		return;
+
+	sec_mod_threads_drain(sec);
+
+	pthread_mutex_lock(&t->lock);
+	t->quit = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+
+	for (i=0;i<t->nthreads;i++)
+		pthread_join(t->threads[i], NULL);
+
+	pthread_cond_destroy(&t->cond);
+	pthread_mutex_destroy(&t->lock);
+	close(t->done_fd[0]);
+	close(t->done_fd[1]);
+
+	talloc_free(t);
+	sec->threads = NULL;
+}
+
+#else
+
+int sec_mod_threads_init(sec_mod_st *sec, unsigned nthreads)
+{
+	return -1;
+}
+
+void sec_mod_threads_deinit(sec_mod_st *sec)
+{
+}
+
+int sec_mod_threads_fd(sec_mod_st *sec)
+{
+	return -1;
+}
+
+int sec_mod_job_submit(sec_mod_st *sec, sec_mod_job_st *job)
+{
+	return -1;
+}
+
+void sec_mod_threads_complete(sec_mod_st *sec)
+{
+}
+
+void sec_mod_threads_drain(sec_mod_st *sec)
+{
+}
+
+#endif
@@ -176,38 +176,12 @@ int load_pins(struct perm_cfg_st *config, struct pin_st *s)
 	return 0;
 }
 
-static int handle_op(void *pool, int cfd, sec_mod_st * sec, uint8_t type, uint8_t * rep,
-		     size_t rep_size)
-{
-	SecOpMsg msg = SEC_OP_MSG__INIT;
-	int ret;
-
-	msg.data.data = rep;
-	msg.data.len = rep_size;
-
-	ret = send_msg(pool, cfd, type, &msg,
-		       (pack_size_func) sec_op_msg__get_packed_size,
-		       (pack_func) sec_op_msg__pack);
-	if (ret < 0) {
-		seclog(sec, LOG_WARNING, "sec-mod error in sending reply");
-	}
-
-	return 0;
-}
-
 static
 int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_request_t cmd,
 		   uint8_t * buffer, size_t buffer_size)
 {
-	unsigned i;
-	gnutls_datum_t data, out;
+	gnutls_datum_t data;
 	int ret;
-	SecOpMsg *op;
-	vhost_cfg_st *vhost;
-#if GNUTLS_VERSION_NUMBER >= 0x030600
-	unsigned bits;
-	SecGetPkMsg *pkm;
-#endif
 	PROTOBUF_ALLOCATOR(pa, pool);
 
 	seclog(sec, LOG_DEBUG, "cmd [size=%d] %s\n", (int)buffer_size,
@@ -216,125 +190,6 @@ int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_r
 	data.size = buffer_size;
 
 	switch (cmd) {
-#if GNUTLS_VERSION_NUMBER >= 0x030600
-	case CMD_SEC_GET_PK:
-		pkm = sec_get_pk_msg__unpack(&pa, data.size, data.data);
-		if (pkm == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec get pk\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, pkm->vhost);
-		/* check for static analyzer - find_vhost is always non-NULL */
-		assert(vhost != NULL);
-
-		i = pkm->key_idx;
-		if (i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		pkm->pk = gnutls_privkey_get_pk_algorithm(vhost->key[i], &bits);
-		pkm->bits = bits;
-
-		ret = send_msg(pool, cfd, CMD_SEC_GET_PK, pkm,
-			       (pack_size_func) sec_get_pk_msg__get_packed_size,
-			       (pack_func) sec_get_pk_msg__pack);
-
-		sec_get_pk_msg__free_unpacked(pkm, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error sending reply: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		return ret;
-
-	case CMD_SEC_SIGN_DATA:
-	case CMD_SEC_SIGN_HASH:
-		op = sec_op_msg__unpack(&pa, data.size, data.data);
-		if (op == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec op\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, op->vhost);
-		assert(vhost != NULL);
-
-		i = op->key_idx;
-		if (op->has_key_idx == 0 || i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		data.data = op->data.data;
-		data.size = op->data.len;
-
-		if (cmd == CMD_SEC_SIGN_DATA) {
-			ret = gnutls_privkey_sign_data2(vhost->key[i], op->sig, 0, &data, &out);
-		} else {
-			ret = gnutls_privkey_sign_hash2(vhost->key[i], op->sig, 0, &data, &out);
-		}
-		sec_op_msg__free_unpacked(op, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error in crypto operation: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
-		gnutls_free(out.data);
-
-		return ret;
-#endif
-	case CMD_SEC_SIGN:
-	case CMD_SEC_DECRYPT:
-		op = sec_op_msg__unpack(&pa, data.size, data.data);
-		if (op == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec op\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, op->vhost);
-		assert(vhost != NULL);
-
-		i = op->key_idx;
-		if (op->has_key_idx == 0 || i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		data.data = op->data.data;
-		data.size = op->data.len;
-
-		if (cmd == CMD_SEC_DECRYPT) {
-			ret =
-			    gnutls_privkey_decrypt_data(vhost->key[i], 0, &data,
-							&out);
-		} else {
-			ret =
-			    gnutls_privkey_sign_hash(vhost->key[i], 0,
-						     GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
-						     &data, &out);
-		}
-		sec_op_msg__free_unpacked(op, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error in crypto operation: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
-		gnutls_free(out.data);
-
-		return ret;
-
 	case CMD_SEC_CLI_STATS:{
 			CliStatsMsg *tmsg;
 
@@ -620,6 +475,7 @@ static void reload_server(sec_mod_st *sec)
 	vhost_cfg_st *vhost = NULL;
 
 	seclog(sec, LOG_DEBUG, "reloading configuration");
+	sec_mod_threads_drain(sec);
 	reload_cfg_file(sec, sec->vconfig, 1);
 	load_keys(sec, 0);
 
@@ -638,6 +494,8 @@ static void check_other_work(sec_mod_st *sec)
 	if (need_exit) {
 		unsigned i;
 
+		sec_mod_threads_deinit(sec);
+
 		list_for_each(sec->vconfig, vhost, list) {
 			for (i = 0; i < vhost->key_size; i++) {
 				gnutls_privkey_deinit(vhost->key[i]);
@@ -752,8 +610,11 @@ int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, u
 		goto leave;
 	}
 
-	ret = process_worker_packet(pool, cfd, pid, sec, cmd, buffer, ret);
-	if (ret < 0) {
+	if (IS_KEYOP_CMD(cmd))
+		ret = handle_sec_keyop(pool, sec, cfd, cmd, buffer, ret);
+	else
+		ret = process_worker_packet(pool, cfd, pid, sec, cmd, buffer, ret);
+	if (ret < 0 && ret != ERR_WAIT_FOR_THREAD) {
 		seclog(sec, LOG_DEBUG, "error processing '%s' command (%d)", cmd_request_to_str(cmd), ret);
 	}
 	
@@ -892,6 +753,7 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	struct sockaddr_un sa;
 	socklen_t sa_len;
 	int cfd, ret, e, n;
+	int done_fd;
 	unsigned buffer_size;
 	uid_t uid;
 	uint8_t *buffer;
@@ -1004,6 +866,14 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	}
 
 	sigprocmask(SIG_BLOCK, &blockset, &sig_default_set);
+
+	if (GETCONFIG(sec)->sec_mod_threads > 0) {
+		ret = sec_mod_threads_init(sec, GETCONFIG(sec)->sec_mod_threads);
+		if (ret < 0) {
+			seclog(sec, LOG_ERR, "could not initialize threads; authentication will be performed synchronously");
+		}
+	}
+
 	alarm(MAINTAINANCE_TIME);
 	seclog(sec, LOG_INFO, "sec-mod initialized (socket: %s)", SOCKET_FILE);
 
@@ -1023,6 +893,12 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 		FD_SET(sd, &rd_set);
 		n = MAX(n, sd);
 
+		done_fd = sec_mod_threads_fd(sec);
+		if (done_fd != -1) {
+			FD_SET(done_fd, &rd_set);
+			n = MAX(n, done_fd);
+		}
+
 #ifdef HAVE_PSELECT
 		ts.tv_nsec = 0;
 		ts.tv_sec = 120;
@@ -1072,6 +948,10 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 			}
 		}
 		
+		if (done_fd != -1 && FD_ISSET(done_fd, &rd_set)) {
+			sec_mod_threads_complete(sec);
+		}
+
 		if (FD_ISSET(sd, &rd_set)) {
 			sa_len = sizeof(sa);
 			cfd = accept(sd, (struct sockaddr *)&sa, &sa_len);
@@ -1095,9 +975,13 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 				seclog(sec, LOG_INFO, "rejected unauthorized connection");
 			} else {
 				memset(buffer, 0, buffer_size);
-				serve_request_worker(sec, cfd, pid, buffer, buffer_size);
+				ret = serve_request_worker(sec, cfd, pid, buffer, buffer_size);
 			}
-			close(cfd);
+
+			/* if the request is processed on a thread, the connection
+			 * is closed when it completes */
+			if (ret != ERR_WAIT_FOR_THREAD)
+				close(cfd);
 		}
  cont:
 		talloc_free(buffer);
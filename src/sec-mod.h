@@ -38,6 +38,10 @@ typedef struct sec_mod_st {
 	void *sec_mod_pool;
 
 	struct htable *client_db;
+	/* the client_db entries which may expire, in a min-heap on exptime */
+	struct client_entry_st **client_heap;
+	unsigned client_heap_size;
+	unsigned client_heap_max;
 	int cmd_fd;
 	int cmd_fd_sync;
 
@@ -47,8 +51,20 @@ typedef struct sec_mod_st {
 	uint32_t avg_auth_time; /* the average time spent in (sucessful) authentication */
 	uint32_t total_authentications; /* successful authentications: to calculate the average above */
 	time_t last_stats_reset;
+
+	struct sec_mod_threads_st *threads; /* NULL if no threads are used */
 } sec_mod_st;
 
+/* A job which is run on a sec-mod thread. The run() function is called
+ * on the thread, and done() on the main sec-mod loop when run() completes.
+ */
+typedef struct sec_mod_job_st {
+	struct list_node list;
+	int (*run)(struct sec_mod_job_st *job);
+	void (*done)(struct sec_mod_st *sec, struct sec_mod_job_st *job);
+	int result;
+} sec_mod_job_st;
+
 typedef struct stats_st {
 	uint64_t bytes_in;
 	uint64_t bytes_out;
@@ -75,7 +91,7 @@ typedef struct common_acct_info_st {
 	unsigned id;
 } common_acct_info_st;
 
-#define IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, clean) (e->exptime != -1 && now >= e->exptime && e->in_use == 0)
+#define IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, clean) (e->exptime != -1 && now >= e->exptime && e->in_use == 0 && e->in_thread == 0)
 #define IS_CLIENT_ENTRY_EXPIRED(sec, e, now) IS_CLIENT_ENTRY_EXPIRED_FULL(sec, e, now, 0)
 
 typedef struct client_entry_st {
@@ -89,6 +105,7 @@ typedef struct client_entry_st {
 	void *auth_ctx; /* the context of authentication */
 	unsigned session_is_open; /* whether open_session was done */
 	unsigned in_use; /* counter of users of this structure */
+	unsigned in_thread; /* non-zero while an auth module call runs on a sec-mod thread */
 	unsigned tls_auth_ok;
 
 	char *msg_str;
@@ -103,8 +120,10 @@ typedef struct client_entry_st {
 
 	/* The time this client entry was created */
 	time_t created;
+	struct timespec created_mono; /* CLOCK_MONOTONIC; for the auth latency */
 	/* The time this client entry is supposed to expire */
 	time_t exptime;
+	unsigned heap_idx; /* position in sec->client_heap, or NOT_IN_HEAP */
 
 	/* the auth type associated with the user */
 	unsigned auth_type;
@@ -134,6 +153,7 @@ client_entry_st * new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *, const
 client_entry_st * find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE]);
 void del_client_entry(sec_mod_st *sec, client_entry_st * e);
 void expire_client_entry(sec_mod_st *sec, client_entry_st * e);
+void update_client_entry_expiry(sec_mod_st *sec, client_entry_st * e);
 void cleanup_client_entries(sec_mod_st *sec);
 
 #ifdef __GNUC__
@@ -162,6 +182,20 @@ int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionClos
 int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid);
 void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e);
 
+int sec_mod_threads_init(sec_mod_st *sec, unsigned nthreads);
+void sec_mod_threads_deinit(sec_mod_st *sec);
+int sec_mod_threads_fd(sec_mod_st *sec);
+int sec_mod_job_submit(sec_mod_st *sec, sec_mod_job_st *job);
+void sec_mod_threads_complete(sec_mod_st *sec);
+void sec_mod_threads_drain(sec_mod_st *sec);
+
+int handle_sec_keyop(void *pool, sec_mod_st *sec, int cfd, cmd_request_t cmd,
+		     uint8_t *buffer, size_t buffer_size);
+
+#define IS_KEYOP_CMD(cmd) ((cmd) == CMD_SEC_SIGN || (cmd) == CMD_SEC_SIGN_DATA || \
+			   (cmd) == CMD_SEC_SIGN_HASH || (cmd) == CMD_SEC_DECRYPT || \
+			   (cmd) == CMD_SEC_GET_PK)
+
 void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfig,
 		    const char *socket_file,
 		    int cmd_fd, int cmd_fd_sync);
@@ -43,12 +43,14 @@
 #include <main.h>
 #include <worker.h>
 #include <common.h>
+#include <cloexec.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <c-ctype.h>
 
 static void tls_reload_ocsp(main_server_st* s, struct vhost_cfg_st *vhost);
@@ -59,6 +61,10 @@ void cstp_cork(worker_st *ws)
 		gnutls_record_cork(ws->session);
 	} else {
 		int state = 1;
+
+		/* the unix socket of listen-clear-file cannot be corked;
+		 * the data are queued and sent on uncork */
+		ws->cstp_corked = 1;
 #ifdef __linux__
 		setsockopt(ws->conn_fd, IPPROTO_TCP, TCP_CORK, &state, sizeof(state));
 #elif defined(TCP_NOPUSH)
@@ -73,6 +79,12 @@ int cstp_uncork(worker_st *ws)
 		return gnutls_record_uncork(ws->session, GNUTLS_RECORD_WAIT);
 	} else {
 		int state = 0;
+
+		if (ws->cstp_corked) {
+			ws->cstp_corked = 0;
+			if (cstp_outq_flush(ws) < 0)
+				return -1;
+		}
 #if defined(__linux__)
 		setsockopt(ws->conn_fd, IPPROTO_TCP, TCP_CORK, &state, sizeof(state));
 #elif defined(TCP_NOPUSH)
@@ -83,6 +95,140 @@ int cstp_uncork(worker_st *ws)
 }
 
 
+/* Sends the data queued on the CSTP channel. Returns the number of
+ * bytes which remain queued, or a negative value on error. */
+ssize_t cstp_outq_flush(worker_st *ws)
+{
+	cstp_outq_st *q = &ws->cstp_outq;
+	ssize_t ret;
+
+	while (q->size > 0) {
+		ret = send(ws->conn_fd, q->data + q->off, q->size, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		q->off += ret;
+		q->size -= ret;
+	}
+
+	if (q->size == 0)
+		q->off = 0;
+
+	return q->size;
+}
+
+static int cstp_outq_append(worker_st *ws, const uint8_t *data, size_t size)
+{
+	cstp_outq_st *q = &ws->cstp_outq;
+	uint8_t *p;
+	size_t new_alloc;
+
+	if (q->off + q->size + size > q->alloc) {
+		/* reclaim the sent data first */
+		if (q->off > 0) {
+			memmove(q->data, q->data + q->off, q->size);
+			q->off = 0;
+		}
+
+		if (q->size + size > q->alloc) {
+			new_alloc = q->alloc ? q->alloc : 4096;
+			while (new_alloc < q->size + size)
+				new_alloc *= 2;
+
+			p = talloc_realloc_size(ws, q->data, new_alloc);
+			if (p == NULL)
+				return -1;
+			q->data = p;
+			q->alloc = new_alloc;
+		}
+	}
+
+	memcpy(q->data + q->off + q->size, data, size);
+	q->size += size;
+	return 0;
+}
+
+/* The push function of the CSTP channel. It never blocks; the data
+ * which cannot be sent are queued and sent once the socket becomes
+ * writable (see cstp_outq_flush()). */
+static ssize_t cstp_push(worker_st *ws, const void *data, size_t size)
+{
+	ssize_t ret = 0;
+
+	if (ws->cstp_corked) {
+		if (cstp_outq_append(ws, data, size) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		return size;
+	}
+
+	if (ws->cstp_outq.size > 0) {
+		ret = cstp_outq_flush(ws);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ws->cstp_outq.size == 0) {
+		do {
+			ret = send(ws->conn_fd, data, size, 0);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			ret = 0;
+		}
+
+		if ((size_t)ret == size)
+			return size;
+	}
+
+	if (cstp_outq_append(ws, (uint8_t*)data + ret, size - ret) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return size;
+}
+
+static ssize_t cstp_tls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
+{
+	return cstp_push(ptr, data, size);
+}
+
+void cstp_set_transport(worker_st *ws, gnutls_session_t session)
+{
+	gnutls_transport_set_ptr2(session,
+				  (gnutls_transport_ptr_t) (long)ws->conn_fd, ws);
+	gnutls_transport_set_push_function(session, cstp_tls_push);
+}
+
+/* Waits (for a bounded time) until the queued CSTP data are sent; used
+ * before closing the channel. */
+static void cstp_outq_drain(worker_st *ws)
+{
+	struct pollfd pfd;
+	int counter = 10;
+
+	while (ws->cstp_outq.size > 0 && counter-- > 0) {
+		pfd.fd = ws->conn_fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 100) == -1 && errno != EINTR)
+			break;
+
+		if (cstp_outq_flush(ws) < 0)
+			break;
+	}
+}
+
 ssize_t cstp_send(worker_st *ws, const void *data,
 			size_t data_size)
 {
@@ -91,14 +237,12 @@ ssize_t cstp_send(worker_st *ws, const void *data,
 	const uint8_t* p = data;
 
 	if (ws->session != NULL) {
+		/* the push function never blocks */
 		while(left > 0) {
-			ret = gnutls_record_send(ws->session, p, data_size);
+			ret = gnutls_record_send(ws->session, p, left);
 			if (ret < 0) {
 				if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED) {
 					return ret;
-				} else {
-					/* do not cause mayhem */
-					ms_sleep(20);
 				}
 			}
 
@@ -109,7 +253,7 @@ ssize_t cstp_send(worker_st *ws, const void *data,
 		}
 		return data_size;
 	} else {
-		return force_write(ws->conn_fd, data, data_size);
+		return cstp_push(ws, data, data_size);
 	}
 }
 
@@ -137,6 +281,18 @@ int ret;
 	return total;
 }
 
+/* Waits up to @ms milliseconds for @fd to become readable */
+static void wait_for_readable(int fd, int ms)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	poll(&pfd, 1, ms);
+}
+
 static
 int recv_remaining(int fd, uint8_t *p, int left)
 {
@@ -148,7 +304,7 @@ int recv_remaining(int fd, uint8_t *p, int left)
 		ret = recv(fd, p, left, 0);
 		if (ret == -1 && counter > 0 && (errno == EINTR || errno == EAGAIN)) {
 			counter--;
-			ms_sleep(100);
+			wait_for_readable(fd, 100);
 			continue;
 		}
 		if (ret == 0)
@@ -164,6 +320,87 @@ int recv_remaining(int fd, uint8_t *p, int left)
 	return total;
 }
 
+void cstp_inq_init(worker_st *ws)
+{
+	cstp_inq_st *q = &ws->cstp_inq;
+
+	q->data = talloc_size(ws, CSTP_INQ_SIZE);
+	if (q->data == NULL)
+		return;
+
+	q->alloc = CSTP_INQ_SIZE;
+	q->off = 0;
+	q->size = 0;
+}
+
+/* Returns non-zero if a full CSTP frame is queued */
+unsigned cstp_inq_pending(worker_st *ws)
+{
+	cstp_inq_st *q = &ws->cstp_inq;
+	const uint8_t *p;
+
+	if (q->size < 8)
+		return 0;
+
+	p = q->data + q->off;
+	return q->size >= 8 + ((p[4] << 8) | p[5]);
+}
+
+/* Returns the next CSTP frame in @frame, which points into the queue
+ * and remains valid until the next call. It reads from the socket as
+ * much as fits into the queue, and never blocks; if a full frame
+ * is not yet received, it returns -1 with errno set to EAGAIN. A frame
+ * larger than @max_size is fatal; the queue is emptied and -1 is
+ * returned with errno set to EBADMSG. */
+static ssize_t cstp_inq_get(worker_st *ws, uint8_t **frame, size_t max_size)
+{
+	cstp_inq_st *q = &ws->cstp_inq;
+	unsigned pktlen;
+	uint8_t *p;
+	ssize_t ret;
+
+	if (max_size > q->alloc)
+		max_size = q->alloc;
+
+	for (;;) {
+		if (q->size >= 8) {
+			p = q->data + q->off;
+
+			pktlen = (p[4] << 8) | p[5];
+			if (pktlen+8 > max_size) {
+				oclog(ws, LOG_ERR, "error in CSTP packet length");
+				q->off = 0;
+				q->size = 0;
+				errno = EBADMSG;
+				return -1;
+			}
+
+			if (q->size >= pktlen+8) {
+				*frame = p;
+				q->off += pktlen+8;
+				q->size -= pktlen+8;
+				if (q->size == 0)
+					q->off = 0;
+				return pktlen+8;
+			}
+		}
+
+		/* move the incomplete frame to the start */
+		if (q->off > 0) {
+			memmove(q->data, q->data + q->off, q->size);
+			q->off = 0;
+		}
+
+		ret = recv(ws->conn_fd, q->data + q->size, q->alloc - q->size, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret;
+
+		q->size += ret;
+	}
+}
+
 /* Receives CSTP packet, after the channel is established.
  * It makes sure that CSTP packet boundaries are respected in
  * case we do not read over TLS - e.g., when TLS is done by
@@ -176,6 +413,13 @@ static ssize_t _cstp_recv_packet(worker_st *ws, void *data, size_t data_size)
 
 	if (ws->session != NULL) {
 		return gnutls_record_recv(ws->session, data, data_size);
+	} else if (ws->cstp_inq.data != NULL) {
+		uint8_t *frame;
+
+		ret = cstp_inq_get(ws, &frame, data_size);
+		if (ret > 0)
+			memcpy(data, frame, ret);
+		return ret;
 	} else {
 		/* It can happen in UNIX sockets case that we receive an
 		 * incomplete CSTP packet. In that case we attempt to read
@@ -193,7 +437,8 @@ static ssize_t _cstp_recv_packet(worker_st *ws, void *data, size_t data_size)
 		pktlen = (p[4] << 8) + p[5];
 		if (pktlen+8 > data_size) {
 			oclog(ws, LOG_ERR, "error in CSTP packet length");
-			return GNUTLS_E_UNEXPECTED_PACKET_LENGTH;
+			errno = EBADMSG;
+			return -1;
 		}
 
 		if (pktlen > 0) {
@@ -209,6 +454,16 @@ static ssize_t _cstp_recv_packet(worker_st *ws, void *data, size_t data_size)
 ssize_t cstp_recv_packet(worker_st *ws, gnutls_datum_t *data, void **p)
 {
 	int ret;
+	uint8_t *frame;
+
+	/* without TLS the frame is used in place */
+	if (ws->session == NULL && ws->cstp_inq.data != NULL) {
+		ret = cstp_inq_get(ws, &frame, ws->buffer_size);
+		data->data = frame;
+		data->size = ret;
+		return ret;
+	}
+
 #ifdef ZERO_COPY
 	gnutls_packet_t packet = NULL;
 
@@ -243,7 +498,7 @@ ssize_t cstp_recv(worker_st *ws, void *data, size_t data_size)
 			ret = gnutls_record_recv(ws->session, data, data_size);
 			if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
 				counter--;
-				ms_sleep(20);
+				wait_for_readable(ws->conn_fd, 20);
 			}
 		} while ((ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) && counter > 0);
 	} else {
@@ -251,7 +506,7 @@ ssize_t cstp_recv(worker_st *ws, void *data, size_t data_size)
 			ret = recv(ws->conn_fd, data, data_size, 0);
 			if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
 				counter--;
-				ms_sleep(20);
+				wait_for_readable(ws->conn_fd, 20);
 			}
 		} while(ret == -1 && (errno == EINTR || errno == EAGAIN) && counter > 0);
 	}
@@ -306,6 +561,8 @@ int __attribute__ ((format(printf, 2, 3)))
 
 void cstp_close(worker_st *ws)
 {
+	cstp_outq_drain(ws);
+
 	if (ws->session) {
 		gnutls_bye(ws->session, GNUTLS_SHUT_WR);
 		gnutls_deinit(ws->session);
@@ -348,31 +605,18 @@ ssize_t dtls_recv_packet(worker_st *ws, gnutls_datum_t *data, void **p)
 	return ret;
 }
 
+/* The DTLS push function drops the records which cannot be sent, hence
+ * that function does not block. */
 ssize_t dtls_send(worker_st *ws, const void *data,
 			size_t data_size)
 {
 	int ret;
-	int left = data_size;
-	const uint8_t* p = data;
-
-	while(left > 0) {
-		ret = gnutls_record_send(ws->dtls_session, p, data_size);
-		if (ret < 0) {
-			if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED) {
-				return ret;
-			} else {
-				/* do not cause mayhem */
-				ms_sleep(20);
-			}
-		}
 
-		if (ret > 0) {
-			left -= ret;
-			p += ret;
-		}
-	}
+	do {
+		ret = gnutls_record_send(ws->dtls_session, data, data_size);
+	} while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
 
-	return data_size;
+	return ret;
 }
 
 void dtls_close(worker_st *ws)
@@ -395,6 +639,7 @@ void tls_cache_init(void *pool, tls_sess_db_st* db)
 		exit(1);
 
 	htable_init(db->ht, rehash, NULL);
+	list_head_init(&db->list);
 	db->entries = 0;
 }
 
@@ -415,6 +660,7 @@ void tls_cache_deinit(tls_sess_db_st* db)
 		cache = htable_next(db->ht, &iter);
         }
         htable_clear(db->ht);
+	list_head_init(&db->list);
 	db->entries = 0;
 	talloc_free(db->ht);
 
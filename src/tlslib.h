@@ -44,6 +44,7 @@
 typedef struct 
 {
 	struct htable *ht;
+	struct list_head list; /* the entries in the order they were stored */
 	unsigned int entries;
 } tls_sess_db_st;
 
@@ -119,6 +120,8 @@ typedef struct
   unsigned int session_data_size;
 
   char *vhostname;
+
+  struct list_node list;
 } tls_cache_st;
 
 #define TLS_SESSION_EXPIRATION_TIME(config) ((config)->cookie_timeout)
@@ -139,6 +142,10 @@ ssize_t cstp_send_file(struct worker_st *ws, const char *file);
 ssize_t cstp_send(struct worker_st *ws, const void *data,
 			size_t data_size);
 #define cstp_puts(s, str) cstp_send(s, str, sizeof(str)-1)
+void cstp_set_transport(struct worker_st *ws, gnutls_session_t session);
+ssize_t cstp_outq_flush(struct worker_st *ws);
+void cstp_inq_init(struct worker_st *ws);
+unsigned cstp_inq_pending(struct worker_st *ws);
 
 void cstp_cork(struct worker_st *ws);
 int cstp_uncork(struct worker_st *ws);
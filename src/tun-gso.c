@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <tun-gso.h>
+
+/* Segmentation of the super-packets provided by a tun device which
+ * has TSO/USO offloads enabled. The packets are segmented just before
+ * they are encrypted and sent to the client, and their checksums
+ * are calculated in software.
+ */
+
+#ifdef ENABLE_TUN_OFFLOAD
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, unsigned size)
+{
+	unsigned i;
+
+	for (i=0;i+1<size;i+=2)
+		sum += (data[i] << 8) | data[i+1];
+
+	if (size & 1)
+		sum += data[size-1] << 8;
+
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum & 0xffff;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/* Calculates the TCP or UDP checksum of the provided packet, including
+ * the IP pseudo-header. */
+static void l4_csum(uint8_t *pkt, unsigned pkt_size, unsigned ipv4,
+		    unsigned proto, unsigned l4_off)
+{
+	uint32_t sum = 0;
+	unsigned l4_size = pkt_size - l4_off;
+	unsigned csum_off = (proto == IPPROTO_TCP)?16:6;
+	uint16_t csum;
+
+	put16(pkt+l4_off+csum_off, 0);
+
+	if (ipv4)
+		sum = csum_add(sum, pkt+12, 8);
+	else
+		sum = csum_add(sum, pkt+8, 32);
+	sum += proto;
+	sum += l4_size;
+
+	sum = csum_add(sum, pkt+l4_off, l4_size);
+	csum = csum_fold(sum);
+	if (csum == 0 && proto == IPPROTO_UDP)
+		csum = 0xffff;
+
+	put16(pkt+l4_off+csum_off, csum);
+}
+
+/* Completes the checksum of a packet when the kernel
+ * has set VIRTIO_NET_HDR_F_NEEDS_CSUM. The checksum field contains
+ * the partial sum of the pseudo-header. */
+int tun_csum_finish(const struct virtio_net_hdr *hdr, uint8_t *pkt, unsigned pkt_size)
+{
+	unsigned start = hdr->csum_start;
+	unsigned off = hdr->csum_offset;
+
+	if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return 0;
+
+	if (start >= pkt_size || start + off + 2 > pkt_size)
+		return -1;
+
+	put16(pkt+start+off, csum_fold(csum_add(0, pkt+start, pkt_size-start)));
+	return 0;
+}
+
+int tun_gso_init(tun_gso_st *st, const struct virtio_net_hdr *hdr,
+		 const uint8_t *pkt, unsigned pkt_size, unsigned max_seg_size)
+{
+	unsigned type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+	unsigned l4_hdr_size;
+
+	memset(st, 0, sizeof(*st));
+	st->pkt = pkt;
+	st->pkt_size = pkt_size;
+	st->mss = hdr->gso_size;
+
+	if (pkt_size < 20 || st->mss == 0)
+		return -1;
+
+	switch (type) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		st->ipv4 = 1;
+		st->proto = IPPROTO_TCP;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		st->proto = IPPROTO_TCP;
+		break;
+#ifdef VIRTIO_NET_HDR_GSO_UDP_L4
+	case VIRTIO_NET_HDR_GSO_UDP_L4:
+		st->ipv4 = ((pkt[0] >> 4) == 4);
+		st->proto = IPPROTO_UDP;
+		break;
+#endif
+	default:
+		return -1;
+	}
+
+	if ((pkt[0] >> 4) != (st->ipv4?4:6))
+		return -1;
+
+	/* the kernel sets the start of the transport header, even
+	 * if there are IPv6 extension headers present */
+	if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+		st->l4_off = hdr->csum_start;
+	else if (st->ipv4)
+		st->l4_off = (pkt[0] & 0x0f) * 4;
+	else
+		st->l4_off = 40;
+
+	if (st->l4_off < 20 || st->l4_off + 20 > pkt_size)
+		return -1;
+
+	if (st->proto == IPPROTO_TCP)
+		l4_hdr_size = (pkt[st->l4_off+12] >> 4) * 4;
+	else
+		l4_hdr_size = 8;
+
+	st->hdr_len = st->l4_off + l4_hdr_size;
+	if (l4_hdr_size < 8 || st->hdr_len >= pkt_size || st->hdr_len >= max_seg_size)
+		return -1;
+
+	if (st->hdr_len + st->mss > max_seg_size) {
+		/* UDP datagram boundaries cannot be altered */
+		if (st->proto != IPPROTO_TCP)
+			return -1;
+		st->mss = max_seg_size - st->hdr_len;
+	}
+
+	return 0;
+}
+
+/* Outputs the next segment in @out. Returns the size of the
+ * segment, zero when there are no more segments, or a negative
+ * error code. */
+int tun_gso_next(tun_gso_st *st, uint8_t *out, unsigned out_size)
+{
+	unsigned payload = st->pkt_size - st->hdr_len;
+	unsigned seg_payload, seg_size, last;
+	uint8_t *l4;
+
+	if (st->offset >= payload)
+		return 0;
+
+	seg_payload = payload - st->offset;
+	if (seg_payload > st->mss)
+		seg_payload = st->mss;
+	last = (st->offset + seg_payload >= payload);
+
+	seg_size = st->hdr_len + seg_payload;
+	if (seg_size > out_size)
+		return -1;
+
+	memcpy(out, st->pkt, st->hdr_len);
+	memcpy(out+st->hdr_len, st->pkt+st->hdr_len+st->offset, seg_payload);
+
+	l4 = out + st->l4_off;
+
+	if (st->ipv4) {
+		put16(out+2, seg_size);
+		put16(out+4, get16(st->pkt+4) + st->idx);
+		put16(out+10, 0);
+		put16(out+10, csum_fold(csum_add(0, out, (out[0] & 0x0f) * 4)));
+	} else {
+		put16(out+4, seg_size - 40);
+	}
+
+	if (st->proto == IPPROTO_TCP) {
+		uint32_t seq;
+
+		memcpy(&seq, l4+4, 4);
+		seq = htonl(ntohl(seq) + st->offset);
+		memcpy(l4+4, &seq, 4);
+
+		if (!last)
+			l4[13] &= ~(TCP_FLAG_FIN|TCP_FLAG_PSH);
+		if (st->idx > 0)
+			l4[13] &= ~TCP_FLAG_CWR;
+	} else {
+		put16(l4+4, seg_size - st->l4_off);
+	}
+
+	l4_csum(out, seg_size, st->ipv4, st->proto, st->l4_off);
+
+	st->offset += seg_payload;
+	st->idx++;
+
+	return seg_size;
+}
+
+ssize_t tun_read_vnet(int sockfd, struct virtio_net_hdr *hdr, void *buf, size_t len)
+{
+	struct iovec iov[2];
+	ssize_t ret;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+
+	ret = readv(sockfd, iov, 2);
+	if (ret < 0)
+		return ret;
+
+	if ((size_t)ret < sizeof(*hdr)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ret - sizeof(*hdr);
+}
+
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len)
+{
+	struct virtio_net_hdr hdr;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	/* we hand complete, checksummed packets to the kernel */
+	memset(&hdr, 0, sizeof(hdr));
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void*)buf;
+	iov[1].iov_len = len;
+
+	ret = writev(sockfd, iov, 2);
+	if (ret >= (ssize_t)sizeof(hdr))
+		ret -= sizeof(hdr);
+	return ret;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TUN_GSO_H
+# define TUN_GSO_H
+
+#include <config.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_VIRTIO_NET_H)
+# define ENABLE_TUN_OFFLOAD 1
+#endif
+
+#ifdef ENABLE_TUN_OFFLOAD
+# include <linux/virtio_net.h>
+
+/* The maximum size of a packet read from a tun device with
+ * offloads enabled (i.e., a GSO super-packet). */
+#define TUN_GSO_MAX_SIZE (64*1024)
+
+typedef struct tun_gso_st {
+	const uint8_t *pkt;
+	unsigned pkt_size;
+
+	unsigned ipv4; /* otherwise IPv6 */
+	unsigned proto; /* IPPROTO_TCP or IPPROTO_UDP */
+	unsigned l4_off; /* the offset of the TCP/UDP header */
+	unsigned hdr_len; /* the size of all headers */
+	unsigned mss; /* payload size of each segment */
+
+	unsigned offset; /* payload bytes already output */
+	unsigned idx; /* segment index */
+} tun_gso_st;
+
+int tun_gso_init(tun_gso_st *st, const struct virtio_net_hdr *hdr,
+		 const uint8_t *pkt, unsigned pkt_size, unsigned max_seg_size);
+int tun_gso_next(tun_gso_st *st, uint8_t *out, unsigned out_size);
+
+int tun_csum_finish(const struct virtio_net_hdr *hdr, uint8_t *pkt, unsigned pkt_size);
+
+ssize_t tun_read_vnet(int sockfd, struct virtio_net_hdr *hdr, void *buf, size_t len);
+ssize_t tun_write_vnet(int sockfd, const void *buf, size_t len);
+#endif
+
+#endif
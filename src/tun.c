@@ -47,6 +47,7 @@
 #include <vpn.h>
 #include <tun.h>
 #include <main.h>
+#include <tun-gso.h>
 #include <ccan/list/list.h>
 #include "vhost.h"
 
@@ -652,6 +653,10 @@ static int os_open_tun(main_server_st * s, struct proc_st *proc)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+#ifdef ENABLE_TUN_OFFLOAD
+	if (GETCONFIG(s)->tun_offload)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+#endif
 
 	memcpy(ifr.ifr_name, proc->tun_lease.name, IFNAMSIZ);
 
@@ -665,6 +670,38 @@ static int os_open_tun(main_server_st * s, struct proc_st *proc)
 	mslog(s, proc, LOG_DEBUG, "assigning tun device %s\n",
 	      proc->tun_lease.name);
 
+#ifdef ENABLE_TUN_OFFLOAD
+	if (GETCONFIG(s)->tun_offload) {
+		int hdr_size = sizeof(struct virtio_net_hdr);
+
+		if (ioctl(tunfd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_ERR, "%s: TUNSETVNETHDRSZ: %s\n",
+			      proc->tun_lease.name, strerror(e));
+			goto fail;
+		}
+
+		/* the worker segments the packets and calculates checksums
+		 * prior to encryption. */
+		t = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+# if defined(TUN_F_USO4) && defined(VIRTIO_NET_HDR_GSO_UDP_L4)
+		t |= TUN_F_USO4 | TUN_F_USO6;
+# endif
+		if (ioctl(tunfd, TUNSETOFFLOAD, t) < 0) {
+# if defined(TUN_F_USO4) && defined(VIRTIO_NET_HDR_GSO_UDP_L4)
+			/* kernels prior to 6.2 do not support USO */
+			t &= ~(TUN_F_USO4 | TUN_F_USO6);
+			if (ioctl(tunfd, TUNSETOFFLOAD, t) < 0)
+# endif
+			{
+				e = errno;
+				mslog(s, NULL, LOG_INFO, "%s: TUNSETOFFLOAD: %s\n",
+				      proc->tun_lease.name, strerror(e));
+			}
+		}
+	}
+#endif
+
 	/* we no longer use persistent tun */
 	if (ioctl(tunfd, TUNSETPERSIST, (void *)0) < 0) {
 		e = errno;
@@ -727,6 +764,10 @@ int open_tun(main_server_st * s, struct proc_st *proc)
 
 	set_cloexec_flag(tunfd, 1);
 
+	/* the worker drains multiple packets per wakeup */
+	if (GETCONFIG(s)->tun_batch_size > 1)
+		set_non_block(tunfd);
+
 	if (proc->tun_lease.name[0] == 0) {
 		mslog(s, NULL, LOG_ERR, "tun device with no name!");
 		goto fail;
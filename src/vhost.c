@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <c-ctype.h>
+#include <c-strcase.h>
+#include <talloc.h>
+#include <ccan/hash/hash.h>
+#include <ccan/htable/htable.h>
+
+#include <vpn.h>
+#include <vhost.h>
+
+/* The index of the virtual host names. It is built once the configuration
+ * is (re-)loaded, and is not modified afterwards; a new one replaces it on
+ * the next reload. Names are compared case-insensitively, and a name of
+ * the form '*.example.com' matches any name ending in '.example.com'.
+ */
+
+struct vhost_key_st {
+	const char *prefix; /* "*" for wildcard lookups */
+	const char *name;
+};
+
+/* hashes the lower case form of prefix and name, as if they were a
+ * single string */
+static size_t hash_folded(const char *prefix, const char *name)
+{
+	const char *parts[2] = {prefix, name};
+	const char *p;
+	char buf[64];
+	size_t h = 0;
+	unsigned i = 0, j;
+
+	for (j = 0; j < 2; j++) {
+		for (p = parts[j]; *p != 0; p++) {
+			buf[i++] = c_tolower(*p);
+			if (i == sizeof(buf)) {
+				h = hash_any(buf, i, h);
+				i = 0;
+			}
+		}
+	}
+
+	return hash_any(buf, i, h);
+}
+
+static size_t rehash_vhost(const void *_e, void *unused)
+{
+	const vhost_cfg_st *vhost = _e;
+
+	return hash_folded("", vhost->name);
+}
+
+static bool vhost_cmp(const void *_e, void *_k)
+{
+	const vhost_cfg_st *vhost = _e;
+	const struct vhost_key_st *k = _k;
+
+	if (k->prefix[0] != 0) {
+		if (vhost->name[0] != '*')
+			return 0;
+		return c_strcasecmp(vhost->name+1, k->name) == 0;
+	}
+
+	return c_strcasecmp(vhost->name, k->name) == 0;
+}
+
+static vhost_cfg_st *index_get(struct htable *ht, const char *prefix, const char *name)
+{
+	struct vhost_key_st k;
+
+	k.prefix = prefix;
+	k.name = name;
+
+	return htable_get(ht, hash_folded(prefix, name), vhost_cmp, &k);
+}
+
+void vhost_index_build(struct list_head *head)
+{
+	vhost_cfg_st *vhost = NULL, *defvhost = default_vhost(head);
+	struct htable *ht;
+
+	ht = talloc(defvhost, struct htable);
+	if (ht == NULL)
+		return;
+
+	htable_init(ht, rehash_vhost, NULL);
+
+	/* on duplicates the first on the list is kept, as with the
+	 * list search */
+	list_for_each(head, vhost, list) {
+		if (vhost->name == NULL)
+			continue;
+
+		if (index_get(ht, "", vhost->name) != NULL)
+			continue;
+
+		if (htable_add(ht, rehash_vhost(vhost, NULL), vhost) == 0) {
+			htable_clear(ht);
+			talloc_free(ht);
+			return;
+		}
+	}
+
+	if (defvhost->name_index != NULL) {
+		htable_clear(defvhost->name_index);
+		talloc_free(defvhost->name_index);
+	}
+	defvhost->name_index = ht;
+}
+
+vhost_cfg_st *vhost_index_find(struct list_head *head, const char *name)
+{
+	vhost_cfg_st *vhost = NULL, *defvhost = default_vhost(head);
+	const char *p;
+
+	if (defvhost->name_index == NULL) {
+		list_for_each(head, vhost, list) {
+			if (vhost->name != NULL && c_strcasecmp(vhost->name, name) == 0)
+				return vhost;
+		}
+		return NULL;
+	}
+
+	vhost = index_get(defvhost->name_index, "", name);
+	if (vhost != NULL)
+		return vhost;
+
+	/* the most specific wildcard first */
+	for (p = strchr(name, '.'); p != NULL; p = strchr(p+1, '.')) {
+		vhost = index_get(defvhost->name_index, "*", p);
+		if (vhost != NULL)
+			return vhost;
+	}
+
+	return NULL;
+}
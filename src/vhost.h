@@ -54,6 +54,9 @@ typedef struct vhost_cfg_st {
 	gnutls_privkey_t *key;
 	unsigned key_size;
 
+	/* the index of the vhost names; only set on the default vhost */
+	struct htable *name_index;
+
 	/* temporary values used during config loading
 	 */
 	char *acct;
@@ -116,19 +119,26 @@ inline static vhost_cfg_st *default_vhost(struct list_head *vconfig)
 
 #include <c-strcase.h>
 
+/* Builds the index used by find_vhost(); called once the configuration
+ * is (re-)loaded */
+void vhost_index_build(struct list_head *head);
+
+/* returns NULL if no vhost matches */
+vhost_cfg_st *vhost_index_find(struct list_head *head, const char *name);
+
 /* always returns a vhost */
 inline static vhost_cfg_st *find_vhost(struct list_head *vconfig, const char *name)
 {
-	vhost_cfg_st *vhost = NULL;
+	vhost_cfg_st *vhost;
+
 	if (name == NULL)
 		return default_vhost(vconfig);
-	
-	list_for_each(vconfig, vhost, list) {
-		if (vhost->name != NULL && c_strcasecmp(vhost->name, name) == 0)
-			return vhost;
-	}
 
-	return default_vhost(vconfig);
+	vhost = vhost_index_find(vconfig, name);
+	if (vhost == NULL)
+		return default_vhost(vconfig);
+
+	return vhost;
 }
 
 #endif
@@ -105,6 +105,12 @@ inline static const char *proto_to_str(fw_proto_t proto)
 #define MIN_NO_COMPRESS_LIMIT 64
 #define DEFAULT_NO_COMPRESS_LIMIT 256
 
+/* The maximum number of packets drained from the tun device
+ * on a single poll wakeup (see tun-batch-size). */
+#define MAX_TUN_BATCH_SIZE 64
+#define MAX_SEC_MOD_THREADS 64
+#define MAX_WORKER_POOL_SIZE 256
+
 /* The time after which a user will be forced to authenticate
  * or disconnect. */
 #define DEFAULT_AUTH_TIMEOUT_SECS 1800
@@ -236,6 +242,7 @@ struct cfg_st {
 	char *priorities;
 	unsigned enable_compression;
 	unsigned no_compress_limit;	/* under this size (in bytes) of data there will be no compression */
+	unsigned adaptive_compression;	/* skip compression on flows which do not benefit */
 
 	char *banner;
 	char *ocsp_response; /* file with the OCSP response */
@@ -299,6 +306,9 @@ struct cfg_st {
 	                               * TCP sessions. */
 	unsigned rate_limit_ms; /* if non zero force a connection every rate_limit milliseconds */
 	unsigned ping_leases; /* non zero if we need to ping prior to leasing */
+	unsigned sec_mod_threads; /* threads running the blocking auth modules; zero to disable */
+	unsigned worker_pool_size; /* pre-forked idle workers; zero to disable */
+	unsigned worker_cmd_ring; /* frequent worker messages over a shared-memory ring */
 
 	size_t rx_per_sec;
 	size_t tx_per_sec;
@@ -307,15 +317,20 @@ struct cfg_st {
 	char *crl;
 
 	unsigned output_buffer;
+	unsigned tun_batch_size; /* packets read from tun and sent on a single wakeup */
+	unsigned tun_offload; /* whether the tun device is opened with a virtio-net header and TSO */
 	unsigned default_mtu;
 	unsigned predictable_ips; /* boolean */
 
 	char *route_add_cmd;
 	char *route_del_cmd;
+	unsigned route_netlink; /* apply the iroutes over rtnetlink instead of the commands */
 
 	char *connect_script;
 	char *host_update_script;
 	char *disconnect_script;
+	unsigned script_max_concurrency; /* 0 is unlimited */
+	unsigned script_queue_size; /* 0 is unlimited */
 
 	char *cgroup;
 	char *proxy_url;
@@ -358,6 +373,7 @@ struct perm_cfg_st {
 
 	char *chroot_dir;	/* where the xml files are served from */
 	char* occtl_socket_file;
+	char* metrics_socket_file;
 	char* socket_file_prefix;
 
 	uid_t uid;
@@ -388,6 +404,7 @@ struct perm_cfg_st {
 	char* unix_conn_file;
 	unsigned int port;
 	unsigned int udp_port;
+	unsigned int tls_session_cache_size; /* entries of the shared resumption cache */
 
 	/* attic, where old config allocated values are stored */
 	struct list_head attic;
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <netinet/in.h>
+#include <ccan/hash/hash.h>
+#include <worker-comp.h>
+
+/* Adaptive compression bypass. Most of the tunneled traffic is already
+ * encrypted and cannot be compressed; to avoid spending CPU on it, the
+ * outcome of the compression attempts is tracked per inner flow, and a
+ * flow for which compression does not help is skipped for an
+ * exponentially increasing number of packets. Flows which carry TLS
+ * records or QUIC are considered incompressible without an attempt.
+ */
+
+/* A compression is worthwhile if it saves at least 1/16 of the size */
+#define COMP_MIN_SAVINGS(size) ((size) / 16)
+
+#define TLS_APP_DATA 0x17
+
+/* Returns the flow key of the packet, and sets @encrypted if the
+ * payload is known to be encrypted. */
+static uint32_t flow_key(const uint8_t *pkt, unsigned size, unsigned *encrypted)
+{
+	unsigned proto, l4_off;
+	uint32_t key;
+	const uint8_t *l4;
+
+	*encrypted = 0;
+
+	if (size < 20)
+		return 0;
+
+	if ((pkt[0] >> 4) == 4) {
+		proto = pkt[9];
+		l4_off = (pkt[0] & 0x0f) * 4;
+		key = hash_any(pkt + 12, 8, proto);
+
+		/* fragments have no ports */
+		if (((pkt[6] & 0x1f) | pkt[7]) != 0)
+			return key;
+	} else if ((pkt[0] >> 4) == 6 && size >= 40) {
+		proto = pkt[6];
+		l4_off = 40;
+		key = hash_any(pkt + 8, 32, proto);
+	} else {
+		return 0;
+	}
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return key;
+
+	if (l4_off + 8 > size)
+		return key;
+
+	l4 = pkt + l4_off;
+	key = hash_any(l4, 4, key);
+
+	if (proto == IPPROTO_UDP) {
+		/* QUIC */
+		if ((l4[0] == 1 && l4[1] == 0xbb) || (l4[2] == 1 && l4[3] == 0xbb))
+			*encrypted = 1;
+	} else if (l4_off + 20 <= size) {
+		l4_off += (l4[12] >> 4) * 4;
+		if (l4_off + 3 <= size && pkt[l4_off] == TLS_APP_DATA &&
+		    pkt[l4_off+1] == 3 && pkt[l4_off+2] <= 4)
+			*encrypted = 1;
+	}
+
+	return key;
+}
+
+unsigned comp_bypass_check(comp_bypass_st *b, const uint8_t *pkt, unsigned size,
+			   comp_flow_st **flow)
+{
+	comp_flow_st *f;
+	unsigned encrypted;
+	uint32_t key;
+
+	if (b == NULL) {
+		*flow = NULL;
+		return 1;
+	}
+
+	key = flow_key(pkt, size, &encrypted);
+
+	f = &b->flows[key % COMP_FLOW_SLOTS];
+	if (f->key != key) {
+		/* a new flow takes over the slot */
+		memset(f, 0, sizeof(*f));
+		f->key = key;
+	}
+	*flow = f;
+
+	if (encrypted) {
+		f->backoff = COMP_MAX_BACKOFF;
+		f->skip = COMP_MAX_BACKOFF;
+		return 0;
+	}
+
+	if (f->skip > 0) {
+		f->skip--;
+		return 0;
+	}
+
+	return 1;
+}
+
+void comp_bypass_update(comp_flow_st *f, unsigned size, int compressed_size)
+{
+	if (f == NULL)
+		return;
+
+	if (compressed_size > 0 &&
+	    (unsigned)compressed_size + COMP_MIN_SAVINGS(size) < size) {
+		f->backoff = 0;
+		return;
+	}
+
+	if (f->backoff == 0)
+		f->backoff = 1;
+	else if (f->backoff < COMP_MAX_BACKOFF)
+		f->backoff *= 2;
+	f->skip = f->backoff;
+}
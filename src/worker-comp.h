@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WORKER_COMP_H
+# define WORKER_COMP_H
+
+#include <stdint.h>
+
+/* The number of flows (inner 5-tuples) tracked per session */
+#define COMP_FLOW_SLOTS 64
+
+/* The maximum number of packets of a flow to skip after failed
+ * compression attempts */
+#define COMP_MAX_BACKOFF 128
+
+typedef struct comp_flow_st {
+	uint32_t key;
+	uint16_t backoff; /* packets skipped after the last failure */
+	uint16_t skip; /* packets to skip before the next attempt */
+} comp_flow_st;
+
+typedef struct comp_bypass_st {
+	comp_flow_st flows[COMP_FLOW_SLOTS];
+} comp_bypass_st;
+
+/* Returns non-zero if compression should be attempted on the IP packet
+ * @pkt of @size bytes. @flow is set to the flow state to pass to
+ * comp_bypass_update(), or NULL if @b is NULL. */
+unsigned comp_bypass_check(comp_bypass_st *b, const uint8_t *pkt, unsigned size,
+			   comp_flow_st **flow);
+
+/* Records whether compressing a packet of the flow was worthwhile */
+void comp_bypass_update(comp_flow_st *flow, unsigned size, int compressed_size);
+
+#endif
@@ -19,6 +19,7 @@
 
 #include <config.h>
 #include <worker.h>
+#include <resume-shm.h>
 
 #ifdef HAVE_LIBSECCOMP
 
@@ -72,11 +73,15 @@ int disable_system_calls(struct worker_st *ws)
 #endif
 	ADD_SYSCALL(recvmsg, 0);
 	ADD_SYSCALL(sendmsg, 0);
+#ifdef HAVE_SENDMMSG
+	ADD_SYSCALL(sendmmsg, 0); /* used when tun-batch-size is set */
+#endif
 
 	ADD_SYSCALL(read, 0);
 
 	ADD_SYSCALL(write, 0);
 	ADD_SYSCALL(writev, 0);
+	ADD_SYSCALL(readv, 0); /* used when tun-offload is set */
 
 	ADD_SYSCALL(send, 0);
 	ADD_SYSCALL(recv, 0);
@@ -107,6 +112,11 @@ int disable_system_calls(struct worker_st *ws)
 	ADD_SYSCALL(getsockopt, 0);
 	ADD_SYSCALL(setsockopt, 0);
 
+	/* the locks of the shared TLS session cache */
+	if (resume_shm_enabled()) {
+		ADD_SYSCALL(futex, 0);
+	}
+
 	/* we need to open files when we have an xml_config_file setup on any vhost */
 	list_for_each(ws->vconfig, vhost, list) {
 		if (vhost->perm_config.config->xml_config_file) {
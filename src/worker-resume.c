@@ -38,6 +38,7 @@
 #include "common.h"
 #include "ipc.pb-c.h"
 #include <tlslib.h>
+#include <resume-shm.h>
 
 
 static int recv_resume_fetch_reply(worker_st *ws, int sd, gnutls_datum_t *sdata)
@@ -90,6 +91,12 @@ static gnutls_datum_t resume_db_fetch(void *dbf, gnutls_datum_t key)
 		return r;
 	}
 
+	if (resume_shm_enabled()) {
+		resume_shm_fetch(&key, &ws->remote_addr, ws->remote_addr_len,
+				 ws->vhost->name, TLS_SESSION_EXPIRATION_TIME(WSCONFIG(ws)), &r);
+		return r;
+	}
+
 	sd = connect_to_secmod(ws);
 	if (sd == -1) {
 		oclog(ws, LOG_DEBUG, "cannot connect to secmod");
@@ -134,6 +141,13 @@ resume_db_store (void *dbf, gnutls_datum_t key, gnutls_datum_t data)
 		return GNUTLS_E_DB_ERROR;
 	}
 
+	if (resume_shm_enabled()) {
+		if (resume_shm_store(&key, &ws->remote_addr, ws->remote_addr_len,
+				     ws->vhost->name, &data) < 0)
+			return GNUTLS_E_DB_ERROR;
+		return 0;
+	}
+
 	msg.session_id.len = key.size;
 	msg.session_data.len = data.size;
 
@@ -179,6 +193,11 @@ static int resume_db_delete(void *dbf, gnutls_datum_t key)
 		return GNUTLS_E_DB_ERROR;
 	}
 
+	if (resume_shm_enabled()) {
+		resume_shm_delete(&key);
+		return 0;
+	}
+
 	msg.session_id.len = key.size;
 	msg.session_id.data = key.data;
 
@@ -56,8 +56,11 @@
 #include "ipc.pb-c.h"
 #include <worker.h>
 #include <tlslib.h>
+#include <tun-gso.h>
+#include <worker-comp.h>
 
 #include <http_parser.h>
+#include <ccan/container_of/container_of.h>
 
 #define MIN_MTU(ws) (((ws)->vinfo.ipv6!=NULL)?1280:800)
 
@@ -96,6 +99,8 @@ static void set_net_priority(worker_st * ws, int fd, int priority);
 static void set_socket_timeout(worker_st * ws, int fd);
 
 static void link_mtu_set(worker_st * ws, unsigned mtu);
+static int mtu_not_ok(worker_st * ws);
+static void dtls_batch_init(worker_st *ws);
 
 static void handle_alarm(int signo)
 {
@@ -182,12 +187,183 @@ int dtls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
 	return ret;
 }
 
+/* Handles a queued DTLS record which could not be sent. A record
+ * which is too large for the path lowers the MTU, and its packet is
+ * sent over CSTP as with the records which are not batched, if it is
+ * still in its slot; any other is dropped. It is called out of GnuTLS,
+ * as it may update the DTLS session.
+ */
+static void dtls_batch_failed(dtls_transport_ptr *p, unsigned i, int e,
+			      unsigned *mtu_updated)
+{
+	worker_st *ws = container_of(p, struct worker_st, dtls_tptr);
+	dtls_batch_st *b = p->batch;
+	uint8_t *pkt = b->plain[i];
+	size_t size = b->plain_size[i];
+	int ret;
+
+	/* the following records were produced for the same MTU */
+	if (e == EMSGSIZE && *mtu_updated == 0) {
+		mtu_not_ok(ws);
+		*mtu_updated = 1;
+	}
+
+	if (e != EMSGSIZE || size == 0 || ws->cstp_outq.size >= CSTP_OUTQ_LIMIT) {
+		p->drops++;
+		return;
+	}
+
+	oclog(ws, LOG_TRANSFER_DEBUG, "retrying (TLS) %d\n", (int)size);
+
+	pkt[0] = 'S';
+	pkt[1] = 'T';
+	pkt[2] = 'F';
+	pkt[3] = 1;
+	pkt[4] = size >> 8;
+	pkt[5] = size & 0xff;
+	pkt[6] = AC_PKT_DATA;
+	pkt[7] = 0;
+
+	ret = cstp_send(ws, pkt, size + 8);
+	CSTP_FATAL_ERR_CMD(ws, ret, exit_worker_reason(ws, REASON_ERROR));
+}
+
+/* Sends all the DTLS records queued while draining the tun device.
+ * Records which cannot be sent are dropped, as it would happen
+ * to any other datagram in the path, and the rest are still sent.
+ * It must not be called from the DTLS transport functions.
+ */
+static int dtls_batch_flush(dtls_transport_ptr *p)
+{
+	dtls_batch_st *b = p->batch;
+	unsigned i, mtu_updated = 0;
+	int ret = 0, e = 0;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[MAX_TUN_BATCH_SIZE];
+	struct iovec iov[MAX_TUN_BATCH_SIZE];
+#endif
+
+	if (b == NULL || b->count == 0)
+		return 0;
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(msgs[0])*b->count);
+	for (i=0;i<b->count;i++) {
+		iov[i].iov_base = b->data[i];
+		iov[i].iov_len = b->size[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	i = 0;
+	while (i < b->count) {
+		ret = sendmmsg(p->fd, &msgs[i], b->count - i, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/* the first record failed; skip it */
+			e = errno;
+			dtls_batch_failed(p, i, e, &mtu_updated);
+			i++;
+			continue;
+		}
+		i += ret;
+	}
+#else
+	for (i=0;i<b->count;i++) {
+		do {
+			ret = send(p->fd, b->data[i], b->size[i], 0);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret == -1) {
+			e = errno;
+			dtls_batch_failed(p, i, e, &mtu_updated);
+		}
+	}
+#endif
+
+	b->count = 0;
+	if (e != 0) {
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
 static
 ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
 {
 	dtls_transport_ptr *p = ptr;
+	dtls_batch_st *b = p->batch;
+	ssize_t ret;
 
-	return send(p->fd, data, size, 0);
+	/* the records are only queued here; tun_send_to_client() makes
+	 * room for them, so that the batch is never sent from within
+	 * GnuTLS */
+	if (b != NULL && b->active && size <= DTLS_BATCH_SLOT_SIZE &&
+	    b->count < b->max) {
+		memcpy(b->data[b->count], data, size);
+		b->size[b->count] = size;
+
+		if (b->cur == b->plain[b->count] + 8)
+			b->plain_size[b->count] = b->cur_size;
+		else
+			b->plain_size[b->count] = 0;
+		b->count++;
+		return size;
+	}
+
+	do {
+		ret = send(p->fd, data, size, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+		/* the socket buffer is full; drop the record as it
+		 * would happen to any other datagram in the path */
+		p->drops++;
+		return size;
+	}
+
+	return ret;
+}
+
+/* Sends the queued DTLS records if the record of a packet of @size
+ * bytes cannot be queued after them. It is called before the packet
+ * is encrypted, as the batch must not be sent from within GnuTLS.
+ */
+static void dtls_batch_reserve(worker_st *ws, unsigned size)
+{
+	dtls_batch_st *b = ws->dtls_tptr.batch;
+	int e;
+
+	if (b == NULL || !b->active || b->count == 0)
+		return;
+
+	if (b->count < b->max &&
+	    size + 1 + ws->dtls_crypto_overhead <= DTLS_BATCH_SLOT_SIZE)
+		return;
+
+	if (dtls_batch_flush(&ws->dtls_tptr) < 0) {
+		e = errno;
+		oclog(ws, LOG_TRANSFER_DEBUG, "could not send DTLS batch: %s", strerror(e));
+	}
+}
+
+/* Returns the buffer to read a tun packet of up to @size bytes into,
+ * at offset 8. While the tun device is drained in a batch, that is the
+ * slot of the packet's DTLS record, so that it need not be copied to
+ * be resent over CSTP.
+ */
+static uint8_t *tun_packet_buf(worker_st *ws, unsigned size)
+{
+	dtls_batch_st *b = ws->dtls_tptr.batch;
+
+	dtls_batch_reserve(ws, size);
+
+	if (b == NULL || !b->active || size + 8 > DTLS_BATCH_SLOT_SIZE)
+		return ws->buffer;
+
+	return b->plain[b->count];
 }
 
 int get_psk_key(gnutls_session_t session,
@@ -508,6 +684,10 @@ void exit_worker_reason(worker_st * ws, unsigned reason)
 	if (ws->ban_points > 0)
 		ws_add_score_to_ip(ws, 0, 1);
 
+	if (ws->cstp_drops > 0 || ws->dtls_tptr.drops > 0)
+		oclog(ws, LOG_INFO, "dropped %lu CSTP and %lu DTLS packets due to a full socket buffer",
+		      (unsigned long)ws->cstp_drops, (unsigned long)ws->dtls_tptr.drops);
+
 	talloc_free(ws->main_pool);
 	closelog();
 	_exit(1);
@@ -619,7 +799,7 @@ static int hello_hook_func(gnutls_session_t session, unsigned int htype,
 			      "client requested hostname: %s", (char*)ws->buffer);
 
 			ws->vhost = find_vhost(ws->vconfig, (char*)ws->buffer);
-			if (ws->vhost->name && c_strcasecmp(ws->vhost->name, (char*)ws->buffer) != 0) {
+			if (ws->vhost->name == NULL && (HAVE_VHOSTS(ws))) {
 				oclog(ws, LOG_INFO,
 				      "client requested hostname %s does not match known vhost", (char*)ws->buffer);
 			}
@@ -722,6 +902,7 @@ void vpn_server(struct worker_st *ws)
 	ocsignal(SIGALRM, handle_alarm);
 
 	global_ws = ws;
+	ws->metrics = worker_metrics_slot(getpid());
 	if (GETCONFIG(ws)->auth_timeout)
 		alarm(GETCONFIG(ws)->auth_timeout);
 
@@ -781,8 +962,7 @@ void vpn_server(struct worker_st *ws)
 #endif
 		}
 
-		gnutls_transport_set_ptr(session,
-				 (gnutls_transport_ptr_t) (long)ws->conn_fd);
+		cstp_set_transport(ws, session);
 
 		set_resume_db_funcs(session);
 		gnutls_db_set_ptr(session, ws);
@@ -922,15 +1102,47 @@ void vpn_server(struct worker_st *ws)
 	cstp_close(ws);
 }
 
+static
+void comp_stats_send(worker_st * ws)
+{
+	CompStatsMsg msg = COMP_STATS_MSG__INIT;
+	struct cmd_ring_msg_st rmsg;
+
+	if (ws->cmd_ring) {
+		memset(&rmsg, 0, sizeof(rmsg));
+		rmsg.cmd = CMD_COMP_STATS;
+		rmsg.m.comp.attempted = ws->comp_stats.attempted;
+		rmsg.m.comp.skipped = ws->comp_stats.skipped;
+		rmsg.m.comp.saved_bytes = ws->comp_stats.saved_bytes;
+		if (cmd_ring_put(ws->cmd_ring, ws->cmd_ring_efd, &rmsg) == 0)
+			return;
+	}
+
+	msg.attempted = ws->comp_stats.attempted;
+	msg.skipped = ws->comp_stats.skipped;
+	msg.saved_bytes = ws->comp_stats.saved_bytes;
+	send_msg_to_main(ws, CMD_COMP_STATS, &msg,
+			 (pack_size_func) comp_stats_msg__get_packed_size,
+			 (pack_func) comp_stats_msg__pack);
+}
+
 static
 void data_mtu_send(worker_st * ws, unsigned mtu)
 {
 	TunMtuMsg msg = TUN_MTU_MSG__INIT;
+	struct cmd_ring_msg_st rmsg;
 
 	msg.mtu = mtu;
-	send_msg_to_main(ws, CMD_TUN_MTU, &msg,
-			 (pack_size_func) tun_mtu_msg__get_packed_size,
-			 (pack_func) tun_mtu_msg__pack);
+
+	memset(&rmsg, 0, sizeof(rmsg));
+	rmsg.cmd = CMD_TUN_MTU;
+	rmsg.m.mtu = mtu;
+	if (ws->cmd_ring == NULL ||
+	    cmd_ring_put(ws->cmd_ring, ws->cmd_ring_efd, &rmsg) < 0) {
+		send_msg_to_main(ws, CMD_TUN_MTU, &msg,
+				 (pack_size_func) tun_mtu_msg__get_packed_size,
+				 (pack_func) tun_mtu_msg__pack);
+	}
 
 	oclog(ws, LOG_DEBUG, "setting data MTU to %u", msg.mtu);
 }
@@ -994,6 +1206,7 @@ void link_mtu_set(worker_st * ws, unsigned mtu)
 		return;
 
 	ws->link_mtu = mtu;
+	METRIC_ADD(ws->metrics, mtu_changes, 1);
 
 	oclog(ws, LOG_DEBUG, "setting connection link MTU to %u", mtu);
 	if (ws->dtls_session)
@@ -1222,6 +1435,10 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 		send_stats_to_secmod(ws, now, 0);
 	}
 
+	/* update main with the compression counters */
+	if (COMP_SELECTED(ws))
+		comp_stats_send(ws);
+
 	/* check DPD. Otherwise exit */
 	if (ws->udp_state == UP_ACTIVE &&
 	    now - ws->last_msg_udp > DPD_TRIES * dpd && dpd > 0) {
@@ -1235,6 +1452,7 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 
 		ret = dtls_send(ws, ws->buffer, data_mtu+1);
 		DTLS_FATAL_ERR_CMD(ret, exit_worker_reason(ws, REASON_ERROR));
+		METRIC_ADD(ws->metrics, dpd_sent, 1);
 
 		if (now - ws->last_msg_udp > DPD_MAX_TRIES * dpd) {
 			oclog(ws, LOG_ERR,
@@ -1257,10 +1475,12 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 
 		ret = cstp_send(ws, ws->buffer, 8);
 		CSTP_FATAL_ERR_CMD(ws, ret, exit_worker_reason(ws, REASON_ERROR));
+		METRIC_ADD(ws->metrics, dpd_sent, 1);
 
 		if (now - ws->last_msg_tcp > DPD_MAX_TRIES * dpd) {
 			oclog(ws, LOG_ERR,
 			      "have not received TCP DPD for very long; tearing down connection");
+			METRIC_ADD(ws->metrics, dpd_timeouts, 1);
 			exit_worker_reason(ws, REASON_DPD_TIMEOUT);
 		}
 	}
@@ -1495,39 +1715,48 @@ static int tls_mainloop(struct worker_st *ws, struct timespec *tnow)
 	return ret;
 }
 
-static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+/* Returns non-zero if the compression of the packet should be skipped */
+static unsigned comp_bypass(struct worker_st *ws, const uint8_t *pkt, int l,
+			    comp_flow_st **flow)
 {
-	int ret, l, e;
+	if (comp_bypass_check(ws->comp_bypass, pkt, l, flow) == 0) {
+		ws->comp_stats.skipped++;
+		return 1;
+	}
+	return 0;
+}
+
+static void comp_account(struct worker_st *ws, comp_flow_st *flow, int l, int ret)
+{
+	ws->comp_stats.attempted++;
+	if (ret > 0 && ret < l) {
+		ws->comp_stats.saved_bytes += l - ret;
+		METRIC_ADD(ws->metrics, comp_in_bytes, l);
+		METRIC_ADD(ws->metrics, comp_out_bytes, ret);
+	}
+
+	comp_bypass_update(flow, l, ret);
+}
+
+/* Sends a packet read from the tun device to the client. The packet
+ * of size @l is present at @buf + 8; the first 8 bytes of @buf are
+ * used for the CSTP or DTLS header.
+ */
+static int tun_send_to_client(struct worker_st *ws, uint8_t *buf, int l,
+			      struct timespec *tnow)
+{
+	int ret;
 	unsigned tls_retry;
 	int dtls_type = AC_PKT_DATA;
 	int cstp_type = AC_PKT_DATA;
 	gnutls_datum_t dtls_to_send;
 	gnutls_datum_t cstp_to_send;
+	comp_flow_st *flow;
 
-	l = tun_read(ws->tun_fd, ws->buffer + 8, DATA_MTU(ws, ws->link_mtu));
-	if (l < 0) {
-		e = errno;
-
-		if (e != EAGAIN && e != EINTR) {
-			oclog(ws, LOG_ERR,
-			      "received corrupt data from tun (%d): %s",
-			      l, strerror(e));
-			return -1;
-		}
-
-		return 0;
-	}
-
-	if (l == 0) {
-		oclog(ws, LOG_INFO, "TUN device returned zero");
-		return 0;
-	}
-
-
-	dtls_to_send.data = ws->buffer;
+	dtls_to_send.data = buf;
 	dtls_to_send.size = l;
 
-	cstp_to_send.data = ws->buffer;
+	cstp_to_send.data = buf;
 	cstp_to_send.size = l;
 
 	if (WSCONFIG(ws)->switch_to_tcp_timeout &&
@@ -1540,29 +1769,35 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 
 	if (ws->udp_state == UP_ACTIVE && ws->dtls_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
 		/* otherwise don't compress */
-		ret = ws->dtls_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
-		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
-		if (ret > 0 && ret < l) {
-			dtls_to_send.data = ws->decomp;
-			dtls_to_send.size = ret;
-			dtls_type = AC_PKT_COMPRESSED;
-
-			if (ws->cstp_selected_comp) {
-				if (ws->cstp_selected_comp->id == ws->dtls_selected_comp->id) {
-					cstp_to_send.data = ws->decomp;
-					cstp_to_send.size = ret;
-					cstp_type = AC_PKT_COMPRESSED;
+		if (comp_bypass(ws, buf+8, l, &flow) == 0) {
+			ret = ws->dtls_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, buf+8, l);
+			oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
+			comp_account(ws, flow, l, ret);
+			if (ret > 0 && ret < l) {
+				dtls_to_send.data = ws->decomp;
+				dtls_to_send.size = ret;
+				dtls_type = AC_PKT_COMPRESSED;
+
+				if (ws->cstp_selected_comp) {
+					if (ws->cstp_selected_comp->id == ws->dtls_selected_comp->id) {
+						cstp_to_send.data = ws->decomp;
+						cstp_to_send.size = ret;
+						cstp_type = AC_PKT_COMPRESSED;
+					}
 				}
 			}
 		}
 	} else if (ws->cstp_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
 		/* otherwise don't compress */
-		ret = ws->cstp_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
-		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
-		if (ret > 0 && ret < l) {
-			cstp_to_send.data = ws->decomp;
-			cstp_to_send.size = ret;
-			cstp_type = AC_PKT_COMPRESSED;
+		if (comp_bypass(ws, buf+8, l, &flow) == 0) {
+			ret = ws->cstp_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, buf+8, l);
+			oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
+			comp_account(ws, flow, l, ret);
+			if (ret > 0 && ret < l) {
+				cstp_to_send.data = ws->decomp;
+				cstp_to_send.size = ret;
+				cstp_type = AC_PKT_COMPRESSED;
+			}
 		}
 	}
 
@@ -1578,7 +1813,14 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 			ws->tun_bytes_out += dtls_to_send.size;
 
 			dtls_to_send.data[7] = dtls_type;
+			dtls_batch_reserve(ws, l);
+			if (ws->dtls_tptr.batch != NULL) {
+				ws->dtls_tptr.batch->cur = buf + 8;
+				ws->dtls_tptr.batch->cur_size = l;
+			}
 			ret = dtls_send(ws, dtls_to_send.data + 7, dtls_to_send.size + 1);
+			if (ws->dtls_tptr.batch != NULL)
+				ws->dtls_tptr.batch->cur = NULL;
 			DTLS_FATAL_ERR_CMD(ret, exit_worker_reason(ws, REASON_ERROR));
 
 			if (ret == GNUTLS_E_LARGE_PACKET) {
@@ -1587,13 +1829,22 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 				oclog(ws, LOG_TRANSFER_DEBUG,
 				      "retrying (TLS) %d\n", l);
 				tls_retry = 1;
-			} else if (ret >= 1+DATA_MTU(ws, ws->link_mtu) &&
-				   WSCONFIG(ws)->try_mtu != 0) {
-				mtu_ok(ws);
+			} else {
+				METRIC_ADD(ws->metrics, tx_packets, 1);
+				METRIC_ADD(ws->metrics, tx_bytes, l);
+				METRIC_ADD(ws->metrics, dtls_tx_packets, 1);
+
+				if (ret >= 1+DATA_MTU(ws, ws->link_mtu) &&
+				    WSCONFIG(ws)->try_mtu != 0)
+					mtu_ok(ws);
 			}
 		}
 
-		if (ws->udp_state != UP_ACTIVE || tls_retry != 0) {
+		if ((ws->udp_state != UP_ACTIVE || tls_retry != 0) &&
+		    ws->cstp_outq.size >= CSTP_OUTQ_LIMIT) {
+			/* the client does not keep up; drop instead of queuing */
+			ws->cstp_drops++;
+		} else if (ws->udp_state != UP_ACTIVE || tls_retry != 0) {
 			cstp_to_send.data[0] = 'S';
 			cstp_to_send.data[1] = 'T';
 			cstp_to_send.data[2] = 'F';
@@ -1607,11 +1858,180 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 
 			ret = cstp_send(ws, cstp_to_send.data, cstp_to_send.size + 8);
 			CSTP_FATAL_ERR_CMD(ws, ret, exit_worker_reason(ws, REASON_ERROR));
+
+			METRIC_ADD(ws->metrics, tx_packets, 1);
+			METRIC_ADD(ws->metrics, tx_bytes, l);
 		}
 		ws->last_nc_msg = tnow->tv_sec;
 	}
 
-	return 0;
+	return 1;
+}
+
+#ifdef ENABLE_TUN_OFFLOAD
+/* Reads a packet from a tun device which has offloads enabled. GSO
+ * super-packets are segmented here, prior to being encrypted. */
+static int tun_read_and_send_gso(struct worker_st *ws, struct timespec *tnow)
+{
+	struct virtio_net_hdr hdr;
+	tun_gso_st gso;
+	unsigned data_mtu = DATA_MTU(ws, ws->link_mtu);
+	uint8_t *buf;
+	int ret, l, e;
+
+	l = tun_read_vnet(ws->tun_fd, &hdr, ws->tun_gso_buf + 8, TUN_GSO_MAX_SIZE);
+	if (l < 0) {
+		e = errno;
+
+		if (e != EAGAIN && e != EINTR) {
+			oclog(ws, LOG_ERR,
+			      "received corrupt data from tun (%d): %s",
+			      l, strerror(e));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (l == 0) {
+		oclog(ws, LOG_INFO, "TUN device returned zero");
+		return 0;
+	}
+
+	if (hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (tun_csum_finish(&hdr, ws->tun_gso_buf + 8, l) < 0) {
+			oclog(ws, LOG_TRANSFER_DEBUG, "discarding packet with invalid checksum offsets");
+			return 1;
+		}
+
+		return tun_send_to_client(ws, ws->tun_gso_buf, l, tnow);
+	}
+
+	ret = tun_gso_init(&gso, &hdr, ws->tun_gso_buf + 8, l, data_mtu);
+	if (ret < 0) {
+		oclog(ws, LOG_TRANSFER_DEBUG, "discarding unsupported GSO packet (type: %u, size: %u)",
+		      (unsigned)hdr.gso_type, (unsigned)hdr.gso_size);
+		return 1;
+	}
+
+	oclog(ws, LOG_TRANSFER_DEBUG, "segmenting %d byte(s) to %u byte segments",
+	      l, gso.mss);
+
+	for (;;) {
+		buf = tun_packet_buf(ws, data_mtu);
+		ret = tun_gso_next(&gso, buf + 8, data_mtu);
+		if (ret <= 0)
+			break;
+
+		ret = tun_send_to_client(ws, buf, ret, tnow);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 1;
+}
+#endif
+
+/* Reads a single packet from the tun device and sends it to the client.
+ * Returns 1 if a packet was processed, 0 if none was available and
+ * a negative value on error.
+ */
+static int tun_read_and_send(struct worker_st *ws, struct timespec *tnow)
+{
+	unsigned data_mtu = DATA_MTU(ws, ws->link_mtu);
+	uint8_t *buf;
+	int l, e;
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (ws->tun_gso_buf != NULL)
+		return tun_read_and_send_gso(ws, tnow);
+#endif
+
+	buf = tun_packet_buf(ws, data_mtu);
+	l = tun_read(ws->tun_fd, buf + 8, data_mtu);
+	if (l < 0) {
+		e = errno;
+
+		if (e != EAGAIN && e != EINTR) {
+			oclog(ws, LOG_ERR,
+			      "received corrupt data from tun (%d): %s",
+			      l, strerror(e));
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (l == 0) {
+		oclog(ws, LOG_INFO, "TUN device returned zero");
+		return 0;
+	}
+
+	return tun_send_to_client(ws, buf, l, tnow);
+}
+
+/* Sends the pending data from the tun device. When tun-batch-size is
+ * set, up to that number of packets are drained on each call; the
+ * CSTP records are coalesced by corking the channel and the DTLS
+ * records are sent with a single sendmmsg().
+ */
+static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+{
+	dtls_batch_st *b = ws->dtls_tptr.batch;
+	unsigned i;
+	int ret, e;
+
+	if (b == NULL) {
+		ret = tun_read_and_send(ws, tnow);
+		return (ret < 0) ? ret : 0;
+	}
+
+	cstp_cork(ws);
+	b->active = 1;
+
+	for (i=0;i<b->max;i++) {
+		ret = tun_read_and_send(ws, tnow);
+		if (ret <= 0)
+			break;
+	}
+
+	b->active = 0;
+	if (dtls_batch_flush(&ws->dtls_tptr) < 0) {
+		e = errno;
+		oclog(ws, LOG_TRANSFER_DEBUG, "could not send DTLS batch: %s", strerror(e));
+	}
+
+	e = cstp_uncork(ws);
+	CSTP_FATAL_ERR_CMD(ws, e, exit_worker_reason(ws, REASON_ERROR));
+
+	return (ret < 0) ? ret : 0;
+}
+
+static void dtls_batch_init(worker_st *ws)
+{
+	dtls_batch_st *b;
+	unsigned max = GETCONFIG(ws)->tun_batch_size;
+
+	if (max <= 1)
+		return;
+
+	b = talloc_zero(ws, dtls_batch_st);
+	if (b == NULL)
+		return;
+
+	b->data = talloc_size(b, DTLS_BATCH_SLOT_SIZE * max);
+	b->size = talloc_array(b, size_t, max);
+	b->plain = talloc_size(b, DTLS_BATCH_SLOT_SIZE * max);
+	b->plain_size = talloc_array(b, size_t, max);
+	if (b->data == NULL || b->size == NULL ||
+	    b->plain == NULL || b->plain_size == NULL) {
+		oclog(ws, LOG_INFO, "could not allocate memory for tun batching");
+		talloc_free(b);
+		return;
+	}
+	b->max = max;
+
+	ws->dtls_tptr.batch = b;
 }
 
 static
@@ -1800,6 +2220,10 @@ static int connect_handler(worker_st * ws)
 
 	ws->buffer_size = sizeof(ws->buffer);
 
+	/* without TLS the frames are read in bulk */
+	if (ws->session == NULL)
+		cstp_inq_init(ws);
+
 	cookie_authenticate_or_exit(ws);
 
 	if (strcmp(req->url, "/CSCOSSLC/tunnel") != 0) {
@@ -2139,6 +2563,27 @@ static int connect_handler(worker_st * ws)
 	set_non_block(ws->conn_fd);
 	set_net_priority(ws, ws->conn_fd, ws->user_config->net_priority);
 
+	dtls_batch_init(ws);
+
+	if (COMP_SELECTED(ws) && WSCONFIG(ws)->adaptive_compression) {
+		ws->comp_bypass = talloc_zero(ws, comp_bypass_st);
+		if (ws->comp_bypass == NULL) {
+			oclog(ws, LOG_ERR, "could not allocate memory for compression");
+			exit_worker(ws);
+		}
+	}
+
+#ifdef ENABLE_TUN_OFFLOAD
+	if (GETCONFIG(ws)->tun_offload) {
+		/* the device was opened with a virtio-net header */
+		ws->tun_gso_buf = talloc_size(ws, TUN_GSO_MAX_SIZE + 8);
+		if (ws->tun_gso_buf == NULL) {
+			oclog(ws, LOG_ERR, "could not allocate memory for tun offload");
+			exit_worker(ws);
+		}
+	}
+#endif
+
 	if (ws->udp_state != UP_DISABLED) {
 
 		if (ws->user_config->dpd > 0) {
@@ -2291,7 +2736,7 @@ static int connect_handler(worker_st * ws)
 		if (ws->session != NULL)
 			tls_pending = gnutls_record_check_pending(ws->session);
 		else
-			tls_pending = 0;
+			tls_pending = cstp_inq_pending(ws);
 
 		if (ws->udp_state > UP_WAIT_FD) {
 			dtls_pending = dtls_pull_buffer_non_empty(&ws->dtls_tptr);
@@ -2310,6 +2755,8 @@ static int connect_handler(worker_st * ws)
 		if (tls_pending == 0 && dtls_pending == 0) {
 			pfd[0].fd = ws->conn_fd;
 			pfd[0].events = POLLIN;
+			if (ws->cstp_outq.size > 0)
+				pfd[0].events |= POLLOUT;
 
 			pfd[1].fd = ws->cmd_fd;
 			pfd[1].events = POLLIN;
@@ -2354,6 +2801,14 @@ static int connect_handler(worker_st * ws)
 			goto exit;
 		}
 
+		/* send the queued CSTP data */
+		if (pfd[0].revents & POLLOUT) {
+			if (cstp_outq_flush(ws) < 0) {
+				terminate_reason = REASON_ERROR;
+				goto exit;
+			}
+		}
+
 		/* send pending data from tun device */
 		if (pfd[2].revents & (POLLIN|POLLHUP)) {
 			ret = tun_mainloop(ws, &tnow);
@@ -2517,7 +2972,12 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 	case AC_PKT_DATA:
 		oclog(ws, LOG_TRANSFER_DEBUG, "writing %d byte(s) to TUN",
 		      (int)plain_size);
-		ret = tun_write(ws->tun_fd, plain, plain_size);
+#ifdef ENABLE_TUN_OFFLOAD
+		if (ws->tun_gso_buf != NULL)
+			ret = tun_write_vnet(ws->tun_fd, plain, plain_size);
+		else
+#endif
+			ret = tun_write(ws->tun_fd, plain, plain_size);
 		if (ret == -1) {
 			e = errno;
 			oclog(ws, LOG_ERR, "could not write data to tun: %s",
@@ -2527,6 +2987,11 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 		ws->tun_bytes_in += plain_size;
 		ws->last_nc_msg = now;
 
+		METRIC_ADD(ws->metrics, rx_packets, 1);
+		METRIC_ADD(ws->metrics, rx_bytes, plain_size);
+		if (is_dtls)
+			METRIC_ADD(ws->metrics, dtls_rx_packets, 1);
+
 		break;
 	default:
 		oclog(ws, LOG_DEBUG, "received unknown packet %u/size: %u",
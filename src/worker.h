@@ -37,6 +37,8 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 #include "vhost.h"
+#include <metrics.h>
+#include <cmd-ring.h>
 
 typedef enum {
 	UP_DISABLED,
@@ -152,16 +154,67 @@ struct http_req_st {
 	unsigned authorization_size;
 };
 
+/* The maximum size of a DTLS record which can be queued in a
+ * batch; larger records are sent directly. */
+#define DTLS_BATCH_SLOT_SIZE 2048
+
+/* Holds the DTLS records produced while draining the tun device,
+ * so that they can be sent using a single sendmmsg() */
+typedef struct dtls_batch_st {
+	unsigned active;
+	unsigned count;
+	unsigned max;
+	uint8_t (*data)[DTLS_BATCH_SLOT_SIZE];
+	size_t *size;
+	/* the tun packets are read into the slot of their record, so
+	 * that they can be resent over CSTP if the record is too large
+	 * for the path; the first 8 bytes are for the CSTP header */
+	uint8_t (*plain)[DTLS_BATCH_SLOT_SIZE];
+	size_t *plain_size; /* zero if the packet is not in its slot */
+	const uint8_t *cur; /* the packet being encrypted */
+	size_t cur_size;
+} dtls_batch_st;
+
 typedef struct dtls_transport_ptr {
 	int fd;
 	UdpFdMsg *msg; /* holds the data of the first client hello */
 	int consumed;
+	dtls_batch_st *batch; /* non-NULL when tun-batch-size is set */
+	uint64_t drops; /* records dropped because the socket was full */
 } dtls_transport_ptr;
 
+/* The number of bytes which may be queued on the CSTP channel
+ * while the socket is not writable. Once exceeded, packets from
+ * the tun device are dropped instead of being queued. */
+#define CSTP_OUTQ_LIMIT (256*1024)
+
+/* Holds the CSTP data which could not be sent without blocking */
+typedef struct cstp_outq_st {
+	uint8_t *data;
+	size_t off; /* the offset of the first unsent byte */
+	size_t size; /* the number of unsent bytes */
+	size_t alloc;
+} cstp_outq_st;
+
+/* Holds the data received on the CSTP channel when TLS is done by a
+ * proxy (listen-clear-file). It may contain several frames, and the
+ * start of an incomplete one. */
+typedef struct cstp_inq_st {
+	uint8_t *data;
+	size_t off; /* the offset of the first unread byte */
+	size_t size; /* the number of unread bytes */
+	size_t alloc;
+} cstp_inq_st;
+
+#define CSTP_INQ_SIZE (64*1024)
+
 /* Given a base MTU, this macro provides the DTLS plaintext data we can send;
  * the output value does not include the DTLS header */
 #define DATA_MTU(ws,mtu) (mtu-ws->dtls_crypto_overhead-ws->dtls_proto_overhead)
 
+/* non-zero if compression was negotiated on either channel */
+#define COMP_SELECTED(ws) (ws->cstp_selected_comp != NULL || ws->dtls_selected_comp != NULL)
+
 typedef struct worker_st {
 	gnutls_session_t session;
 	gnutls_session_t dtls_session;
@@ -177,6 +230,8 @@ typedef struct worker_st {
 	unsigned int sid_set;
 
 	int cmd_fd;
+	struct cmd_ring_st *cmd_ring; /* NULL unless worker-cmd-ring is set */
+	int cmd_ring_efd;
 	int conn_fd;
 	sock_type_t conn_type; /* AF_UNIX or something else */
 	
@@ -253,8 +308,23 @@ typedef struct worker_st {
 	uint8_t buffer[16*1024];
 	/* Buffer used for decompression */
 	uint8_t decomp[16*1024];
+	/* non-NULL when adaptive-compression is set */
+	struct comp_bypass_st *comp_bypass;
+	struct {
+		uint64_t attempted;
+		uint64_t skipped;
+		uint64_t saved_bytes;
+	} comp_stats;
 	unsigned buffer_size;
 
+	cstp_outq_st cstp_outq;
+	uint64_t cstp_drops; /* packets dropped because cstp_outq was full */
+	cstp_inq_st cstp_inq;
+	unsigned cstp_corked; /* without TLS; the data are only queued */
+
+	/* Buffer for GSO super-packets; set when tun-offload is enabled */
+	uint8_t *tun_gso_buf;
+
 	/* the following are set only if authentication is complete */
 
 	char username[MAX_USERNAME_SIZE];
@@ -280,6 +350,7 @@ typedef struct worker_st {
 	unsigned ban_points;
 
 	/* tun device stats */
+	struct worker_metrics_st *metrics; /* NULL if metrics are disabled */
 	uint64_t tun_bytes_in;
 	uint64_t tun_bytes_out;
 
@@ -56,6 +56,8 @@ int main()
 {
 	main_server_st *s = talloc(NULL, struct main_server_st);
 	vhost_cfg_st *vhost;
+	char txt[MAX_IP_STR];
+	unsigned i;
 
 	if (s == NULL)
 		exit(1);
@@ -88,8 +90,29 @@ int main()
 
 	add_str_ip_to_ban_list(s, "192.168.3.1", 40);
 
+	/* many entries with different scores */
+	for (i=0;i<1000;i++) {
+		snprintf(txt, sizeof(txt), "10.0.%u.%u", i/250, i%250);
+		add_str_ip_to_ban_list(s, txt, 1+i%30);
+	}
+
 	cleanup_banned_entries(s);
 
+	if (main_ban_db_elems(s) != 1003) {
+		fprintf(stderr, "error in %d: have %d entries\n", __LINE__, main_ban_db_elems(s));
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.0.0.19") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.0.0.18") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
 	if (check_if_banned_str(s, "192.168.1.1") == 0) {
 		fprintf(stderr, "error in %d\n", __LINE__);
 		exit(1);
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "../src/cmd-ring.c"
+
+/* Unit test for the worker command ring in cmd-ring.c. A child process
+ * sends many more messages than the ring holds, and the parent verifies
+ * that it receives all of them in order, sleeping on the eventfd
+ * whenever the ring is empty.
+ */
+
+#ifdef ENABLE_CMD_RING
+
+#define MSGS 100000
+
+int main(void)
+{
+	struct cmd_ring_st *ring;
+	struct cmd_ring_msg_st msg;
+	struct pollfd pfd;
+	unsigned i, expected = 0;
+	uint32_t tail = 0;
+	int efd, ret, status;
+	pid_t pid;
+
+	assert(cmd_ring_new(&ring, &efd) == 0);
+
+	/* an empty ring */
+	assert(cmd_ring_get(ring, &tail, &msg) == 0);
+	assert(cmd_ring_sleep(ring, efd, tail) == 0);
+
+	pid = fork();
+	assert(pid != -1);
+
+	if (pid == 0) {
+		for (i = 0; i < MSGS; i++) {
+			memset(&msg, 0, sizeof(msg));
+			msg.cmd = 11;
+			msg.m.mtu = i;
+			while (cmd_ring_put(ring, efd, &msg) < 0)
+				usleep(10);
+		}
+		exit(0);
+	}
+
+	while (expected < MSGS) {
+		while ((ret = cmd_ring_get(ring, &tail, &msg)) > 0) {
+			assert(msg.cmd == 11);
+			assert(msg.m.mtu == expected);
+			expected++;
+		}
+		assert(ret == 0);
+
+		if (expected == MSGS || cmd_ring_sleep(ring, efd, tail) != 0)
+			continue;
+
+		pfd.fd = efd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, 10000);
+		if (ret != 1) {
+			fprintf(stderr, "missed a wakeup after %u messages\n", expected);
+			exit(1);
+		}
+	}
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* the tail in the mapping is not used by main */
+	assert(ring->tail == tail);
+	ring->tail = tail - 1;
+	assert(cmd_ring_get(ring, &tail, &msg) == 0);
+
+	/* a corrupted head is detected */
+	ring->head = tail + CMD_RING_SIZE + 1;
+	assert(cmd_ring_get(ring, &tail, &msg) < 0);
+
+	cmd_ring_free(ring, efd);
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	exit(77);
+}
+
+#endif
@@ -28,7 +28,8 @@
 #include <gnutls/gnutls.h>
 
 /* Unit test for _cstp_recv_packet(). I checks whether
- * CSTP packets are received and decoded as expected.
+ * CSTP packets are received and decoded as expected, with
+ * and without the input queue.
  */
 static unsigned verbose = 0;
 #define UNDER_TEST
@@ -51,7 +52,7 @@ void writer(int fd)
 
 	memset(buf, 0, sizeof(buf));
 
-	for (i=0;i<ITERATIONS;i++) {
+	for (i=0;i<2*ITERATIONS;i++) {
 		assert(gnutls_rnd(GNUTLS_RND_NONCE, &size, sizeof(unsigned)) >= 0);
 
 		size %= MAX_SIZE;
@@ -59,6 +60,7 @@ void writer(int fd)
 
 		buf[4] = (size >> 8) & 0xff;
 		buf[5] = size & 0xff;
+		buf[8] = i & 0xff;
 
 		size += 8;
 
@@ -75,18 +77,43 @@ void receiver(int fd)
 {
 	worker_st ws;
 	unsigned char buf[MAX_SIZE*3];
+	unsigned char inq[MAX_SIZE*4];
+	gnutls_datum_t data;
+	void *packet = NULL;
 	int ret;
 	unsigned i;
 
 	memset(&ws, 0, sizeof(ws));
 	ws.conn_fd = fd;
+	ws.buffer_size = sizeof(ws.buffer);
 
 	for (i=0;i<ITERATIONS;i++) {
 		ret = _cstp_recv_packet(&ws, buf, sizeof(buf));
 		if (verbose)
 			fprintf(stderr, "received %d\n", ret);
-		assert(ret > 0);
+		assert(ret > 8);
+		assert(buf[8] == (i & 0xff));
+	}
+
+	/* the frames are read in bulk and split in the input queue */
+	ws.cstp_inq.data = inq;
+	ws.cstp_inq.alloc = sizeof(inq);
+
+	for (;i<2*ITERATIONS;i++) {
+		if (i % 2) {
+			ret = cstp_recv_packet(&ws, &data, &packet);
+			assert(ret > 8 && data.size == (unsigned)ret);
+			memcpy(buf, data.data, ret);
+		} else {
+			ret = _cstp_recv_packet(&ws, buf, sizeof(buf));
+		}
+		if (verbose)
+			fprintf(stderr, "received %d (queued)\n", ret);
+		assert(ret > 8);
+		assert(buf[8] == (i & 0xff));
+		assert(ret == 8 + ((buf[4] << 8) | buf[5]));
 	}
+	assert(cstp_inq_pending(&ws) == 0);
 
 	return;
 }
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "../src/ip-pool.c"
+
+/* Unit test for the lease bitmap in ip-pool.c. It checks that a
+ * network can be leased until it is exhausted, that the reserved
+ * addresses are never returned, and that released leases are found
+ * again by the next-fit search.
+ */
+
+static void check_ipv4(void)
+{
+	struct ip_pool_st *p;
+	struct in_addr net, addr;
+	uint32_t idx, idx2, i, n;
+	char buf[64];
+
+	inet_pton(AF_INET, "10.1.0.0", &net);
+	p = ip_pool_new(NULL, AF_INET, (uint8_t *)&net, 20, 32);
+	assert(p != NULL);
+	assert(p->size == 4096);
+	assert(p->reserved == 3);
+
+	/* a /20 has 4093 assignable addresses */
+	for (n=0;ip_pool_next(p, &idx) == 0;n++) {
+		assert(idx != 0 && idx != 1 && idx != 4095);
+		assert(ip_pool_is_used(p, idx) == 0);
+		ip_pool_mark(p, idx, 1);
+	}
+	assert(n == 4093);
+	assert(p->used == p->size);
+
+	/* a released lease is found again */
+	memcpy(&addr, &net, sizeof(addr));
+	inet_pton(AF_INET, "10.1.7.200", &addr);
+	assert(ip_pool_index(p, (uint8_t *)&addr, &idx) == 0);
+	assert(idx == 7*256+200);
+	ip_pool_mark(p, idx, 0);
+	assert(ip_pool_next(p, &idx2) == 0);
+	assert(idx2 == idx);
+
+	ip_pool_addr(p, idx2, (uint8_t *)&addr);
+	inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+	assert(strcmp(buf, "10.1.7.200") == 0);
+
+	/* the reserved addresses cannot be released */
+	for (i=0;i<p->size;i++)
+		ip_pool_mark(p, i, 0);
+	assert(p->used == p->reserved);
+	assert(ip_pool_is_used(p, 0) && ip_pool_is_used(p, 1) && ip_pool_is_used(p, 4095));
+
+	/* addresses outside the network */
+	inet_pton(AF_INET, "10.1.16.1", &addr);
+	assert(ip_pool_index(p, (uint8_t *)&addr, &idx) < 0);
+
+	talloc_free(p);
+
+	/* too large to track */
+	assert(ip_pool_new(NULL, AF_INET, (uint8_t *)&net, 4, 32) == NULL);
+}
+
+static void check_ipv6(void)
+{
+	struct ip_pool_st *p;
+	struct in6_addr net, addr;
+	uint32_t idx, n;
+	char buf[64];
+
+	inet_pton(AF_INET6, "fd00:1:2::", &net);
+	p = ip_pool_new(NULL, AF_INET6, (uint8_t *)&net, 56, 64);
+	assert(p != NULL);
+	assert(p->size == 256);
+	assert(p->reserved == 1);
+
+	for (n=0;ip_pool_next(p, &idx) == 0;n++) {
+		assert(idx != 0);
+		ip_pool_mark(p, idx, 1);
+	}
+	assert(n == 255);
+
+	/* the interface identifier is kept */
+	inet_pton(AF_INET6, "::1234", &addr);
+	ip_pool_addr(p, 0xab, (uint8_t *)&addr);
+	inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+	assert(strcmp(buf, "fd00:1:2:ab::1234") == 0);
+	assert(ip_pool_index(p, (uint8_t *)&addr, &idx) == 0);
+	assert(idx == 0xab);
+
+	talloc_free(p);
+
+	/* single addresses */
+	p = ip_pool_new(NULL, AF_INET6, (uint8_t *)&net, 120, 128);
+	assert(p != NULL);
+	assert(p->reserved == 2);
+	talloc_free(p);
+
+	assert(ip_pool_new(NULL, AF_INET6, (uint8_t *)&net, 48, 128) == NULL);
+}
+
+int main(void)
+{
+	check_ipv4();
+	check_ipv6();
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../src/lzs.c"
+
+/* Checks that the LZS compressor produces the same output when its
+ * context is reused across packets as when the hash table is cleared
+ * for every packet, and that the output decompresses to the input.
+ * The packet sizes are on both sides of LZS_RESET_LIMIT.
+ */
+
+#define PKT_SIZES 5
+
+static const unsigned pkt_sizes[PKT_SIZES] = { 64, 576, 1400, 9000, 3 };
+
+static unsigned char pkt[9000];
+static unsigned char comp[9000*2];
+static unsigned char comp2[9000*2];
+static unsigned char decomp[9000];
+
+/* a packet with an IP-like header and a partly repetitive payload */
+static void fill_packet(unsigned char *p, unsigned size, unsigned seed)
+{
+	static const char text[] = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+				   "Accept: text/html,application/xhtml+xml\r\n\r\n";
+	unsigned i;
+
+	srand(seed);
+	for (i=0;i<size;i++) {
+		if (i < 20 || (i % 97) < 11)
+			p[i] = rand() & 0xff;
+		else
+			p[i] = text[i % (sizeof(text)-1)];
+	}
+}
+
+static uint16_t table[LZS_HASH_TABLE_SIZE];
+
+/* the table is cleared on every packet */
+static int compress_with_clear(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+{
+	memset(table, 0xff, sizeof(table));
+	return _lzs_compress(table, dst, dstlen, src, srclen);
+}
+
+int main(void)
+{
+	static lzs_ctx_st ctx;
+	unsigned i, j, size;
+	int ret, ret2;
+
+	/* the sizes alternate, so that each packet follows one of
+	 * another size */
+	for (i=0;i<64;i++) {
+		for (j=0;j<PKT_SIZES;j++) {
+			size = pkt_sizes[(i+j) % PKT_SIZES];
+			fill_packet(pkt, size, i*PKT_SIZES+j);
+
+			ret = compress_with_clear(comp, sizeof(comp), pkt, size);
+			ret2 = lzs_compress_ctx(&ctx, comp2, sizeof(comp2), pkt, size);
+			assert(ret > 0);
+			assert(ret == ret2);
+			assert(memcmp(comp, comp2, ret) == 0);
+
+			ret = lzs_decompress(decomp, sizeof(decomp), comp2, ret2);
+			assert(ret == (int)size);
+			assert(memcmp(decomp, pkt, size) == 0);
+		}
+	}
+
+	/* the context must be left clean on errors too */
+	for (j=0;j<PKT_SIZES;j++) {
+		size = pkt_sizes[j];
+		if (size < 64) /* fits */
+			continue;
+		fill_packet(pkt, size, j);
+
+		ret = lzs_compress_ctx(&ctx, comp2, 8, pkt, size);
+		assert(ret == -EFBIG);
+		for (i=0;i<LZS_HASH_TABLE_SIZE;i++)
+			assert(ctx.hash_table[i] == INVALID_OFS);
+	}
+
+	return 0;
+}
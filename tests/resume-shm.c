@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "../src/resume-shm.c"
+
+/* Unit test for the shared TLS session resumption cache in
+ * resume-shm.c. Entries stored by a child process are visible to the
+ * parent, and are only returned for the same session ID, address and
+ * virtual host.
+ */
+
+#ifdef HAVE_LIBPTHREAD
+
+#define ENTRIES 64
+
+static void set_addr(struct sockaddr_storage *ss, const char *ip)
+{
+	struct sockaddr_in *sa = (void*)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	sa->sin_family = AF_INET;
+	assert(inet_pton(AF_INET, ip, &sa->sin_addr) == 1);
+}
+
+static void set_id(gnutls_datum_t *id, uint8_t buf[32], unsigned i)
+{
+	memset(buf, 0, 32);
+	memcpy(buf, &i, sizeof(i));
+	id->data = buf;
+	id->size = 32;
+}
+
+int main(void)
+{
+	struct sockaddr_storage addr, addr2;
+	uint8_t idbuf[32], databuf[512];
+	gnutls_datum_t id, data, out;
+	unsigned i, found;
+	int status, fds[2];
+	char c;
+	pid_t pid;
+
+	assert(resume_shm_enabled() == 0);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), NULL, 300, &out) < 0);
+
+	assert(resume_shm_init(ENTRIES) == 0);
+	assert(resume_shm_enabled() != 0);
+
+	set_addr(&addr, "192.168.1.1");
+	set_addr(&addr2, "192.168.1.2");
+	memset(databuf, 0xaa, sizeof(databuf));
+	data.data = databuf;
+	data.size = sizeof(databuf);
+
+	/* stored by another process */
+	pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		set_id(&id, idbuf, 1);
+		assert(resume_shm_store(&id, &addr, sizeof(struct sockaddr_in), "vhost1", &data) == 0);
+		exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	set_id(&id, idbuf, 1);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) == 0);
+	assert(out.size == data.size && memcmp(out.data, data.data, data.size) == 0);
+	gnutls_free(out.data);
+
+	/* the entry is bound to the address and virtual host */
+	assert(resume_shm_fetch(&id, &addr2, sizeof(struct sockaddr_in), "vhost1", 300, &out) < 0);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost2", 300, &out) < 0);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), NULL, 300, &out) < 0);
+
+	/* expired */
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", -1, &out) < 0);
+
+	/* a modified entry is not returned */
+	for (i = 0; i < sets_size * RESUME_SHM_WAYS; i++) {
+		struct resume_shm_entry_st *e = &sets[i / RESUME_SHM_WAYS].e[i % RESUME_SHM_WAYS];
+		if (e->used)
+			e->data[0] ^= 1;
+	}
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) < 0);
+
+	/* replaced, and deleted */
+	assert(resume_shm_store(&id, &addr, sizeof(struct sockaddr_in), "vhost1", &data) == 0);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) == 0);
+	gnutls_free(out.data);
+	resume_shm_delete(&id);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) < 0);
+
+	/* a set locked by another process is a cache miss; it is
+	 * usable again once that process exits */
+	assert(resume_shm_store(&id, &addr, sizeof(struct sockaddr_in), "vhost1", &data) == 0);
+	assert(pipe(fds) == 0);
+	pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		for (i = 0; i < sets_size; i++)
+			assert(pthread_mutex_lock(&sets[i].lock) == 0);
+		assert(write(fds[1], "x", 1) == 1);
+		pause();
+		exit(0);
+	}
+	assert(read(fds[0], &c, 1) == 1);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) < 0);
+	assert(resume_shm_store(&id, &addr, sizeof(struct sockaddr_in), "vhost1", &data) < 0);
+	kill(pid, SIGKILL);
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), "vhost1", 300, &out) == 0);
+	gnutls_free(out.data);
+	close(fds[0]);
+	close(fds[1]);
+
+	/* more entries than the cache holds; the last one is always there */
+	for (i = 0; i < ENTRIES * 8; i++) {
+		set_id(&id, idbuf, 1000+i);
+		assert(resume_shm_store(&id, &addr, sizeof(struct sockaddr_in), NULL, &data) == 0);
+		assert(resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), NULL, 300, &out) == 0);
+		gnutls_free(out.data);
+	}
+
+	found = 0;
+	for (i = 0; i < ENTRIES * 8; i++) {
+		set_id(&id, idbuf, 1000+i);
+		if (resume_shm_fetch(&id, &addr, sizeof(struct sockaddr_in), NULL, 300, &out) == 0) {
+			found++;
+			gnutls_free(out.data);
+		}
+	}
+	assert(found > 0 && found <= sets_size * RESUME_SHM_WAYS);
+
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	exit(77);
+}
+
+#endif
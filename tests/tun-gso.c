@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../src/tun-gso.c"
+
+/* Unit test for the GSO segmentation in tun-gso.c. It segments
+ * TCP super-packets and verifies the headers and checksums of
+ * the output segments.
+ */
+
+#ifdef ENABLE_TUN_OFFLOAD
+
+#define PAYLOAD_SIZE 3500
+#define MSS 1000
+
+static uint8_t pkt[60+PAYLOAD_SIZE];
+static uint8_t seg[2048];
+
+/* the ones' complement sum over a valid packet is zero */
+static void check_csum(const uint8_t *p, unsigned size, unsigned ipv4, unsigned l4_off)
+{
+	uint32_t sum = 0;
+
+	if (ipv4) {
+		assert(csum_fold(csum_add(0, p, l4_off)) == 0);
+		sum = csum_add(sum, p+12, 8);
+	} else {
+		sum = csum_add(sum, p+8, 32);
+	}
+	sum += IPPROTO_TCP;
+	sum += size - l4_off;
+	sum = csum_add(sum, p+l4_off, size - l4_off);
+
+	assert(csum_fold(sum) == 0);
+}
+
+static void check_segments(unsigned ipv4, unsigned max_seg_size, unsigned exp_mss)
+{
+	struct virtio_net_hdr hdr;
+	tun_gso_st st;
+	unsigned l4_off = ipv4?20:40;
+	unsigned total = l4_off + 20 + PAYLOAD_SIZE;
+	unsigned i, n = 0, payload = 0;
+	uint32_t seq;
+	int ret;
+
+	memset(pkt, 0, sizeof(pkt));
+	if (ipv4) {
+		pkt[0] = 0x45;
+		pkt[4] = 0x12; pkt[5] = 0x34; /* id */
+		pkt[8] = 64;
+		pkt[9] = IPPROTO_TCP;
+		memcpy(pkt+12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+	} else {
+		pkt[0] = 0x60;
+		pkt[6] = IPPROTO_TCP;
+		pkt[7] = 64;
+		pkt[8] = 0xfe; pkt[9] = 0x80; pkt[23] = 1;
+		pkt[24] = 0xfe; pkt[25] = 0x80; pkt[39] = 2;
+	}
+	pkt[l4_off+4] = 0x10; /* seq */
+	pkt[l4_off+12] = 5 << 4;
+	pkt[l4_off+13] = TCP_FLAG_PSH|TCP_FLAG_FIN|TCP_FLAG_CWR|0x10;
+	for (i=0;i<PAYLOAD_SIZE;i++)
+		pkt[l4_off+20+i] = i & 0xff;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	hdr.gso_type = ipv4?VIRTIO_NET_HDR_GSO_TCPV4:VIRTIO_NET_HDR_GSO_TCPV6;
+	hdr.gso_size = MSS;
+	hdr.csum_start = l4_off;
+	hdr.csum_offset = 16;
+
+	assert(tun_gso_init(&st, &hdr, pkt, total, max_seg_size) == 0);
+	assert(st.mss == exp_mss);
+
+	while ((ret = tun_gso_next(&st, seg, sizeof(seg))) > 0) {
+		unsigned seg_payload = ret - l4_off - 20;
+		unsigned last = (payload + seg_payload == PAYLOAD_SIZE);
+
+		assert(seg_payload <= exp_mss);
+		assert(memcmp(seg+l4_off+20, pkt+l4_off+20+payload, seg_payload) == 0);
+
+		if (ipv4) {
+			assert(((seg[2] << 8) | seg[3]) == ret);
+			assert(((seg[4] << 8) | seg[5]) == (int)(0x1234 + n));
+		} else {
+			assert(((seg[4] << 8) | seg[5]) == ret - 40);
+		}
+
+		memcpy(&seq, seg+l4_off+4, 4);
+		assert(ntohl(seq) == 0x10000000 + payload);
+
+		assert(!!(seg[l4_off+13] & TCP_FLAG_FIN) == last);
+		assert(!!(seg[l4_off+13] & TCP_FLAG_PSH) == last);
+		assert(!!(seg[l4_off+13] & TCP_FLAG_CWR) == (n == 0));
+
+		check_csum(seg, ret, ipv4, l4_off);
+
+		payload += seg_payload;
+		n++;
+	}
+
+	assert(ret == 0);
+	assert(payload == PAYLOAD_SIZE);
+	assert(n == (PAYLOAD_SIZE + exp_mss - 1) / exp_mss);
+}
+
+int main()
+{
+	check_segments(1, 1400, MSS);
+	check_segments(0, 1400, MSS);
+
+	/* the MSS is reduced when the segments do not fit the MTU */
+	check_segments(1, 840, 800);
+	check_segments(0, 860, 800);
+
+	return 0;
+}
+
+#else
+int main()
+{
+	exit(77);
+}
+#endif
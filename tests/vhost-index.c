@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../src/vhost.c"
+
+/* Unit test for the virtual host name index in vhost.c */
+
+static vhost_cfg_st *add(struct list_head *head, const char *name)
+{
+	vhost_cfg_st *vhost;
+
+	vhost = talloc_zero(NULL, struct vhost_cfg_st);
+	assert(vhost != NULL);
+	if (name)
+		vhost->name = talloc_strdup(vhost, name);
+
+	/* as in config.c the default vhost is the first added, and
+	 * the last on the list */
+	list_add(head, &vhost->list);
+	return vhost;
+}
+
+static void check(struct list_head *head, const char *name, vhost_cfg_st *expected)
+{
+	vhost_cfg_st *vhost = find_vhost(head, name);
+
+	if (vhost != expected) {
+		fprintf(stderr, "unexpected vhost for %s: %s\n", name, VHOSTNAME(vhost));
+		exit(1);
+	}
+}
+
+int main(void)
+{
+	struct list_head head;
+	vhost_cfg_st *def, *www2, *wild, *wild2, *longname;
+	char name[300];
+	unsigned pass;
+
+	list_head_init(&head);
+
+	def = add(&head, NULL);
+	add(&head, "www.example.com");
+	wild = add(&head, "*.example.com");
+	wild2 = add(&head, "*.vpn.example.com");
+
+	memset(name, 'a', sizeof(name));
+	memcpy(&name[sizeof(name)-13], ".example.org", 13);
+	longname = add(&head, name);
+
+	/* a case-insensitive duplicate; the first on the list wins */
+	www2 = add(&head, "WWW.example.com");
+
+	/* the list search, and then the index */
+	for (pass = 0; pass < 2; pass++) {
+		check(&head, NULL, def);
+		check(&head, "www.example.com", www2);
+		check(&head, "Www.Example.COM", www2);
+		check(&head, "example.org", def);
+		check(&head, "", def);
+		check(&head, name, longname);
+
+		if (pass == 0) {
+			vhost_index_build(&head);
+			assert(def->name_index != NULL);
+			continue;
+		}
+
+		/* wildcards are only used by the index, and the most
+		 * specific one is used */
+		check(&head, "mail.example.com", wild);
+		check(&head, "a.b.example.com", wild);
+		check(&head, "a.vpn.example.com", wild2);
+		check(&head, "A.VPN.Example.Com", wild2);
+		check(&head, "vpn.example.com", wild);
+		check(&head, "example.com", def);
+		check(&head, "www.example.com.", def);
+		check(&head, "wwwexample.com", def);
+	}
+
+	/* a rebuilt index replaces the previous */
+	vhost_index_build(&head);
+	check(&head, "mail.example.com", wild);
+
+	htable_clear(def->name_index);
+	return 0;
+}